@@ -0,0 +1,550 @@
+#include "batch.h"
+#include "instrument.h"
+#include "j2p.h"
+#include <boost\atomic.hpp>
+#include <fstream>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+
+ErrorCode readFile(const string& fileName, size_t probeBytes, vector<uint8_t>& data)
+{
+	ifstream file;
+	// straight into data, not through the buffer of the stream
+	file.rdbuf()->pubsetbuf(NULL, 0);
+	file.open(fileName, ios::binary);
+	if (!file)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	data.resize(probeBytes);
+	streamsize length = file.rdbuf()->sgetn((char*)data.data(), probeBytes);
+	if (length < (streamsize)probeBytes)
+	{
+		data.resize((size_t)length);
+		return SUCCESS;
+	}
+
+	// larger than the probe: the rest in a second read
+	streamoff end = file.rdbuf()->pubseekoff(0, ios::end, ios::in);
+	if (end < length || file.rdbuf()->pubseekpos(length, ios::in) != length)
+	{
+		return FILE_CANNOT_SEEK;
+	}
+	data.resize((size_t)end);
+	if (file.rdbuf()->sgetn((char*)data.data() + length, end - length) != end - length)
+	{
+		return FILE_CANNOT_READ;
+	}
+	return SUCCESS;
+}
+
+// readFile timed as a stage, an allocation failure fails just this file
+void readItem(BatchItem& item, size_t probeBytes)
+{
+	BJPEG_INSTRUMENT_SCOPE(instrument, STAGE_READ_FILE, -1);
+	try
+	{
+		item.error = readFile(item.fileName, probeBytes, item.data);
+	}
+	catch (const exception&)
+	{
+		item.error = FILE_CANNOT_READ;
+	}
+}
+
+ErrorCode parseFile(BatchItem& item)
+{
+	if (item.data.size() >= 2 && JpegAccess::VerifyReadUint16(item.data.data(), 0, J2KFile::MARKER_ID))
+	{
+		return item.file.loadBuffer(item.data.data(), item.data.size());
+	}
+	J2PFile container;
+	ErrorCode result = container.loadBuffer(item.data.data(), item.data.size());
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	// the tile data is handed over, not copied
+	J2KFile& codestream = container.codestream.editFile();
+	vector<TilePart> tiles;
+	tiles.swap(codestream.tiles);
+	item.file = codestream;
+	item.file.tiles.swap(tiles);
+	return SUCCESS;
+}
+
+#ifdef __linux__
+// Reads with io_uring: one thread keeps up to depth files in flight, where the
+// blocking readers need a thread for each. Every step goes through the ring, so
+// the open and the size lookup do not block the thread either: open, the probe
+// read, and when the probe is full statx and the read of the rest.
+class RingReader
+{
+	enum Step
+	{
+		STEP_OPEN,
+		STEP_READ,
+		STEP_SIZE
+	};
+
+	struct Read
+	{
+		BatchItemPtr item;
+		Step step;
+		int file;
+		uint64_t done;
+		bool sized;
+		struct statx status;
+		uint64_t started;
+	};
+
+	int ring;
+	void* rings;
+	size_t ringsLength;
+	io_uring_sqe* entries;
+	size_t entriesLength;
+	unsigned* submitTail;
+	unsigned* submitMask;
+	unsigned* submitArray;
+	unsigned* completeHead;
+	unsigned* completeTail;
+	unsigned* completeMask;
+	io_uring_cqe* completions;
+	unsigned depth;
+	size_t probeBytes;
+	// queued in the submission ring, not yet taken by the kernel
+	unsigned unsubmitted;
+	// set when io_uring_enter fails for good; the rest is read without the ring
+	bool broken;
+	std::vector<Read> reads;
+	std::vector<unsigned> idle;
+
+	io_uring_sqe& prepare(unsigned slot, uint8_t opcode)
+	{
+		unsigned tail = *submitTail;
+		unsigned index = tail & *submitMask;
+		io_uring_sqe& entry = entries[index];
+		memset(&entry, 0, sizeof(entry));
+		entry.opcode = opcode;
+		entry.user_data = slot;
+		submitArray[index] = index;
+		__atomic_store_n(submitTail, tail + 1, __ATOMIC_RELEASE);
+		unsubmitted++;
+		return entry;
+	}
+
+	void submitOpen(unsigned slot)
+	{
+		Read& read = reads[slot];
+		read.step = STEP_OPEN;
+		io_uring_sqe& entry = prepare(slot, IORING_OP_OPENAT);
+		entry.fd = AT_FDCWD;
+		entry.addr = (uint64_t)(size_t)read.item->fileName.c_str();
+		entry.open_flags = O_RDONLY | O_CLOEXEC;
+	}
+
+	void submitRead(unsigned slot)
+	{
+		Read& read = reads[slot];
+		read.step = STEP_READ;
+		io_uring_sqe& entry = prepare(slot, IORING_OP_READ);
+		entry.fd = read.file;
+		entry.off = read.done;
+		entry.addr = (uint64_t)(size_t)(read.item->data.data() + read.done);
+		entry.len = (uint32_t)min<uint64_t>(read.item->data.size() - read.done, 0x7FFFF000);
+	}
+
+	void submitSize(unsigned slot)
+	{
+		Read& read = reads[slot];
+		read.step = STEP_SIZE;
+		io_uring_sqe& entry = prepare(slot, IORING_OP_STATX);
+		entry.fd = read.file;
+		entry.addr = (uint64_t)(size_t)"";
+		entry.statx_flags = AT_EMPTY_PATH;
+		entry.len = STATX_SIZE;
+		entry.off = (uint64_t)(size_t)&read.status;
+	}
+
+	void finish(unsigned slot, ErrorCode error, BoundedQueue<BatchItemPtr>& queue)
+	{
+		Read& read = reads[slot];
+		if (read.file >= 0)
+		{
+			close(read.file);
+		}
+#ifdef BJPEG_INSTRUMENT
+		Instrumentation::stage(STAGE_READ_FILE, -1, read.started, Instrumentation::now());
+#endif
+		read.item->error = error;
+		BatchItemPtr item;
+		item.swap(read.item);
+		idle.push_back(slot);
+		queue.push(item);
+	}
+
+	void start(unsigned slot, const BatchItemPtr& item, BoundedQueue<BatchItemPtr>& queue)
+	{
+		Read& read = reads[slot];
+		idle.pop_back();
+		read.item = item;
+		read.file = -1;
+		read.done = 0;
+		read.sized = false;
+#ifdef BJPEG_INSTRUMENT
+		read.started = Instrumentation::now();
+#endif
+		try
+		{
+			item->data.resize(probeBytes);
+		}
+		catch (const exception&)
+		{
+			finish(slot, FILE_CANNOT_READ, queue);
+			return;
+		}
+		submitOpen(slot);
+	}
+
+	void complete(unsigned slot, int result, BoundedQueue<BatchItemPtr>& queue)
+	{
+		Read& read = reads[slot];
+		if (result == -EINTR || result == -EAGAIN)
+		{
+			read.step == STEP_OPEN ? submitOpen(slot) : read.step == STEP_READ ? submitRead(slot) : submitSize(slot);
+			return;
+		}
+		switch (read.step)
+		{
+			case STEP_OPEN:
+				if (result < 0)
+				{
+					finish(slot, FILE_CANNOT_OPEN, queue);
+					return;
+				}
+				read.file = result;
+				submitRead(slot);
+				return;
+			case STEP_SIZE:
+				if (result < 0 || read.status.stx_size < read.done)
+				{
+					finish(slot, FILE_CANNOT_SEEK, queue);
+					return;
+				}
+				read.sized = true;
+				if (read.status.stx_size == read.done)
+				{
+					finish(slot, SUCCESS, queue);
+					return;
+				}
+				try
+				{
+					read.item->data.resize((size_t)read.status.stx_size);
+				}
+				catch (const exception&)
+				{
+					finish(slot, FILE_CANNOT_READ, queue);
+					return;
+				}
+				submitRead(slot);
+				return;
+			case STEP_READ:
+				break;
+		}
+
+		vector<uint8_t>& data = read.item->data;
+		if (result < 0 || (result == 0 && read.sized))
+		{
+			finish(slot, FILE_CANNOT_READ, queue);
+			return;
+		}
+		read.done += result;
+		if (read.done < data.size())
+		{
+			if (read.sized)
+			{
+				submitRead(slot);
+			}
+			else
+			{
+				// smaller than the probe
+				data.resize((size_t)read.done);
+				finish(slot, SUCCESS, queue);
+			}
+			return;
+		}
+		if (read.sized)
+		{
+			finish(slot, SUCCESS, queue);
+			return;
+		}
+		// larger than the probe, or exactly its size
+		submitSize(slot);
+	}
+
+	// the files of what the ring holds and the kernel has not taken are read again
+	// without the ring
+	void withdraw(BoundedQueue<BatchItemPtr>& queue)
+	{
+		unsigned tail = *submitTail;
+		for (; unsubmitted > 0; unsubmitted--)
+		{
+			tail--;
+			unsigned slot = (unsigned)entries[tail & *submitMask].user_data;
+			Read& read = reads[slot];
+			if (read.file >= 0)
+			{
+				close(read.file);
+				read.file = -1;
+			}
+			readItem(*read.item, probeBytes);
+			BatchItemPtr item;
+			item.swap(read.item);
+			idle.push_back(slot);
+			queue.push(item);
+		}
+		__atomic_store_n(submitTail, tail, __ATOMIC_RELEASE);
+	}
+
+	void enter(BoundedQueue<BatchItemPtr>& queue)
+	{
+		// with nothing left to hand over, only the wait for a completion
+		unsigned inKernel = depth - (unsigned)idle.size() - unsubmitted;
+		long entered = syscall(__NR_io_uring_enter, ring, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (entered >= 0)
+		{
+			unsubmitted -= (unsigned)entered;
+			return;
+		}
+		switch (errno)
+		{
+			case EINTR:
+				return;
+			case EAGAIN:
+			case EBUSY:
+			case ENOMEM:
+				// out of resources until some reads complete
+				if (inKernel > 0)
+				{
+					syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+				}
+				else
+				{
+					boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+				}
+				return;
+		}
+		broken = true;
+		withdraw(queue);
+		if (inKernel > 0)
+		{
+			// completions are still posted, the wait just cannot go through enter
+			boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+		}
+	}
+
+public:
+	RingReader() : ring(-1), rings(MAP_FAILED), entries((io_uring_sqe*)MAP_FAILED), unsubmitted(0), broken(false) {}
+
+	~RingReader()
+	{
+		if (entries != MAP_FAILED)
+		{
+			munmap(entries, entriesLength);
+		}
+		if (rings != MAP_FAILED)
+		{
+			munmap(rings, ringsLength);
+		}
+		if (ring >= 0)
+		{
+			close(ring);
+		}
+	}
+
+	// false when io_uring or its OPENAT, STATX and READ (5.6) are not there
+	bool open(unsigned requestedDepth)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ring = (int)syscall(__NR_io_uring_setup, requestedDepth, &params);
+		if (ring < 0 || (params.features & IORING_FEAT_SINGLE_MMAP) == 0 || (params.features & IORING_FEAT_RW_CUR_POS) == 0)
+		{
+			return false;
+		}
+		ringsLength = max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+			params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+		rings = mmap(NULL, ringsLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+		entriesLength = params.sq_entries * sizeof(io_uring_sqe);
+		entries = (io_uring_sqe*)mmap(NULL, entriesLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+		if (rings == MAP_FAILED || entries == MAP_FAILED)
+		{
+			return false;
+		}
+		uint8_t* base = (uint8_t*)rings;
+		submitTail = (unsigned*)(base + params.sq_off.tail);
+		submitMask = (unsigned*)(base + params.sq_off.ring_mask);
+		submitArray = (unsigned*)(base + params.sq_off.array);
+		completeHead = (unsigned*)(base + params.cq_off.head);
+		completeTail = (unsigned*)(base + params.cq_off.tail);
+		completeMask = (unsigned*)(base + params.cq_off.ring_mask);
+		completions = (io_uring_cqe*)(base + params.cq_off.cqes);
+
+		// one entry per file in flight; the completion queue is twice as deep, so it
+		// cannot overflow
+		depth = params.sq_entries;
+		reads.resize(depth);
+		for (unsigned slot = depth; slot > 0; slot--)
+		{
+			idle.push_back(slot - 1);
+		}
+		return true;
+	}
+
+	void run(const vector<string>& fileNames, boost::atomic<size_t>& nextFile, size_t probeBytes, BoundedQueue<BatchItemPtr>& queue)
+	{
+		this->probeBytes = probeBytes;
+		size_t index = 0;
+		for (;;)
+		{
+			while (!idle.empty() && (index = nextFile++) < fileNames.size())
+			{
+				BatchItemPtr item(new BatchItem(index, fileNames[index]));
+				if (broken)
+				{
+					readItem(*item, probeBytes);
+					queue.push(item);
+					continue;
+				}
+				start(idle.back(), item, queue);
+			}
+			if (idle.size() == depth)
+			{
+				break;
+			}
+
+			if (!broken)
+			{
+				// hand over what is queued and wait for at least one completion
+				enter(queue);
+			}
+			else
+			{
+				boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+			}
+			unsigned head = *completeHead;
+			unsigned tail = __atomic_load_n(completeTail, __ATOMIC_ACQUIRE);
+			for (; head != tail; head++)
+			{
+				const io_uring_cqe& completion = completions[head & *completeMask];
+				complete((unsigned)completion.user_data, completion.res, queue);
+			}
+			__atomic_store_n(completeHead, head, __ATOMIC_RELEASE);
+			if (broken)
+			{
+				// the next steps of what just completed
+				withdraw(queue);
+			}
+		}
+	}
+};
+#endif
+
+}
+
+void BatchPipeline::run(const vector<string>& fileNames, const Consumer& consumer)
+{
+	BoundedQueue<BatchItemPtr> readQueue(options.queueCapacity);
+	BoundedQueue<BatchItemPtr> parsedQueue(options.queueCapacity);
+	boost::atomic<size_t> nextFile(0);
+	boost::atomic<unsigned> activeReaders(max(1u, options.readThreads));
+	boost::atomic<unsigned> activeParsers(max(1u, options.parseThreads));
+	boost::thread_group threads;
+
+#ifdef __linux__
+	shared_ptr<RingReader> ringReader(new RingReader());
+	if (ringReader->open(max(1u, options.readThreads)))
+	{
+		threads.create_thread([&]()
+		{
+			ringReader->run(fileNames, nextFile, options.probeBytes, readQueue);
+			readQueue.close();
+		});
+	}
+	else
+#endif
+	for (unsigned i = 0; i < max(1u, options.readThreads); i++)
+	{
+		threads.create_thread([&]()
+		{
+			size_t index;
+			while ((index = nextFile++) < fileNames.size())
+			{
+				BatchItemPtr item(new BatchItem(index, fileNames[index]));
+				readItem(*item, options.probeBytes);
+				readQueue.push(item);
+			}
+			if (--activeReaders == 0)
+			{
+				readQueue.close();
+			}
+		});
+	}
+
+	for (unsigned i = 0; i < max(1u, options.parseThreads); i++)
+	{
+		threads.create_thread([&]()
+		{
+			BatchItemPtr item;
+			while (readQueue.pop(item))
+			{
+				if (item->error == SUCCESS)
+				{
+					// out of memory for one large file fails just that file
+					try
+					{
+						item->error = parseFile(*item);
+					}
+					catch (const exception&)
+					{
+						item->error = BATCH_PARSE_FAILED;
+					}
+				}
+				// the parsed file owns copies of everything it needs
+				vector<uint8_t>().swap(item->data);
+				parsedQueue.push(item);
+			}
+			if (--activeParsers == 0)
+			{
+				parsedQueue.close();
+			}
+		});
+	}
+
+	for (unsigned i = 0; i < max(1u, options.computeThreads); i++)
+	{
+		threads.create_thread([&]()
+		{
+			BatchItemPtr item;
+			while (parsedQueue.pop(item))
+			{
+				consumer(*item);
+			}
+		});
+	}
+
+	threads.join_all();
+}
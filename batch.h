@@ -0,0 +1,131 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <boost\cstdint.hpp>
+#include <boost\thread.hpp>
+#include <functional>
+#include <deque>
+#include <string>
+#include <vector>
+#include <memory>
+#include "common.h"
+#include "j2k.h"
+
+namespace BJPEG
+{
+
+// Fixed-capacity FIFO between two pipeline stages. push() blocks while the queue
+// is full, which is what throttles a fast producer stage (backpressure).
+template<typename T>
+class BoundedQueue
+{
+	std::deque<T> items;
+	size_t capacity;
+	bool closed;
+	boost::mutex lock;
+	boost::condition_variable notFull;
+	boost::condition_variable notEmpty;
+
+public:
+	BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+	void push(const T& item)
+	{
+		boost::mutex::scoped_lock guard(lock);
+		while (items.size() >= capacity)
+		{
+			notFull.wait(guard);
+		}
+		items.push_back(item);
+		notEmpty.notify_one();
+	}
+
+	// false once the queue is closed and drained
+	bool pop(T& item)
+	{
+		boost::mutex::scoped_lock guard(lock);
+		while (items.empty() && !closed)
+		{
+			notEmpty.wait(guard);
+		}
+		if (items.empty())
+		{
+			return false;
+		}
+		item = items.front();
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		boost::mutex::scoped_lock guard(lock);
+		closed = true;
+		notEmpty.notify_all();
+	}
+};
+
+class BatchItem
+{
+public:
+	size_t index;
+	std::string fileName;
+	// contents of the file, released once it is parsed
+	std::vector<uint8_t> data;
+	ErrorCode error;
+	// the codestream, also of a JP2 file
+	J2KFile file;
+
+	BatchItem(size_t index, const std::string& fileName) : index(index), fileName(fileName), error(SUCCESS) {}
+};
+
+typedef std::shared_ptr<BatchItem> BatchItemPtr;
+
+class BatchOptions
+{
+public:
+	// every reader has one read outstanding, so this is the queue depth the storage
+	// sees; many small files on an SSD need a deep one to reach its IOPS. On Linux
+	// one thread keeps this many reads outstanding through io_uring instead
+	unsigned readThreads;
+	unsigned parseThreads;
+	unsigned computeThreads;
+	// files allowed to wait between two stages
+	size_t queueCapacity;
+	// first read of a file: a file up to this size is read by this one call, without
+	// asking for its size first
+	size_t probeBytes;
+
+	BatchOptions()
+	{
+		unsigned cores = boost::thread::hardware_concurrency();
+		readThreads = 16;
+		parseThreads = cores > 0 ? cores : 1;
+		computeThreads = cores > 0 ? cores : 1;
+		queueCapacity = 64;
+		probeBytes = 64 * 1024;
+	}
+};
+
+// Staged pipeline over many codestreams: read (whole file into memory) -> parse
+// (J2KFile::load, or J2PFile::load for JP2 files) -> compute (caller supplied). Each stage has its own threads and the stages are joined
+// by bounded queues, so I/O, parsing and computation of different files overlap.
+// The consumer is called once per file, in completion order, with item.error set
+// when the file could not be read or parsed.
+class BatchPipeline
+{
+public:
+	typedef std::function<void(BatchItem& item)> Consumer;
+
+	BatchPipeline(const BatchOptions& options = BatchOptions()) : options(options) {}
+
+	void run(const std::vector<std::string>& fileNames, const Consumer& consumer);
+
+private:
+	BatchOptions options;
+};
+
+}
+
+#endif /*_BATCH_H_*/
@@ -0,0 +1,369 @@
+#include "benchmark.h"
+#include "j2k.h"
+#include "j2p.h"
+#include "packets.h"
+#include <boost\chrono.hpp>
+#include <boost\thread.hpp>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+
+const uint64_t MAXIMUM_ITERATIONS = 1000000000;
+
+// keeps the results of measured calls alive
+volatile uint64_t sink;
+
+double cpuSeconds()
+{
+	boost::chrono::process_cpu_clock::times times = boost::chrono::process_cpu_clock::now().time_since_epoch().count();
+	return (times.user + times.system) * 1e-9;
+}
+
+string jsonString(const string& text)
+{
+	ostringstream result;
+	result << '"';
+	BOOST_FOREACH(char c, text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			result << '\\' << c;
+		}
+		else if ((unsigned char)c < 0x20)
+		{
+			result << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 0xF];
+		}
+		else
+		{
+			result << c;
+		}
+	}
+	result << '"';
+	return result.str();
+}
+
+bool hasPacketLengths(const J2KFile& file)
+{
+	BOOST_FOREACH(const TilePart& part, file.tiles)
+	{
+		BOOST_FOREACH(const J2KPartPtr& marker, part.markers)
+		{
+			if (marker->getMarker() == PacketLengthTilePartHeader::MARKER_ID)
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+}
+
+ErrorCode SyntheticCodestream::generate(const SyntheticOptions& options, vector<uint8_t>& bytes)
+{
+	uint32_t tileCount = (uint32_t)options.tilesWide * options.tilesHigh;
+	uint32_t packets = (uint32_t)options.layers * options.components * (options.decompositionLevels + 1);
+	if (tileCount == 0 || tileCount > 65535 || options.tileSize == 0 ||
+		(uint64_t)options.tileSize * max(options.tilesWide, options.tilesHigh) > 0xFFFFFFFF ||
+		options.components == 0 || options.components > 16384 || options.decompositionLevels > 32 ||
+		(options.tileSize >> options.decompositionLevels) == 0 || options.layers == 0 || options.packetBytes == 0 ||
+		options.partsPerTile == 0 || options.componentQccs > options.components ||
+		(uint64_t)packets * options.packetBytes > 0xF0000000)
+	{
+		return SYNTHETIC_INVALID_OPTIONS;
+	}
+
+	J2KFile file;
+	Header& header = file.header;
+	header.Csiz = options.components;
+	header.Lsiz = 38 + 3 * header.Csiz;
+	header.Rsiz = 0;
+	header.Xsiz = options.tilesWide * options.tileSize;
+	header.Ysiz = options.tilesHigh * options.tileSize;
+	header.XOsiz = 0;
+	header.YOsiz = 0;
+	header.XTsiz = options.tileSize;
+	header.YTsiz = options.tileSize;
+	header.XTOsiz = 0;
+	header.YTOsiz = 0;
+	for (uint16_t c = 0; c < options.components; c++)
+	{
+		ComponentHeader component;
+		component.Ssiz = 7;
+		component.XRsiz = 1;
+		component.YRsiz = 1;
+		header.Components.push_back(component);
+	}
+
+	CodingStyleDefault& cod = file.codingStyleDefault;
+	cod.Lcod = 12;
+	cod.Scod = 0;
+	cod.ProgressionOrder = 0;
+	cod.NumberOfLayers = options.layers;
+	cod.MultipleComponentTransformation = options.components >= 3 ? 1 : 0;
+	cod.NumberOfDecompositionLevels = options.decompositionLevels;
+	cod.CodeBlockWidth = 4;
+	cod.CodeBlockHeight = 4;
+	cod.CodeBlockStyle = 0;
+	cod.Transformation = 1;
+
+	// reversible, no quantisation: one exponent per sub-band
+	QuantizationDefaultParameter& qcd = file.quantizationDefaultParameter;
+	qcd.Sqcd = 2 << 5;
+	qcd.Raw.assign(3 * options.decompositionLevels + 1, 9 << 3);
+	qcd.Lqcd = (uint16_t)(3 + qcd.Raw.size());
+
+	for (uint16_t c = 0; c < options.componentQccs; c++)
+	{
+		QuantizationComponent qcc;
+		if (options.components >= 257)
+		{
+			qcc.Raw.push_back((uint8_t)(c >> 8));
+		}
+		qcc.Raw.push_back((uint8_t)c);
+		qcc.Raw.push_back(qcd.Sqcd);
+		qcc.Raw.insert(qcc.Raw.end(), qcd.Raw.begin(), qcd.Raw.end());
+		qcc.Lqcc = (uint16_t)(2 + qcc.Raw.size());
+		file.componentQccs.push_back(qcc);
+	}
+	for (uint16_t i = 0; i < options.comments; i++)
+	{
+		ostringstream text;
+		text << "synthetic codestream, comment " << i;
+		Comment comment;
+		comment.load(text.str());
+		file.comments.push_back(comment);
+	}
+
+	// filler without 0xFF, so no marker can be seen in it
+	vector<uint8_t> packet(options.packetBytes);
+	for (uint32_t i = 0; i < options.packetBytes; i++)
+	{
+		packet[i] = (uint8_t)(i * 37 % 0xFF);
+	}
+	for (uint32_t t = 0; t < tileCount; t++)
+	{
+		for (uint8_t p = 0; p < options.partsPerTile; p++)
+		{
+			uint32_t first = packets * p / options.partsPerTile;
+			uint32_t last = packets * (p + 1) / options.partsPerTile;
+			file.tiles.push_back(TilePart());
+			TilePart& part = file.tiles.back();
+			part.Isot = (uint16_t)t;
+			part.TPsot = p;
+			part.TNsot = options.partsPerTile;
+			part.Raw.reserve(2 + (size_t)(last - first) * options.packetBytes);
+			part.Raw.push_back(0xFF);
+			part.Raw.push_back(0x93);
+			for (uint32_t i = first; i < last; i++)
+			{
+				part.Raw.insert(part.Raw.end(), packet.begin(), packet.end());
+			}
+			if (!options.packetLengths)
+			{
+				continue;
+			}
+
+			shared_ptr<PacketLengthTilePartHeader> plt;
+			uint8_t index = 0;
+			for (uint32_t i = first; i < last; i++)
+			{
+				PacketLength length(options.packetBytes);
+				if (!plt || plt->size() + length.size() > 65537)
+				{
+					plt.reset(new PacketLengthTilePartHeader());
+					plt->Zplt = index++;
+					part.markers.push_back(plt);
+				}
+				plt->packetLengths.push_back(length);
+				plt->Lplt = (uint16_t)(plt->size() - 2);
+			}
+		}
+	}
+
+	ostringstream codestream;
+	file.save(codestream);
+	string data = codestream.str();
+	bytes.assign(data.begin(), data.end());
+	if (!options.wrapped)
+	{
+		return SUCCESS;
+	}
+	J2PFile jp2;
+	ErrorCode result = jp2.wrap(bytes.data(), bytes.size());
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	ostringstream wrapped;
+	jp2.save(wrapped);
+	data = wrapped.str();
+	bytes.assign(data.begin(), data.end());
+	return SUCCESS;
+}
+
+void BenchmarkSuite::measure(const string& name, uint64_t bytes, uint64_t tileParts, const function<ErrorCode()>& body)
+{
+	BenchmarkResult result;
+	result.name = name;
+	result.bytes = bytes;
+	result.tileParts = tileParts;
+	result.error = SUCCESS;
+
+	// grow the batch until it runs long enough, as Google Benchmark does
+	uint64_t iterations = 1;
+	for (;;)
+	{
+		boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+		double cpuStart = cpuSeconds();
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			result.error = body();
+			if (result.error != SUCCESS)
+			{
+				result.iterations = 0;
+				result.realSeconds = 0;
+				result.cpuSeconds = 0;
+				results.push_back(result);
+				return;
+			}
+		}
+		result.realSeconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+		result.cpuSeconds = cpuSeconds() - cpuStart;
+		result.iterations = iterations;
+		if (result.realSeconds >= minimumSeconds || iterations >= MAXIMUM_ITERATIONS)
+		{
+			break;
+		}
+		double factor = result.realSeconds > 0 ? minimumSeconds * 1.4 / result.realSeconds : 10;
+		iterations = min(MAXIMUM_ITERATIONS, max(iterations + 1, (uint64_t)(iterations * min(factor, 10.0))));
+	}
+	results.push_back(result);
+}
+
+void BenchmarkSuite::run(const string& input, const vector<uint8_t>& bytes)
+{
+	const uint8_t* codestream = bytes.data();
+	uint64_t length = bytes.size();
+
+	// a JP2 file is measured as a whole, then its codestream on its own
+	J2PFile jp2;
+	if (jp2.loadBuffer(bytes.data(), bytes.size()) == SUCCESS && jp2.codestream.payload != NULL)
+	{
+		measure("jp2_load/" + input, bytes.size(), jp2.codestream.file().tiles.size(), [&]() -> ErrorCode
+		{
+			J2PFile file;
+			return file.loadBuffer(bytes.data(), bytes.size());
+		});
+		codestream = jp2.codestream.payload;
+		length = jp2.codestream.payloadLength;
+	}
+
+	J2KFile file;
+	ErrorCode result = file.loadBuffer(codestream, length);
+	if (result != SUCCESS)
+	{
+		measure("load/" + input, length, 0, [=]() { return result; });
+		return;
+	}
+	uint64_t tileParts = file.tiles.size();
+
+	measure("load/" + input, length, tileParts, [&]() -> ErrorCode
+	{
+		J2KFile loaded;
+		return loaded.loadBuffer(codestream, length);
+	});
+
+	ostringstream stream;
+	measure("save/" + input, length, tileParts, [&]() -> ErrorCode
+	{
+		stream.seekp(0);
+		file.save(stream);
+		return stream ? SUCCESS : FILE_CANNOT_OPEN;
+	});
+
+	measure("size/" + input, length, tileParts, [&]() -> ErrorCode
+	{
+		sink += file.size();
+		return SUCCESS;
+	});
+
+	if (hasPacketLengths(file))
+	{
+		measure("plt_index/" + input, length, tileParts, [&]() -> ErrorCode
+		{
+			PacketIndex index;
+			ErrorCode result = index.build(file);
+			sink += index.tiles.size();
+			return result;
+		});
+	}
+}
+
+void BenchmarkSuite::runFile(const string& fileName)
+{
+	ifstream stream(fileName, ios::binary);
+	if (!stream)
+	{
+		measure("load/" + fileName, 0, 0, []() { return FILE_CANNOT_OPEN; });
+		return;
+	}
+	vector<uint8_t> bytes((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+	run(fileName, bytes);
+}
+
+void BenchmarkSuite::writeJson(ostream& stream, const string& executable) const
+{
+	char date[32];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+	ostringstream json;
+	json.precision(12);
+	json << "{\n";
+	json << "  \"context\": {\n";
+	json << "    \"date\": " << jsonString(date) << ",\n";
+	json << "    \"executable\": " << jsonString(executable) << ",\n";
+	json << "    \"num_cpus\": " << boost::thread::hardware_concurrency() << ",\n";
+#ifdef NDEBUG
+	json << "    \"library_build_type\": \"release\"\n";
+#else
+	json << "    \"library_build_type\": \"debug\"\n";
+#endif
+	json << "  },\n";
+	json << "  \"benchmarks\": [";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& result = results[i];
+		json << (i == 0 ? "\n" : ",\n") << "    {\n";
+		json << "      \"name\": " << jsonString(result.name) << ",\n";
+		json << "      \"run_name\": " << jsonString(result.name) << ",\n";
+		json << "      \"run_type\": \"iteration\",\n";
+		if (result.error != SUCCESS)
+		{
+			ostringstream message;
+			message << "error " << result.error;
+			json << "      \"error_occurred\": true,\n";
+			json << "      \"error_message\": " << jsonString(message.str()) << "\n";
+			json << "    }";
+			continue;
+		}
+		json << "      \"iterations\": " << result.iterations << ",\n";
+		json << "      \"real_time\": " << result.realSeconds * 1e9 / result.iterations << ",\n";
+		json << "      \"cpu_time\": " << result.cpuSeconds * 1e9 / result.iterations << ",\n";
+		json << "      \"time_unit\": \"ns\",\n";
+		double seconds = result.realSeconds > 0 ? result.realSeconds : 1e-9;
+		json << "      \"bytes_per_second\": " << result.bytes * result.iterations / seconds << ",\n";
+		json << "      \"items_per_second\": " << result.tileParts * result.iterations / seconds << "\n";
+		json << "    }";
+	}
+	json << "\n  ]\n}\n";
+	stream << json.str();
+}
@@ -0,0 +1,89 @@
+#ifndef _BENCHMARK_H_
+#define _BENCHMARK_H_
+
+#include <boost\cstdint.hpp>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "common.h"
+
+namespace BJPEG
+{
+
+// Shape of a generated codestream. The tile data is filler, but the marker segments
+// are consistent: PLT lengths match the packets of the progression and sum to the
+// data of their tile parts, so the packet index can be built from them.
+class SyntheticOptions
+{
+public:
+	uint16_t tilesWide;
+	uint16_t tilesHigh;
+	uint32_t tileSize;
+	uint16_t components;
+	uint8_t decompositionLevels;
+	// packets per tile: layers x components x (decompositionLevels + 1)
+	uint16_t layers;
+	uint32_t packetBytes;
+	// packets of a tile are spread evenly over its tile parts
+	uint8_t partsPerTile;
+	// PLT marker segments in every tile part
+	bool packetLengths;
+	uint16_t comments;
+	// QCC marker segments for the first components, at most components
+	uint16_t componentQccs;
+	// in a JP2 file instead of a bare codestream
+	bool wrapped;
+
+	SyntheticOptions() : tilesWide(4), tilesHigh(4), tileSize(256), components(3), decompositionLevels(5),
+		layers(4), packetBytes(256), partsPerTile(1), packetLengths(true), comments(1), componentQccs(0), wrapped(false)
+	{
+	}
+};
+
+class SyntheticCodestream
+{
+public:
+	static ErrorCode generate(const SyntheticOptions& options, std::vector<uint8_t>& bytes);
+};
+
+// One measurement, per iteration: bytes and tile parts processed.
+class BenchmarkResult
+{
+public:
+	std::string name;
+	uint64_t bytes;
+	uint64_t tileParts;
+	uint64_t iterations;
+	double realSeconds;
+	double cpuSeconds;
+	// the operation failed, nothing was measured
+	ErrorCode error;
+};
+
+// Throughput of J2KFile::load, save and size(), PacketIndex::build over PLT and
+// J2PFile::load on in-memory files. Each operation is repeated until it has run
+// for minimumSeconds; the results are written in the JSON format of Google
+// Benchmark, so its comparison tools can be used on them.
+class BenchmarkSuite
+{
+public:
+	double minimumSeconds;
+	std::vector<BenchmarkResult> results;
+
+	BenchmarkSuite() : minimumSeconds(0.5) {}
+
+	// Every operation that applies to the codestream or JP2 file in bytes.
+	void run(const std::string& input, const std::vector<uint8_t>& bytes);
+	void runFile(const std::string& fileName);
+
+	void writeJson(std::ostream& stream, const std::string& executable) const;
+
+private:
+	// body returns SUCCESS or stops the measurement with its error
+	void measure(const std::string& name, uint64_t bytes, uint64_t tileParts, const std::function<ErrorCode()>& body);
+};
+
+}
+
+#endif /*_BENCHMARK_H_*/
@@ -0,0 +1,59 @@
+#include <boost\foreach.hpp>
+#include <iostream>
+#include "benchmark.h"
+using namespace std;
+using namespace BJPEG;
+
+// Throughput of the synthetic codestreams and of the files given on the command line
+// (the sample images without any), as Google Benchmark JSON on stdout.
+int main(int argc, char* argv[])
+{
+	vector<string> fileNames(argv + 1, argv + argc);
+	if (fileNames.empty())
+	{
+		fileNames.push_back("img/Bretagne1.j2k");
+		fileNames.push_back("img/clone.j2k");
+	}
+
+	vector<pair<string, SyntheticOptions> > inputs;
+	SyntheticOptions options;
+	inputs.push_back(make_pair("synthetic/4x4", options));
+	options.tilesWide = 16;
+	options.tilesHigh = 16;
+	inputs.push_back(make_pair("synthetic/16x16", options));
+	options = SyntheticOptions();
+	options.partsPerTile = 8;
+	inputs.push_back(make_pair("synthetic/parts_8", options));
+	options = SyntheticOptions();
+	options.layers = 32;
+	options.packetBytes = 32;
+	inputs.push_back(make_pair("synthetic/dense_plt", options));
+	options.packetLengths = false;
+	inputs.push_back(make_pair("synthetic/no_plt", options));
+	options = SyntheticOptions();
+	options.comments = 64;
+	options.componentQccs = 3;
+	inputs.push_back(make_pair("synthetic/markers", options));
+	options = SyntheticOptions();
+	options.wrapped = true;
+	inputs.push_back(make_pair("synthetic/jp2", options));
+
+	BenchmarkSuite suite;
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		vector<uint8_t> bytes;
+		ErrorCode errorCode = SyntheticCodestream::generate(inputs[i].second, bytes);
+		if (errorCode != SUCCESS)
+		{
+			cerr << inputs[i].first << ": error " << errorCode << endl;
+			return 1;
+		}
+		suite.run(inputs[i].first, bytes);
+	}
+	BOOST_FOREACH(const string& fileName, fileNames)
+	{
+		suite.runFile(fileName);
+	}
+	suite.writeJson(cout, argv[0]);
+	return 0;
+}
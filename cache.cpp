@@ -0,0 +1,195 @@
+#include "cache.h"
+#include <algorithm>
+
+using namespace std;
+using namespace BJPEG;
+
+size_t TileKey::hash() const
+{
+	size_t result = std::hash<string>()(fileName);
+	result = result * 31 + tile;
+	result = result * 31 + reduce;
+	result = result * 31 + layers;
+	for (size_t i = 0; i < components.size(); i++)
+	{
+		result = result * 3 + (components[i] ? 1 : 2);
+	}
+	return result;
+}
+
+TileCache::TileCache(uint64_t budget, unsigned shardCount)
+	: budget(budget), bytes(0), clock(0), hits(0), misses(0), evictions(0), coalesced(0)
+{
+	if (shardCount == 0)
+	{
+		shardCount = max(1u, boost::thread::hardware_concurrency());
+	}
+	for (unsigned i = 0; i < shardCount; i++)
+	{
+		shards.push_back(shared_ptr<Shard>(new Shard()));
+	}
+}
+
+TileCache::Shard& TileCache::shardOf(const TileKey& key)
+{
+	// the shard's own map uses the low bits
+	size_t hash = key.hash();
+	return *shards[(hash ^ (hash >> 17)) % shards.size()];
+}
+
+void TileCache::insert(Shard& shard, const TileKey& key, const TileBuffer& buffer)
+{
+	uint64_t size = buffer ? buffer->size() : 0;
+	if (size > budget || shard.lookup.count(key) != 0)
+	{
+		return;
+	}
+	shard.entries.push_front(Entry(key, buffer, clock++));
+	shard.lookup[key] = shard.entries.begin();
+	shard.bytes += size;
+	bytes += size;
+}
+
+void TileCache::evict()
+{
+	while (bytes > budget)
+	{
+		// every shard has its least recently used tile at the back
+		shared_ptr<Shard> oldest;
+		uint64_t oldestUsed = 0;
+		BOOST_FOREACH(const shared_ptr<Shard>& shard, shards)
+		{
+			boost::mutex::scoped_lock guard(shard->lock);
+			if (!shard->entries.empty() && (!oldest || shard->entries.back().used < oldestUsed))
+			{
+				oldest = shard;
+				oldestUsed = shard->entries.back().used;
+			}
+		}
+		if (!oldest)
+		{
+			return;
+		}
+
+		// unless it was used or evicted in the meantime, then look again
+		boost::mutex::scoped_lock guard(oldest->lock);
+		if (!oldest->entries.empty() && oldest->entries.back().used == oldestUsed)
+		{
+			const Entry& last = oldest->entries.back();
+			uint64_t size = last.buffer ? last.buffer->size() : 0;
+			oldest->bytes -= size;
+			bytes -= size;
+			oldest->lookup.erase(last.key);
+			oldest->entries.pop_back();
+			evictions++;
+		}
+	}
+}
+
+ErrorCode TileCache::get(const TileKey& key, const Decoder& decode, TileBuffer& buffer)
+{
+	Shard& shard = shardOf(key);
+	shared_ptr<Pending> pending;
+	bool owner = false;
+	{
+		boost::mutex::scoped_lock guard(shard.lock);
+		unordered_map<TileKey, Entries::iterator, TileKeyHash>::iterator found = shard.lookup.find(key);
+		if (found != shard.lookup.end())
+		{
+			shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+			found->second->used = clock++;
+			buffer = found->second->buffer;
+			hits++;
+			return SUCCESS;
+		}
+		misses++;
+		shared_ptr<Pending>& slot = shard.pending[key];
+		if (!slot)
+		{
+			slot.reset(new Pending());
+			owner = true;
+		}
+		pending = slot;
+	}
+
+	if (!owner)
+	{
+		coalesced++;
+		boost::mutex::scoped_lock guard(pending->lock);
+		while (!pending->done)
+		{
+			pending->finished.wait(guard);
+		}
+		buffer = pending->buffer;
+		return pending->result;
+	}
+
+	// decoded outside of the shard lock, other tiles of the shard stay available
+	TileBuffer decoded;
+	ErrorCode result;
+	try
+	{
+		result = decode(decoded);
+	}
+	catch (...)
+	{
+		complete(shard, key, *pending, CACHE_DECODER_FAILED, TileBuffer());
+		throw;
+	}
+	complete(shard, key, *pending, result, decoded);
+	buffer = decoded;
+	return result;
+}
+
+void TileCache::complete(Shard& shard, const TileKey& key, Pending& pending, ErrorCode result, const TileBuffer& buffer)
+{
+	{
+		boost::mutex::scoped_lock guard(shard.lock);
+		if (result == SUCCESS)
+		{
+			insert(shard, key, buffer);
+		}
+		shard.pending.erase(key);
+	}
+	evict();
+	{
+		boost::mutex::scoped_lock guard(pending.lock);
+		pending.buffer = buffer;
+		pending.result = result;
+		pending.done = true;
+	}
+	pending.finished.notify_all();
+}
+
+void TileCache::erase(const TileKey& key)
+{
+	Shard& shard = shardOf(key);
+	boost::mutex::scoped_lock guard(shard.lock);
+	unordered_map<TileKey, Entries::iterator, TileKeyHash>::iterator found = shard.lookup.find(key);
+	if (found != shard.lookup.end())
+	{
+		uint64_t size = found->second->buffer ? found->second->buffer->size() : 0;
+		shard.bytes -= size;
+		bytes -= size;
+		shard.entries.erase(found->second);
+		shard.lookup.erase(found);
+	}
+}
+
+void TileCache::clear()
+{
+	BOOST_FOREACH(const shared_ptr<Shard>& shard, shards)
+	{
+		boost::mutex::scoped_lock guard(shard->lock);
+		bytes -= shard->bytes;
+		shard->entries.clear();
+		shard->lookup.clear();
+		shard->bytes = 0;
+	}
+}
+
+TileCacheStatistics TileCache::statistics() const
+{
+	TileCacheStatistics result = { hits, misses, evictions, coalesced, bytes };
+	return result;
+}
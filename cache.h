@@ -0,0 +1,146 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <boost\cstdint.hpp>
+#include <boost\thread.hpp>
+#include <boost\atomic.hpp>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "common.h"
+#include "j2k.h"
+
+namespace BJPEG
+{
+
+// What was decoded: the tile of a file (TilePart::Isot) at a resolution
+// reduction, for a set of components, up to a number of quality layers.
+class TileKey
+{
+public:
+	std::string fileName;
+	uint16_t tile;
+	uint8_t reduce;
+	ComponentMask components;
+	uint16_t layers;
+
+	TileKey() : tile(0), reduce(0), layers(0) {}
+
+	bool operator==(const TileKey& other) const
+	{
+		return tile == other.tile && reduce == other.reduce && layers == other.layers &&
+			components == other.components && fileName == other.fileName;
+	}
+
+	size_t hash() const;
+};
+
+class TileKeyHash
+{
+public:
+	size_t operator()(const TileKey& key) const
+	{
+		return key.hash();
+	}
+};
+
+typedef std::shared_ptr<const std::vector<uint8_t> > TileBuffer;
+
+class TileCacheStatistics
+{
+public:
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	// misses served by a decode another thread had already started
+	uint64_t coalesced;
+	uint64_t bytes;
+};
+
+// Decoded tiles for a tile server, kept within a byte budget. The keys are spread
+// over shards with a lock and an LRU list each, so lookups of different tiles
+// rarely contend; the budget is shared, and going over it evicts the least
+// recently used tile of whichever shard holds it. Concurrent misses on one tile
+// run its decoder once, the other callers wait for that result. A buffer larger
+// than the whole budget is handed out but not kept.
+class TileCache
+{
+	class Pending
+	{
+	public:
+		boost::mutex lock;
+		boost::condition_variable finished;
+		bool done;
+		ErrorCode result;
+		TileBuffer buffer;
+
+		Pending() : done(false), result(SUCCESS) {}
+	};
+
+	class Entry
+	{
+	public:
+		TileKey key;
+		TileBuffer buffer;
+		// tick of the last get(), comparable across shards
+		uint64_t used;
+
+		Entry(const TileKey& key, const TileBuffer& buffer, uint64_t used) : key(key), buffer(buffer), used(used) {}
+	};
+
+	typedef std::list<Entry> Entries;
+
+	class Shard
+	{
+	public:
+		boost::mutex lock;
+		// most recently used first
+		Entries entries;
+		std::unordered_map<TileKey, Entries::iterator, TileKeyHash> lookup;
+		std::unordered_map<TileKey, std::shared_ptr<Pending>, TileKeyHash> pending;
+		uint64_t bytes;
+
+		Shard() : bytes(0) {}
+	};
+
+	std::vector<std::shared_ptr<Shard> > shards;
+	uint64_t budget;
+	// of all shards
+	boost::atomic<uint64_t> bytes;
+	boost::atomic<uint64_t> clock;
+	boost::atomic<uint64_t> hits;
+	boost::atomic<uint64_t> misses;
+	boost::atomic<uint64_t> evictions;
+	boost::atomic<uint64_t> coalesced;
+
+	Shard& shardOf(const TileKey& key);
+	void insert(Shard& shard, const TileKey& key, const TileBuffer& buffer);
+	// drops least recently used tiles until the shards are back within the budget;
+	// takes one shard lock at a time, so no shard lock may be held
+	void evict();
+	// hands the result of a decode to the waiters of key, which is no longer pending
+	void complete(Shard& shard, const TileKey& key, Pending& pending, ErrorCode result, const TileBuffer& buffer);
+
+public:
+	typedef std::function<ErrorCode(TileBuffer& buffer)> Decoder;
+
+	// shardCount == 0 picks one per hardware thread
+	explicit TileCache(uint64_t budget, unsigned shardCount = 0);
+
+	// The cached buffer of key, otherwise decode() fills it and it is cached
+	// unless decode() failed. When decode() throws, the exception reaches its
+	// caller and the callers waiting on it get CACHE_DECODER_FAILED.
+	ErrorCode get(const TileKey& key, const Decoder& decode, TileBuffer& buffer);
+
+	void erase(const TileKey& key);
+	void clear();
+
+	TileCacheStatistics statistics() const;
+};
+
+}
+
+#endif /*_CACHE_H_*/
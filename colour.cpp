@@ -0,0 +1,499 @@
+#include "colour.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define BJPEG_SSE2
+#endif
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	const uint32_t SIGNATURE = 0x61637370;
+	const uint32_t XYZ = 0x58595A20;
+	const uint32_t CURVE = 0x63757276;
+	const uint32_t PARAMETRIC_CURVE = 0x70617261;
+	// rXYZ, gXYZ, bXYZ, rTRC, gTRC, bTRC, kTRC
+	const uint32_t TAGS[7] = { 0x7258595A, 0x6758595A, 0x6258595A, 0x72545243, 0x67545243, 0x62545243, 0x6B545243 };
+	const int PARAMETER_COUNTS[5] = { 1, 3, 4, 5, 7 };
+
+	// PCS XYZ (D50) to linear sRGB, Bradford adapted
+	const double SRGB[3][3] =
+	{
+		{ 3.1338561, -1.6168667, -0.4906146 },
+		{ -0.9787684, 1.9161415, 0.0334540 },
+		{ 0.0719453, -0.2289914, 1.4052427 }
+	};
+
+	inline double readFixed(const uint8_t* buffer, int offset)
+	{
+		return (int32_t)JpegAccess::ReadUint32(buffer, offset) / 65536.0;
+	}
+
+	inline double encodeSrgb(double linear)
+	{
+		linear = min(max(linear, 0.0), 1.0);
+		return linear <= 0.0031308 ? 12.92 * linear : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+	}
+
+	const J2PPart* findBox(const J2PHeader& header, uint32_t markerId)
+	{
+		BOOST_FOREACH(const J2PPartPtr& box, header.boxes)
+		{
+			if (box->getMarker() == markerId)
+			{
+				return box.get();
+			}
+		}
+		return NULL;
+	}
+}
+
+ErrorCode ToneCurve::load(const uint8_t* buffer, uint32_t length)
+{
+	if (length < 12)
+	{
+		return ICC_PROFILE_INVALID;
+	}
+	uint32_t type = JpegAccess::ReadUint32(buffer, 0);
+	if (type == CURVE)
+	{
+		uint32_t count = JpegAccess::ReadUint32(buffer, 8);
+		if (length < 12 + 2 * (uint64_t)count)
+		{
+			return ICC_PROFILE_INVALID;
+		}
+		function = -1;
+		table.clear();
+		if (count == 1)
+		{
+			// u8Fixed8 gamma
+			function = 0;
+			parameters[0] = JpegAccess::ReadUint16(buffer, 12) / 256.0;
+			return SUCCESS;
+		}
+		for (uint32_t i = 0; i < count; i++)
+		{
+			table.push_back(JpegAccess::ReadUint16(buffer, 12 + 2 * i));
+		}
+		return SUCCESS;
+	}
+	if (type != PARAMETRIC_CURVE)
+	{
+		return ICC_PROFILE_UNSUPPORTED;
+	}
+	function = JpegAccess::ReadUint16(buffer, 8);
+	if (function > 4)
+	{
+		return ICC_PROFILE_UNSUPPORTED;
+	}
+	if (length < 12u + 4 * PARAMETER_COUNTS[function])
+	{
+		return ICC_PROFILE_INVALID;
+	}
+	for (int i = 0; i < PARAMETER_COUNTS[function]; i++)
+	{
+		parameters[i] = readFixed(buffer, 12 + 4 * i);
+	}
+	return SUCCESS;
+}
+
+double ToneCurve::evaluate(double x) const
+{
+	if (function < 0)
+	{
+		if (table.empty())
+		{
+			return x;
+		}
+		double position = x * (table.size() - 1);
+		size_t i = min((size_t)position, table.size() - 2);
+		double fraction = position - i;
+		return (table[i] * (1 - fraction) + table[i + 1] * fraction) / 65535;
+	}
+	// g, a, b, c, d, e, f
+	const double* p = parameters;
+	double base = function == 0 ? x : p[1] * x + p[2];
+	switch (function)
+	{
+		case 0:
+			return pow(x, p[0]);
+		case 1:
+			return base >= 0 ? pow(base, p[0]) : 0;
+		case 2:
+			return (base >= 0 ? pow(base, p[0]) : 0) + p[3];
+		case 3:
+			return x >= p[4] ? pow(max(base, 0.0), p[0]) : p[3] * x;
+		default:
+			return x >= p[4] ? pow(max(base, 0.0), p[0]) + p[5] : p[3] * x + p[6];
+	}
+}
+
+ErrorCode IccProfile::load(const uint8_t* buffer, uint32_t length)
+{
+	if (length < 132 || JpegAccess::ReadUint32(buffer, 0) > length || JpegAccess::ReadUint32(buffer, 36) != SIGNATURE)
+	{
+		return ICC_PROFILE_INVALID;
+	}
+	colourSpace = JpegAccess::ReadUint32(buffer, 16);
+	if ((colourSpace != RGB && colourSpace != GRAY) || JpegAccess::ReadUint32(buffer, 20) != XYZ)
+	{
+		return ICC_PROFILE_UNSUPPORTED;
+	}
+	uint32_t count = JpegAccess::ReadUint32(buffer, 128);
+	if (132 + 12 * (uint64_t)count > length)
+	{
+		return ICC_PROFILE_INVALID;
+	}
+
+	int found = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		int entry = 132 + 12 * i;
+		uint32_t signature = JpegAccess::ReadUint32(buffer, entry);
+		uint32_t offset = JpegAccess::ReadUint32(buffer, entry + 4);
+		uint32_t size = JpegAccess::ReadUint32(buffer, entry + 8);
+		int tag = (int)(find(TAGS, TAGS + 7, signature) - TAGS);
+		if (tag == 7)
+		{
+			continue;
+		}
+		if ((uint64_t)offset + size > length)
+		{
+			return ICC_PROFILE_INVALID;
+		}
+		if (tag < 3)
+		{
+			if (size < 20 || JpegAccess::ReadUint32(buffer, offset) != XYZ)
+			{
+				return ICC_PROFILE_INVALID;
+			}
+			for (int row = 0; row < 3; row++)
+			{
+				colorants[row][tag] = readFixed(buffer, offset + 8 + 4 * row);
+			}
+		}
+		else
+		{
+			ErrorCode result = curves[tag == 6 ? 0 : tag - 3].load(buffer + offset, size);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+		}
+		found |= 1 << tag;
+	}
+	bool complete = colourSpace == GRAY ? (found & 0x40) != 0 : (found & 0x3F) == 0x3F;
+	return complete ? SUCCESS : ICC_PROFILE_UNSUPPORTED;
+}
+
+ErrorCode ColourTransform::build(const IccProfile& profile, uint16_t maxValue)
+{
+	if (maxValue == 0)
+	{
+		return ICC_PROFILE_UNSUPPORTED;
+	}
+	this->maxValue = maxValue;
+	components = profile.channels();
+	// the sRGB curve rises 12.92 times as fast as linear light near black, 16 table
+	// entries per output code keep the darkest codes apart
+	outputSteps = max(1 << 14, 16 * (maxValue + 1));
+
+	if (components == 1)
+	{
+		// grey to grey folds into a single table
+		outputTable.resize(maxValue + 1);
+		for (int i = 0; i <= maxValue; i++)
+		{
+			double linear = profile.curves[0].evaluate((double)i / maxValue);
+			outputTable[i] = (uint16_t)(encodeSrgb(linear) * maxValue + 0.5);
+		}
+		return SUCCESS;
+	}
+
+	for (int c = 0; c < 3; c++)
+	{
+		inputTables[c].resize(maxValue + 1);
+		for (int i = 0; i <= maxValue; i++)
+		{
+			inputTables[c][i] = (float)profile.curves[c].evaluate((double)i / maxValue);
+		}
+	}
+	// the matrix also scales to output table positions
+	for (int row = 0; row < 3; row++)
+	{
+		for (int column = 0; column < 3; column++)
+		{
+			double value = 0;
+			for (int k = 0; k < 3; k++)
+			{
+				value += SRGB[row][k] * profile.colorants[k][column];
+			}
+			matrix[row * 3 + column] = (float)(value * (outputSteps - 1));
+		}
+	}
+	outputTable.resize(outputSteps);
+	for (int i = 0; i < outputSteps; i++)
+	{
+		outputTable[i] = (uint16_t)(encodeSrgb((double)i / (outputSteps - 1)) * maxValue + 0.5);
+	}
+	return SUCCESS;
+}
+
+ErrorCode ColourTransform::build(const J2PColourSpecification& colour, uint16_t maxValue)
+{
+	if (colour.SpecificationMethod == 1 || colour.Profile == NULL)
+	{
+		return ICC_PROFILE_UNSUPPORTED;
+	}
+	IccProfile profile;
+	ErrorCode result = profile.load(colour.Profile, colour.ProfileLength);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	return build(profile, maxValue);
+}
+
+void ColourTransform::applyScalar(uint16_t* samples, size_t pixels) const
+{
+	const float* m = matrix;
+	for (size_t i = 0; i < pixels; i++, samples += 3)
+	{
+		float r = inputTables[0][min(samples[0], maxValue)];
+		float g = inputTables[1][min(samples[1], maxValue)];
+		float b = inputTables[2][min(samples[2], maxValue)];
+		for (int c = 0; c < 3; c++)
+		{
+			float value = m[c * 3] * r + m[c * 3 + 1] * g + m[c * 3 + 2] * b;
+			value = min(max(value, 0.0f), (float)(outputSteps - 1));
+			samples[c] = outputTable[(int)(value + 0.5f)];
+		}
+	}
+}
+
+void ColourTransform::apply(uint16_t* samples, size_t pixels) const
+{
+	if (components == 1)
+	{
+		for (size_t i = 0; i < pixels; i++)
+		{
+			samples[i] = outputTable[min(samples[i], maxValue)];
+		}
+		return;
+	}
+
+	size_t i = 0;
+#ifdef BJPEG_SSE2
+	// four pixels at a time: gathered lookups, the matrix in vector registers
+	const float* red = inputTables[0].data();
+	const float* green = inputTables[1].data();
+	const float* blue = inputTables[2].data();
+	const uint16_t* output = outputTable.data();
+	__m128 m[9];
+	for (int k = 0; k < 9; k++)
+	{
+		m[k] = _mm_set1_ps(matrix[k]);
+	}
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 top = _mm_set1_ps((float)(outputSteps - 1));
+	const __m128 half = _mm_set1_ps(0.5f);
+	for (; i + 4 <= pixels; i += 4)
+	{
+		uint16_t* p = samples + 3 * i;
+		__m128 r = _mm_setr_ps(red[min(p[0], maxValue)], red[min(p[3], maxValue)], red[min(p[6], maxValue)], red[min(p[9], maxValue)]);
+		__m128 g = _mm_setr_ps(green[min(p[1], maxValue)], green[min(p[4], maxValue)], green[min(p[7], maxValue)], green[min(p[10], maxValue)]);
+		__m128 b = _mm_setr_ps(blue[min(p[2], maxValue)], blue[min(p[5], maxValue)], blue[min(p[8], maxValue)], blue[min(p[11], maxValue)]);
+		for (int c = 0; c < 3; c++)
+		{
+			__m128 value = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[c * 3], r), _mm_mul_ps(m[c * 3 + 1], g)), _mm_mul_ps(m[c * 3 + 2], b));
+			value = _mm_add_ps(_mm_min_ps(_mm_max_ps(value, zero), top), half);
+			int32_t index[4];
+			_mm_storeu_si128((__m128i*)index, _mm_cvttps_epi32(value));
+			p[c] = output[index[0]];
+			p[c + 3] = output[index[1]];
+			p[c + 6] = output[index[2]];
+			p[c + 9] = output[index[3]];
+		}
+	}
+#endif
+	applyScalar(samples + 3 * i, pixels - i);
+}
+
+ErrorCode ColourTransform::apply(PNMFile& image) const
+{
+	if (image.components != components || image.maxValue != maxValue)
+	{
+		return ICC_PROFILE_UNSUPPORTED;
+	}
+	apply(image.samples.data(), (size_t)image.width * image.height);
+	return SUCCESS;
+}
+
+ErrorCode ChannelMapping::build(const J2PHeader& header, uint16_t components)
+{
+	const J2PImageHeader* imageHeader = (const J2PImageHeader*)findBox(header, J2PImageHeader::MARKER_ID);
+	const J2PBitsPerComponent* depths = (const J2PBitsPerComponent*)findBox(header, J2PBitsPerComponent::MARKER_ID);
+	const J2PPalette* pclr = (const J2PPalette*)findBox(header, J2PPalette::MARKER_ID);
+	const J2PComponentMapping* cmap = (const J2PComponentMapping*)findBox(header, J2PComponentMapping::MARKER_ID);
+	const J2PChannelDefinition* cdef = (const J2PChannelDefinition*)findBox(header, J2PChannelDefinition::MARKER_ID);
+	if (imageHeader == NULL || (pclr == NULL) != (cmap == NULL) ||
+		(imageHeader->BitsPerComponent == 255 && (depths == NULL || depths->BPC.size() < components)))
+	{
+		return J2P_CHANNEL_MAPPING_INVALID;
+	}
+	this->components = components;
+
+	vector<Source> mapped;
+	vector<uint8_t> mappedDepths;
+	if (cmap == NULL)
+	{
+		for (uint16_t component = 0; component < components; component++)
+		{
+			Source source = { component, -1 };
+			mapped.push_back(source);
+		}
+	}
+	else
+	{
+		BOOST_FOREACH(const J2PComponentMappingEntry& channel, cmap->channels)
+		{
+			Source source = { channel.CMP, channel.MTYP == 1 ? channel.PCOL : -1 };
+			if (channel.CMP >= components || channel.MTYP > 1 || (source.column >= 0 && channel.PCOL >= pclr->columns()))
+			{
+				return J2P_CHANNEL_MAPPING_INVALID;
+			}
+			mapped.push_back(source);
+		}
+	}
+	BOOST_FOREACH(const Source& source, mapped)
+	{
+		uint8_t depth = imageHeader->BitsPerComponent == 255 ? depths->BPC[source.component] : imageHeader->BitsPerComponent;
+		mappedDepths.push_back(source.column < 0 ? (depth & 0x7F) + 1 : pclr->bitDepth((uint8_t)source.column));
+	}
+
+	// colours by association, then unspecified channels, opacity last
+	vector<pair<uint32_t, uint16_t> > order;
+	alphaType = J2PChannelDefinitionEntry::COLOUR;
+	for (uint16_t channel = 0; channel < mapped.size(); channel++)
+	{
+		uint32_t key = 0x10000 + channel;
+		if (cdef != NULL)
+		{
+			BOOST_FOREACH(const J2PChannelDefinitionEntry& definition, cdef->channels)
+			{
+				if (definition.Cn != channel)
+				{
+					continue;
+				}
+				if (definition.Typ == J2PChannelDefinitionEntry::COLOUR && definition.Asoc != J2PChannelDefinitionEntry::WHOLE_IMAGE)
+				{
+					key = definition.Asoc;
+				}
+				else if (definition.Typ == J2PChannelDefinitionEntry::OPACITY || definition.Typ == J2PChannelDefinitionEntry::PREMULTIPLIED_OPACITY)
+				{
+					key = 0x20000 + channel;
+					alphaType = definition.Typ;
+				}
+			}
+		}
+		order.push_back(make_pair(key, channel));
+	}
+	sort(order.begin(), order.end());
+	sources.clear();
+	bitDepths.clear();
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		sources.push_back(mapped[order[i].second]);
+		bitDepths.push_back(mappedDepths[order[i].second]);
+	}
+	outputDepth = bitDepths.empty() ? 0 : min<uint8_t>(*max_element(bitDepths.begin(), bitDepths.end()), 16);
+	outputMax = (1 << outputDepth) - 1;
+	channelMax.clear();
+	for (size_t c = 0; c < sources.size(); c++)
+	{
+		// palette columns are scaled below
+		channelMax.push_back(sources[c].column < 0 ? (1 << min<uint8_t>(bitDepths[c], 16)) - 1 : outputMax);
+	}
+
+	palette.clear();
+	paletteColumns = paletteEntries = 0;
+	paletteOnly = false;
+	if (pclr != NULL)
+	{
+		paletteColumns = pclr->columns();
+		paletteEntries = pclr->NumberOfEntries;
+		palette.resize(pclr->C.size());
+		for (size_t i = 0; i < palette.size(); i++)
+		{
+			// columns may have up to 38 bits
+			uint64_t top = ((uint64_t)1 << pclr->bitDepth((uint8_t)(i % paletteColumns))) - 1;
+			palette[i] = (uint16_t)((min<uint64_t>(pclr->C[i], top) * outputMax + top / 2) / top);
+		}
+		paletteOnly = !sources.empty();
+		BOOST_FOREACH(const Source& source, sources)
+		{
+			paletteOnly = paletteOnly && source.column >= 0 && source.component == sources[0].component;
+		}
+	}
+	return SUCCESS;
+}
+
+void ChannelMapping::apply(const uint16_t* input, uint16_t* output, size_t pixels) const
+{
+	size_t count = sources.size();
+	uint16_t last = (uint16_t)(paletteEntries - 1);
+	if (paletteOnly)
+	{
+		// one index per pixel, every channel read from the same entry
+		uint16_t component = sources[0].component;
+		for (size_t i = 0; i < pixels; i++, input += components, output += count)
+		{
+			const uint16_t* entry = palette.data() + (size_t)min(input[component], last) * paletteColumns;
+			for (size_t c = 0; c < count; c++)
+			{
+				output[c] = entry[sources[c].column];
+			}
+		}
+		return;
+	}
+	for (size_t i = 0; i < pixels; i++, input += components, output += count)
+	{
+		for (size_t c = 0; c < count; c++)
+		{
+			const Source& source = sources[c];
+			uint16_t value = input[source.component];
+			uint32_t top = channelMax[c];
+			if (source.column >= 0)
+			{
+				output[c] = palette[(size_t)min(value, last) * paletteColumns + source.column];
+			}
+			else if (top == outputMax)
+			{
+				output[c] = value;
+			}
+			else
+			{
+				output[c] = (uint16_t)((min<uint32_t>(value, top) * outputMax + top / 2) / top);
+			}
+		}
+	}
+}
+
+ErrorCode ChannelMapping::apply(const PNMFile& input, PNMFile& output) const
+{
+	if (input.components != components || (channels() != 1 && channels() != 3))
+	{
+		return J2P_CHANNEL_MAPPING_INVALID;
+	}
+	output.width = input.width;
+	output.height = input.height;
+	output.components = channels();
+	output.maxValue = (uint16_t)outputMax;
+	output.samples.resize((size_t)input.width * input.height * output.components);
+	apply(input.samples.data(), output.samples.data(), (size_t)input.width * input.height);
+	return SUCCESS;
+}
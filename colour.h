@@ -0,0 +1,132 @@
+#ifndef _COLOUR_H_
+#define _COLOUR_H_
+
+#include <boost\cstdint.hpp>
+#include <vector>
+#include "common.h"
+#include "j2p.h"
+#include "pnm.h"
+
+namespace BJPEG
+{
+
+// curveType (table or gamma) or parametricCurveType of ICC.1
+class ToneCurve
+{
+public:
+	// 0..4 - parametric function type, -1 - table (empty for identity)
+	int function;
+	double parameters[7];
+	std::vector<uint16_t> table;
+
+	ToneCurve() : function(-1) {}
+
+	ErrorCode load(const uint8_t* buffer, uint32_t length);
+	// device value in [0, 1] to linear
+	double evaluate(double x) const;
+};
+
+// Matrix/TRC profile: three colorants and tone curves, or the grey tone curve
+// alone. Profiles built on lookup tables (A2B0) are not supported.
+class IccProfile
+{
+public:
+	static const uint32_t RGB = 0x52474220;
+	static const uint32_t GRAY = 0x47524159;
+
+	uint32_t colourSpace;
+	// rXYZ, gXYZ and bXYZ as the columns of a device to PCS XYZ (D50) matrix
+	double colorants[3][3];
+	// rTRC, gTRC, bTRC or kTRC alone
+	ToneCurve curves[3];
+
+	IccProfile() : colourSpace(0) {}
+
+	uint16_t channels() const
+	{
+		return colourSpace == GRAY ? 1 : 3;
+	}
+
+	ErrorCode load(const uint8_t* buffer, uint32_t length);
+};
+
+// An input profile compiled into one kernel converting to sRGB: a lookup table
+// linearising each channel, the 3x3 matrix to linear sRGB (skipped for grey) and
+// a lookup table applying the sRGB curve. Samples are converted in place, so a
+// decoder can run it on each row as it writes the output.
+class ColourTransform
+{
+	uint16_t components;
+	uint16_t maxValue;
+	// entries of the output table, from maxValue
+	int outputSteps;
+	std::vector<float> inputTables[3];
+	float matrix[9];
+	std::vector<uint16_t> outputTable;
+
+	void applyScalar(uint16_t* samples, size_t pixels) const;
+
+public:
+	ColourTransform() : components(0), maxValue(0), outputSteps(0) {}
+
+	ErrorCode build(const IccProfile& profile, uint16_t maxValue);
+	// ICC profile of a colr box (methods 2 and 3)
+	ErrorCode build(const J2PColourSpecification& colour, uint16_t maxValue);
+
+	// pixels of interleaved samples, as many components as the profile has channels
+	void apply(uint16_t* samples, size_t pixels) const;
+	ErrorCode apply(PNMFile& image) const;
+};
+
+// pclr, cmap and cdef of a jp2h resolved into the channels of the output: colours
+// in association order, then the rest, opacity last. Built once and applied to
+// each row of decoded components as the output is written.
+class ChannelMapping
+{
+	class Source
+	{
+	public:
+		uint16_t component;
+		// palette column, -1 - the component itself
+		int column;
+	};
+
+	uint16_t components;
+	std::vector<Source> sources;
+	// entry by entry, so one index fetches every column; at the output depth
+	std::vector<uint16_t> palette;
+	uint16_t paletteColumns;
+	uint16_t paletteEntries;
+	// every channel is a column of the palette indexed by one component
+	bool paletteOnly;
+	// largest sample of each channel as it comes in, and of the output
+	std::vector<uint32_t> channelMax;
+	uint32_t outputMax;
+
+public:
+	// bits of each channel
+	std::vector<uint8_t> bitDepths;
+	// bits of every output channel, the largest of bitDepths (16 at most); channels
+	// and palette columns of fewer bits are scaled up to it
+	uint8_t outputDepth;
+	// Typ of the opacity channel, COLOUR when there is none
+	uint16_t alphaType;
+
+	ChannelMapping() : components(0), paletteColumns(0), paletteEntries(0), paletteOnly(false), outputMax(0), outputDepth(0), alphaType(0) {}
+
+	uint16_t channels() const
+	{
+		return (uint16_t)sources.size();
+	}
+
+	// components - Csiz of the codestream; their depths come from ihdr or bpcc
+	ErrorCode build(const J2PHeader& header, uint16_t components);
+
+	// pixels of interleaved components in, pixels of interleaved channels at outputDepth out
+	void apply(const uint16_t* input, uint16_t* output, size_t pixels) const;
+	ErrorCode apply(const PNMFile& input, PNMFile& output) const;
+};
+
+}
+
+#endif /*_COLOUR_H_*/
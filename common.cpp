@@ -1,4 +1,5 @@
 #include "common.h"
+#include "instrument.h"
 #include <fstream>
 
 using namespace std;
@@ -6,24 +7,36 @@ using namespace BJPEG;
 
 ErrorCode ImageFile::loadFile(const std::string& fileName)
 {
-	ifstream file(fileName, ios::binary);
-	file.seekg(0, ios::end);
-	streamsize size = file.tellg();
-	if (size < 0)
+	uint8_t* buffer;
+	streamsize size;
 	{
-		return FILE_CANNOT_SEEK;
+		BJPEG_INSTRUMENT_SCOPE(instrument, STAGE_READ_FILE, -1);
+		ifstream file(fileName, ios::binary);
+		file.seekg(0, ios::end);
+		size = file.tellg();
+		if (size < 0)
+		{
+			return FILE_CANNOT_SEEK;
+		}
+		file.seekg(0, ios::beg);
+		buffer = new uint8_t[size];
+		BJPEG_INSTRUMENT_ALLOCATION(size);
+		file.read((char*)buffer, size);
+		file.close();
 	}
-	file.seekg(0, ios::beg);
-	uint8_t* buffer = new uint8_t[size];
-	file.read((char*)buffer, size);
-	file.close();
-	ErrorCode result = load(buffer, 0);
-	delete buffer;
+	ErrorCode result = loadBuffer(buffer, size);
+	delete[] buffer;
 	return result;
 }
 
+ErrorCode ImageFile::loadBuffer(const uint8_t* buffer, uint64_t)
+{
+	return load(buffer, 0);
+}
+
 void ImageFile::saveFile(const string& fileName) const
 {
+	BJPEG_INSTRUMENT_SCOPE(instrument, STAGE_WRITE_FILE, -1);
 	ofstream outfile(fileName, ios::binary);
 	save(outfile);
 	outfile.close();
@@ -2,8 +2,25 @@
 #define _COMMON_H_
 
 #include <boost\cstdint.hpp>
+#include <cstring>
 #include <ostream>
 
+// the fields of the formats are big endian
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#define BJPEG_FROM_BIG_ENDIAN16(x) _byteswap_ushort(x)
+#define BJPEG_FROM_BIG_ENDIAN32(x) _byteswap_ulong(x)
+#define BJPEG_FROM_BIG_ENDIAN64(x) _byteswap_uint64(x)
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BJPEG_FROM_BIG_ENDIAN16(x) (x)
+#define BJPEG_FROM_BIG_ENDIAN32(x) (x)
+#define BJPEG_FROM_BIG_ENDIAN64(x) (x)
+#else
+#define BJPEG_FROM_BIG_ENDIAN16(x) __builtin_bswap16(x)
+#define BJPEG_FROM_BIG_ENDIAN32(x) __builtin_bswap32(x)
+#define BJPEG_FROM_BIG_ENDIAN64(x) __builtin_bswap64(x)
+#endif
+
 namespace BJPEG
 {
 
@@ -43,19 +60,26 @@ public:
 		return buffer[offset];
 	}
 
+	// unaligned loads, memcpy compiles to a single mov
 	static inline uint16_t ReadUint16(const uint8_t* buffer, int offset)
 	{
-		return (buffer[offset] << 8) + buffer[offset + 1];
+		uint16_t value;
+		memcpy(&value, buffer + offset, sizeof(value));
+		return BJPEG_FROM_BIG_ENDIAN16(value);
 	}
+
 	static inline uint32_t ReadUint32(const uint8_t* buffer, int offset)
 	{
-		return (buffer[offset] << 24) + (buffer[offset + 1] << 16) + (buffer[offset + 2] << 8) + (buffer[offset + 3]);
+		uint32_t value;
+		memcpy(&value, buffer + offset, sizeof(value));
+		return BJPEG_FROM_BIG_ENDIAN32(value);
 	}
 
 	static inline uint64_t ReadUint64(const uint8_t* buffer, int offset)
 	{
-		return (((uint64_t)buffer[offset]) << 56) + (((uint64_t)buffer[offset + 1]) << 48) + (((uint64_t)buffer[offset + 2]) << 40) + (((uint64_t)buffer[offset + 3]) << 32) +
-			(buffer[offset + 4] << 24) + (buffer[offset + 5] << 16) + (buffer[offset + 6] << 8) + (buffer[offset + 7]);
+		uint64_t value;
+		memcpy(&value, buffer + offset, sizeof(value));
+		return BJPEG_FROM_BIG_ENDIAN64(value);
 	}
 
 	static inline bool VerifyReadUint16(const uint8_t* buffer, int offset, uint16_t value)
@@ -74,6 +98,89 @@ public:
 	}
 };
 
+// Position in an untrusted buffer that ends at end. Parsers check once per
+// marker segment that its declared length fits (hasSegment()) and then read
+// its fields with JpegAccess unchecked, so input is parsed in place.
+class ByteCursor
+{
+	const uint8_t* buffer;
+	uint64_t end;
+	uint64_t offset;
+
+public:
+	// for buffers trusted to hold whatever their contents claim
+	static const uint64_t UNKNOWN_END = ~(uint64_t)0;
+
+	ByteCursor(const uint8_t* buffer, uint64_t end, uint64_t offset = 0)
+		: buffer(buffer), end(end), offset(offset < end ? offset : end) {}
+
+	const uint8_t* data() const
+	{
+		return buffer;
+	}
+
+	const uint8_t* current() const
+	{
+		return buffer + offset;
+	}
+
+	// from data()
+	uint64_t position() const
+	{
+		return offset;
+	}
+
+	uint64_t remaining() const
+	{
+		return end - offset;
+	}
+
+	bool has(uint64_t count) const
+	{
+		return count <= remaining();
+	}
+
+	// 0 when fewer than two bytes are left
+	uint16_t peekMarker() const
+	{
+		return has(2) ? JpegAccess::ReadUint16(current(), 0) : 0;
+	}
+
+	// whether a marker segment starts here whose length is at least minimum
+	// and whose declared bytes are all there
+	bool hasSegment(uint16_t minimum) const
+	{
+		if (!has(4))
+		{
+			return false;
+		}
+		uint16_t length = JpegAccess::ReadUint16(current(), 2);
+		return length >= minimum && has(2 + (uint64_t)length);
+	}
+
+	// marker and segment, after hasSegment()
+	uint32_t segmentSize() const
+	{
+		return 2 + JpegAccess::ReadUint16(current(), 2);
+	}
+
+	void skip(uint64_t count)
+	{
+		offset = count < remaining() ? offset + count : end;
+	}
+
+	ByteCursor at(uint64_t position) const
+	{
+		return ByteCursor(buffer, end, position);
+	}
+
+	// the next length bytes (or fewer, if that is all there is)
+	ByteCursor window(uint64_t length) const
+	{
+		return ByteCursor(buffer, has(length) ? offset + length : end, offset);
+	}
+};
+
 enum ErrorCode
 {
 	SUCCESS,
@@ -105,7 +212,60 @@ enum ErrorCode
 	J2P_RESOLUTION_DESCRIPTOR_DOESNT_MATCH,
 	J2P_CAPTURE_RESOLUTION_DESCRIPTOR_DOESNT_MATCH,
 	J2P_DEFAULT_DISPLAY_RESOLUTION_DESCRIPTOR_DOESNT_MATCH,
-	J2P_CONTIGUOUS_CODESTREAM_DOESNT_MATCH
+	J2P_CONTIGUOUS_CODESTREAM_DOESNT_MATCH,
+
+	// new codes go at the end, so the values of the existing ones stay the same
+	FILE_CANNOT_OPEN,
+
+	J2K_CAP_DOESNT_MATCH,
+
+	PNM_MAGIC_DOESNT_MATCH,
+	PNM_INVALID_HEADER,
+
+	ENCODER_UNSUPPORTED_IMAGE,
+
+	J2P_BOX_INVALID_LENGTH,
+	J2P_SEQUENCE_INVALID_TABLE,
+	J2P_FRAME_OUT_OF_RANGE,
+	J2P_FRAME_EXTERNAL_REFERENCE,
+
+	ICC_PROFILE_INVALID,
+	ICC_PROFILE_UNSUPPORTED,
+
+	J2P_PALETTE_DOESNT_MATCH,
+	J2P_COMPONENT_MAPPING_DOESNT_MATCH,
+	J2P_CHANNEL_DEFINITION_DOESNT_MATCH,
+	J2P_CHANNEL_MAPPING_INVALID,
+
+	MOSAIC_MAGIC_DOESNT_MATCH,
+	MOSAIC_INVALID_INDEX,
+
+	SIDECAR_MAGIC_DOESNT_MATCH,
+	SIDECAR_VERSION_DOESNT_MATCH,
+	SIDECAR_INVALID_LENGTH,
+
+	PACKET_INDEX_NO_PACKET_LENGTHS,
+	PACKET_INDEX_INVALID,
+	PACKET_INDEX_UNSUPPORTED,
+
+	SERVER_CANNOT_LISTEN,
+	SERVER_CONNECTION_FAILED,
+	SERVER_INVALID_RESPONSE,
+
+	J2K_MARKER_UNEXPECTED,
+	J2K_PPM_DOESNT_MATCH,
+	J2K_PPT_DOESNT_MATCH,
+	J2K_SEGMENT_TRUNCATED,
+
+	SYNTHETIC_INVALID_OPTIONS,
+
+	FILE_CANNOT_READ,
+
+	CACHE_DECODER_FAILED,
+
+	PNM_DATA_TRUNCATED,
+
+	BATCH_PARSE_FAILED
 };
 
 class ImageFilePart
@@ -119,6 +279,8 @@ class ImageFile : public ImageFilePart
 {
 public:
 	virtual ErrorCode loadFile(const std::string& fileName);
+	// length bytes at buffer; as load(buffer, 0) unless the format checks its bounds
+	virtual ErrorCode loadBuffer(const uint8_t* buffer, uint64_t length);
 	virtual void saveFile(const std::string& fileName) const;
 };
 
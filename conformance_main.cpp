@@ -0,0 +1,210 @@
+#include <boost\foreach.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "encoder.h"
+#include "pnm.h"
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+
+// FNV-1a, 64 bits
+uint64_t hashBytes(const string& bytes)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	BOOST_FOREACH(char c, bytes)
+	{
+		hash = (hash ^ (uint8_t)c) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+template <typename T> bool parseList(const string& text, vector<T>& values)
+{
+	istringstream stream(text);
+	string item;
+	while (getline(stream, item, ','))
+	{
+		istringstream number(item);
+		T value;
+		if (!(number >> value))
+		{
+			return false;
+		}
+		values.push_back(value);
+	}
+	return !values.empty();
+}
+
+// tile=WxH levels=N layers=N bytes=B,... psnr=dB,... irreversible step=S precincts=N plt ppt
+bool parseOption(const string& option, EncoderOptions& options)
+{
+	size_t equals = option.find('=');
+	string name = option.substr(0, equals);
+	string value = equals == string::npos ? "" : option.substr(equals + 1);
+	if (name == "tile")
+	{
+		return sscanf(value.c_str(), "%ux%u", &options.tileWidth, &options.tileHeight) == 2;
+	}
+	if (name == "levels")
+	{
+		options.decompositionLevels = (uint8_t)atoi(value.c_str());
+		return true;
+	}
+	if (name == "layers")
+	{
+		options.layers = (uint16_t)atoi(value.c_str());
+		return options.layers > 0;
+	}
+	if (name == "bytes")
+	{
+		return parseList(value, options.layerBytes);
+	}
+	if (name == "psnr")
+	{
+		return parseList(value, options.layerPsnr);
+	}
+	if (name == "irreversible")
+	{
+		options.irreversible = true;
+		return true;
+	}
+	if (name == "step")
+	{
+		options.quantizationStep = (float)atof(value.c_str());
+		return options.quantizationStep > 0;
+	}
+	if (name == "precincts")
+	{
+		options.precinctExponent = (uint8_t)atoi(value.c_str());
+		return true;
+	}
+	if (name == "plt")
+	{
+		options.packetLengths = true;
+		return true;
+	}
+	if (name == "ppt")
+	{
+		options.packedHeaders = true;
+		return true;
+	}
+	return false;
+}
+
+ErrorCode encode(const PNMFile& image, EncoderOptions options, unsigned threads, string& codestream)
+{
+	options.threads = threads;
+	ostringstream stream;
+	ErrorCode result = J2KEncoder(options).encode(image, stream);
+	codestream = stream.str();
+	return result;
+}
+
+}
+
+// Encodes the images of a manifest (img/conformance.txt without one) and compares the
+// codestreams with the sizes and hashes recorded there. A line is an image, the size
+// and FNV-1a hash of its codestream and the encoder options, '#' starts a comment.
+// Every image is encoded on one worker and on all of them, which have to agree, and
+// byte targets have to be met. With --record the manifest is written to stdout with
+// the sizes and hashes of this build, and the codestreams to conformance<case>.j2k
+// in the working directory, to be checked by an outside decoder.
+int main(int argc, char* argv[])
+{
+	bool record = argc > 1 && string(argv[1]) == "--record";
+	string manifestName = argc > (record ? 2 : 1) ? argv[record ? 2 : 1] : "img/conformance.txt";
+	ifstream manifest(manifestName);
+	if (!manifest)
+	{
+		cerr << manifestName << ": cannot open" << endl;
+		return 1;
+	}
+
+	int cases = 0;
+	int failures = 0;
+	string line;
+	while (getline(manifest, line))
+	{
+		istringstream tokens(line);
+		string imageName, size, hash;
+		if (line.empty() || line[0] == '#' || !(tokens >> imageName >> size >> hash))
+		{
+			if (record)
+			{
+				cout << line << endl;
+			}
+			continue;
+		}
+		cases++;
+		EncoderOptions options;
+		string optionText;
+		string option;
+		bool valid = true;
+		while (tokens >> option)
+		{
+			valid = valid && parseOption(option, options);
+			optionText += " " + option;
+		}
+
+		ostringstream problem;
+		PNMFile image;
+		ErrorCode result = valid ? image.loadFile(imageName) : SUCCESS;
+		string single, parallel;
+		if (!valid)
+		{
+			problem << "invalid options";
+		}
+		else if (result != SUCCESS)
+		{
+			problem << "cannot load the image, error " << result;
+		}
+		else if ((result = encode(image, options, 1, single)) != SUCCESS || (result = encode(image, options, 0, parallel)) != SUCCESS)
+		{
+			problem << "error " << result;
+		}
+		else if (single != parallel)
+		{
+			problem << "the codestream depends on the number of workers";
+		}
+		else if (!options.layerBytes.empty() && single.size() > options.layerBytes.back())
+		{
+			problem << single.size() << " bytes, over the target of " << options.layerBytes.back();
+		}
+
+		ostringstream actual;
+		actual << single.size() << " " << hex << setw(16) << setfill('0') << hashBytes(single);
+		if (record)
+		{
+			cout << imageName << " " << actual.str() << optionText << endl;
+			ostringstream fileName;
+			fileName << "conformance" << cases << ".j2k";
+			ofstream output(fileName.str(), ios::binary);
+			output.write(single.data(), single.size());
+		}
+		else if (problem.str().empty() && actual.str() != size + " " + hash)
+		{
+			problem << actual.str() << ", expected " << size << " " << hash;
+		}
+
+		if (!problem.str().empty())
+		{
+			failures++;
+			cerr << "FAIL " << imageName << optionText << ": " << problem.str() << endl;
+		}
+		else if (!record)
+		{
+			cout << "PASS " << imageName << optionText << endl;
+		}
+	}
+	if (!record)
+	{
+		cout << cases - failures << " of " << cases << " passed" << endl;
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,1407 @@
+#include "encoder.h"
+#include "scheduler.h"
+#include "tier1.h"
+#include "tier2.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	const uint8_t GUARD_BITS = 2;
+	// bits kept below the quantiser step of irreversible coefficients for the distortion estimates
+	const int FRACTION_BITS = 6;
+	// lifting steps and scaling of the irreversible 9/7 filter (F.4.8.2)
+	const double ALPHA = -1.586134342059924;
+	const double BETA = -0.052980118572961;
+	const double GAMMA = 0.882911075530934;
+	const double DELTA = 0.443506852043971;
+	const double K = 1.230174104914001;
+	// default precinct partition (Scod bit 0 clear), 2^15 in each direction
+	const uint32_t PRECINCT_EXPONENT = 15;
+
+	inline uint32_t ceilDiv(uint64_t value, uint64_t divisor)
+	{
+		return (uint32_t)((value + divisor - 1) / divisor);
+	}
+
+	// band coordinates of B-15, the numerator may be negative
+	inline uint32_t bandCoordinate(uint32_t coordinate, uint32_t offset, uint32_t level)
+	{
+		int64_t value = (int64_t)coordinate - ((int64_t)offset << (level - 1));
+		int64_t divisor = (int64_t)1 << level;
+		return value <= 0 ? 0 : (uint32_t)((value + divisor - 1) / divisor);
+	}
+
+	inline uint32_t floorLog2(uint32_t value)
+	{
+		uint32_t result = 0;
+		while (value >>= 1)
+		{
+			result++;
+		}
+		return result;
+	}
+
+	struct Rect
+	{
+		uint32_t x0;
+		uint32_t y0;
+		uint32_t x1;
+		uint32_t y1;
+
+		uint32_t width() const
+		{
+			return x1 > x0 ? x1 - x0 : 0;
+		}
+
+		uint32_t height() const
+		{
+			return y1 > y0 ? y1 - y0 : 0;
+		}
+
+		bool empty() const
+		{
+			return width() == 0 || height() == 0;
+		}
+
+		Rect scaled(uint32_t shift) const
+		{
+			Rect result = { ceilDiv(x0, (uint64_t)1 << shift), ceilDiv(y0, (uint64_t)1 << shift),
+				ceilDiv(x1, (uint64_t)1 << shift), ceilDiv(y1, (uint64_t)1 << shift) };
+			return result;
+		}
+
+		Rect intersect(const Rect& other) const
+		{
+			Rect result = { max(x0, other.x0), max(y0, other.y0), min(x1, other.x1), min(y1, other.y1) };
+			return result;
+		}
+	};
+
+	// feasible truncation point on the convex hull of a code-block's rate-distortion curve
+	struct TruncationPoint
+	{
+		uint32_t passes;
+		// distortion removed per byte since the previous hull point
+		double slope;
+	};
+
+	struct CodeBlock
+	{
+		// sub-band coordinates
+		Rect rect;
+		EncodedCodeBlock encoded;
+		// image domain squared error of one squared quantiser step
+		double weight;
+		std::vector<TruncationPoint> hull;
+		// passes included up to and including each layer
+		std::vector<uint32_t> layerPasses;
+		// Lblock of B.10.7.1
+		uint32_t lengthBits;
+		bool included;
+
+		CodeBlock() : weight(1), lengthBits(3), included(false) {}
+	};
+
+	// code-blocks of one sub-band falling into one precinct
+	struct PrecinctBand
+	{
+		uint32_t gridWidth;
+		uint32_t gridHeight;
+		std::vector<CodeBlock> blocks;
+		TagTreeEncoder inclusion;
+		TagTreeEncoder zeroBitPlanes;
+	};
+
+	struct Band
+	{
+		CodeBlockEncoder::Orientation orientation;
+		Rect rect;
+		// top left corner inside the transformed tile-component
+		uint32_t bufferX;
+		uint32_t bufferY;
+		// Mb of E-2
+		uint32_t magnitudeBits;
+		// quantiser step, 1 for reversible coefficients
+		double step;
+		int fractionBits;
+		double weight;
+	};
+
+	struct Resolution
+	{
+		Rect rect;
+		std::vector<Band> bands;
+		// [precinct][band]
+		std::vector<std::vector<PrecinctBand> > precincts;
+	};
+
+	struct TileComponent
+	{
+		Rect rect;
+		// quantised coefficients
+		std::vector<int32_t> samples;
+		// irreversible path only, dropped once quantised
+		std::vector<float> coefficients;
+		std::vector<Resolution> resolutions;
+	};
+
+	struct Tile
+	{
+		uint16_t index;
+		Rect rect;
+		std::vector<TileComponent> components;
+	};
+
+	inline int mirror(int k, int count)
+	{
+		return k < 0 ? -k : (k >= count ? 2 * (count - 1) - k : k);
+	}
+
+	// one level of 1D synthesis of an interleaved signal, low-pass samples at even positions
+	void synthesise(vector<double>& x, bool irreversible)
+	{
+		int count = (int)x.size();
+		if (irreversible)
+		{
+			const double steps[4] = { DELTA, GAMMA, BETA, ALPHA };
+			for (int k = 0; k < count; k++)
+			{
+				x[k] = (k & 1) == 0 ? x[k] * K : x[k] / K;
+			}
+			for (int s = 0; s < 4; s++)
+			{
+				for (int k = (s & 1) == 0 ? 0 : 1; k < count; k += 2)
+				{
+					x[k] -= steps[s] * (x[mirror(k - 1, count)] + x[mirror(k + 1, count)]);
+				}
+			}
+		}
+		else
+		{
+			for (int k = 0; k < count; k += 2)
+			{
+				x[k] -= (x[mirror(k - 1, count)] + x[mirror(k + 1, count)]) / 4;
+			}
+			for (int k = 1; k < count; k += 2)
+			{
+				x[k] += (x[mirror(k - 1, count)] + x[mirror(k + 1, count)]) / 2;
+			}
+		}
+	}
+
+	// L2 norm of the 1D synthesis basis function of a coefficient at the given level
+	double basisNorm(bool irreversible, uint32_t level, bool high)
+	{
+		if (level == 0)
+		{
+			return 1;
+		}
+		// deeper levels only scale by a constant factor
+		const uint32_t DEEPEST = 10;
+		if (level > DEEPEST)
+		{
+			double growth = basisNorm(irreversible, DEEPEST, false) / basisNorm(irreversible, DEEPEST - 1, false);
+			return basisNorm(irreversible, DEEPEST, high) * pow(growth, (double)(level - DEEPEST));
+		}
+
+		vector<double> signal(32, 0.0);
+		signal[16 + (high ? 1 : 0)] = 1;
+		synthesise(signal, irreversible);
+		for (uint32_t l = 1; l < level; l++)
+		{
+			vector<double> finer(signal.size() * 2, 0.0);
+			for (size_t k = 0; k < signal.size(); k++)
+			{
+				finer[2 * k] = signal[k];
+			}
+			synthesise(finer, irreversible);
+			signal.swap(finer);
+		}
+
+		double energy = 0;
+		for (size_t k = 0; k < signal.size(); k++)
+		{
+			energy += signal[k] * signal[k];
+		}
+		return sqrt(energy);
+	}
+
+	struct BandQuantization
+	{
+		// exponent and mantissa of SPqcd
+		uint8_t exponent;
+		uint16_t mantissa;
+		// step size of E-3
+		double step;
+		// L2 norm of the 2D synthesis basis functions
+		double norm;
+	};
+
+	// quantisation of each sub-band, in QCD order
+	vector<BandQuantization> bandQuantization(const PNMFile& image, uint8_t levels, bool mct, bool irreversible, float baseStep)
+	{
+		vector<BandQuantization> result;
+		for (uint32_t i = 0; i < 1 + 3u * levels; i++)
+		{
+			// LL of the lowest resolution, then HL, LH, HH from the coarsest level on
+			uint32_t orientation = i == 0 ? 0 : (i - 1) % 3 + 1;
+			uint32_t level = i == 0 ? levels : levels - (i - 1) / 3;
+			// HL and LH gain one bit, HH two
+			uint32_t gain = (orientation & 1) + (orientation >> 1);
+
+			BandQuantization band;
+			band.norm = basisNorm(irreversible, level, (orientation & 1) != 0) *
+				basisNorm(irreversible, level, (orientation & 2) != 0);
+			if (!irreversible)
+			{
+				band.exponent = (uint8_t)(image.bitDepth() + (mct ? 1 : 0) + gain);
+				band.mantissa = 0;
+				band.step = 1;
+			}
+			else
+			{
+				// steps inversely proportional to the norms spread the error evenly over the bands
+				int range = image.bitDepth() + gain;
+				int exponent;
+				double mantissa = frexp(baseStep / band.norm, &exponent);
+				// step = 2^(exponent - 1) * (1 + mantissa / 2^11)
+				int rounded = (int)floor((mantissa * 2 - 1) * 2048 + 0.5);
+				if (rounded == 2048)
+				{
+					rounded = 0;
+					exponent++;
+				}
+				band.exponent = (uint8_t)max(0, min(31, range - exponent + 1));
+				band.mantissa = (uint16_t)rounded;
+				band.step = ldexp(1 + rounded / 2048.0, range - band.exponent);
+			}
+			result.push_back(band);
+		}
+		return result;
+	}
+
+	// image domain weight of errors in each component, from the inverse component transform
+	double componentWeight(uint16_t component, bool mct, bool irreversible)
+	{
+		if (!mct || component > 2)
+		{
+			return 1;
+		}
+		static const double reversible[3] = { 3, 11.0 / 16, 11.0 / 16 };
+		static const double ict[3] = { 3, 0.34413 * 0.34413 + 1.772 * 1.772, 1.402 * 1.402 + 0.71414 * 0.71414 };
+		return irreversible ? ict[component] : reversible[component];
+	}
+
+	void initBand(Band& band, const BandQuantization& quantization, bool irreversible, double weight)
+	{
+		band.magnitudeBits = GUARD_BITS + quantization.exponent - 1u;
+		band.step = quantization.step;
+		band.fractionBits = irreversible ? max(0, min(FRACTION_BITS, 30 - (int)band.magnitudeBits)) : 0;
+		band.weight = weight * (quantization.step * quantization.norm) * (quantization.step * quantization.norm);
+	}
+
+	// precincts - PrecintSizes of COD, empty for the default partition
+	void layoutTileComponent(TileComponent& component, uint8_t levels, uint8_t xcb, uint8_t ycb, const vector<uint8_t>& precincts,
+		const vector<BandQuantization>& quantization, bool irreversible, double weight)
+	{
+		component.resolutions.resize(levels + 1);
+		for (uint32_t r = 0; r <= levels; r++)
+		{
+			Resolution& resolution = component.resolutions[r];
+			resolution.rect = component.rect.scaled(levels - r);
+
+			if (r == 0)
+			{
+				Band band;
+				band.orientation = CodeBlockEncoder::LL;
+				band.rect = resolution.rect;
+				band.bufferX = 0;
+				band.bufferY = 0;
+				initBand(band, quantization[0], irreversible, weight);
+				resolution.bands.push_back(band);
+			}
+			else
+			{
+				uint32_t level = levels - r + 1;
+				const Rect& low = component.resolutions[r - 1].rect;
+				for (int orientation = CodeBlockEncoder::HL; orientation <= CodeBlockEncoder::HH; orientation++)
+				{
+					uint32_t xob = orientation & 1;
+					uint32_t yob = orientation >> 1;
+					Band band;
+					band.orientation = (CodeBlockEncoder::Orientation)orientation;
+					band.rect.x0 = bandCoordinate(component.rect.x0, xob, level);
+					band.rect.y0 = bandCoordinate(component.rect.y0, yob, level);
+					band.rect.x1 = bandCoordinate(component.rect.x1, xob, level);
+					band.rect.y1 = bandCoordinate(component.rect.y1, yob, level);
+					band.bufferX = xob ? low.width() : 0;
+					band.bufferY = yob ? low.height() : 0;
+					initBand(band, quantization[3 * (r - 1) + orientation], irreversible, weight);
+					resolution.bands.push_back(band);
+				}
+			}
+
+			if (resolution.rect.empty())
+			{
+				continue;
+			}
+
+			// precincts of the resolution, mapped onto each sub-band (B.6 and B.7); code-blocks
+			// do not cross precinct boundaries
+			uint32_t ppx = precincts.empty() ? PRECINCT_EXPONENT : precincts[r] & 0xF;
+			uint32_t ppy = precincts.empty() ? PRECINCT_EXPONENT : precincts[r] >> 4;
+			uint32_t bandShiftX = r == 0 ? ppx : ppx - 1;
+			uint32_t bandShiftY = r == 0 ? ppy : ppy - 1;
+			uint8_t xcbr = (uint8_t)min<uint32_t>(xcb, bandShiftX);
+			uint8_t ycbr = (uint8_t)min<uint32_t>(ycb, bandShiftY);
+			uint32_t px0 = resolution.rect.x0 >> ppx;
+			uint32_t py0 = resolution.rect.y0 >> ppy;
+			uint32_t px1 = ceilDiv(resolution.rect.x1, (uint64_t)1 << ppx);
+			uint32_t py1 = ceilDiv(resolution.rect.y1, (uint64_t)1 << ppy);
+			for (uint32_t py = py0; py < py1; py++)
+			{
+				for (uint32_t px = px0; px < px1; px++)
+				{
+					vector<PrecinctBand> precinct(resolution.bands.size());
+					for (size_t b = 0; b < resolution.bands.size(); b++)
+					{
+						const Band& band = resolution.bands[b];
+						Rect region = { px << bandShiftX, py << bandShiftY, (uint32_t)min<uint64_t>(((uint64_t)px + 1) << bandShiftX, 0xFFFFFFFF),
+							(uint32_t)min<uint64_t>(((uint64_t)py + 1) << bandShiftY, 0xFFFFFFFF) };
+						region = region.intersect(band.rect);
+						PrecinctBand& precinctBand = precinct[b];
+						precinctBand.gridWidth = 0;
+						precinctBand.gridHeight = 0;
+						if (region.empty())
+						{
+							continue;
+						}
+
+						uint32_t gx0 = region.x0 >> xcbr;
+						uint32_t gy0 = region.y0 >> ycbr;
+						precinctBand.gridWidth = ceilDiv(region.x1, (uint64_t)1 << xcbr) - gx0;
+						precinctBand.gridHeight = ceilDiv(region.y1, (uint64_t)1 << ycbr) - gy0;
+						for (uint32_t gy = 0; gy < precinctBand.gridHeight; gy++)
+						{
+							for (uint32_t gx = 0; gx < precinctBand.gridWidth; gx++)
+							{
+								CodeBlock block;
+								Rect cell = { (gx0 + gx) << xcbr, (gy0 + gy) << ycbr, (gx0 + gx + 1) << xcbr, (gy0 + gy + 1) << ycbr };
+								block.rect = cell.intersect(region);
+								precinctBand.blocks.push_back(block);
+							}
+						}
+						precinctBand.inclusion.init(precinctBand.gridWidth, precinctBand.gridHeight);
+						precinctBand.zeroBitPlanes.init(precinctBand.gridWidth, precinctBand.gridHeight);
+					}
+					resolution.precincts.push_back(precinct);
+				}
+			}
+		}
+	}
+
+	// One dimensional 5/3 analysis (F.4.8.2) of count samples, stride apart, whose first
+	// sample sits at an odd (oddStart) or even coordinate. Low-pass results go first.
+	void analyse53(int32_t* data, uint32_t count, uint32_t stride, bool oddStart, vector<int32_t>& scratch)
+	{
+		if (count == 1)
+		{
+			if (oddStart)
+			{
+				data[0] *= 2;
+			}
+			return;
+		}
+
+		scratch.resize(count);
+		int32_t* x = scratch.data();
+		for (uint32_t k = 0; k < count; k++)
+		{
+			x[k] = data[(size_t)k * stride];
+		}
+
+		// symmetric extension: x[-1] = x[1], x[count] = x[count - 2]
+		int last = (int)count - 1;
+		uint32_t firstOdd = oddStart ? 0 : 1;
+		uint32_t firstEven = oddStart ? 1 : 0;
+		for (uint32_t k = firstOdd; k < count; k += 2)
+		{
+			int32_t left = x[k == 0 ? 1 : k - 1];
+			int32_t right = x[(int)k == last ? k - 1 : k + 1];
+			x[k] -= (left + right) >> 1;
+		}
+		for (uint32_t k = firstEven; k < count; k += 2)
+		{
+			int32_t left = x[k == 0 ? 1 : k - 1];
+			int32_t right = x[(int)k == last ? k - 1 : k + 1];
+			x[k] += (left + right + 2) >> 2;
+		}
+
+		uint32_t out = 0;
+		for (uint32_t k = firstEven; k < count; k += 2)
+		{
+			data[(size_t)(out++) * stride] = x[k];
+		}
+		for (uint32_t k = firstOdd; k < count; k += 2)
+		{
+			data[(size_t)(out++) * stride] = x[k];
+		}
+	}
+
+	// One dimensional 9/7 analysis (F.4.8.2), same layout as analyse53.
+	void analyse97(float* data, uint32_t count, uint32_t stride, bool oddStart, vector<float>& scratch)
+	{
+		if (count == 1)
+		{
+			if (oddStart)
+			{
+				data[0] *= 2;
+			}
+			return;
+		}
+
+		scratch.resize(count);
+		float* x = scratch.data();
+		for (uint32_t k = 0; k < count; k++)
+		{
+			x[k] = data[(size_t)k * stride];
+		}
+
+		int last = (int)count - 1;
+		uint32_t firstOdd = oddStart ? 0 : 1;
+		uint32_t firstEven = oddStart ? 1 : 0;
+		const float steps[4] = { (float)ALPHA, (float)BETA, (float)GAMMA, (float)DELTA };
+		for (int s = 0; s < 4; s++)
+		{
+			for (uint32_t k = (s & 1) == 0 ? firstOdd : firstEven; k < count; k += 2)
+			{
+				float left = x[k == 0 ? 1 : k - 1];
+				float right = x[(int)k == last ? k - 1 : k + 1];
+				x[k] += steps[s] * (left + right);
+			}
+		}
+
+		uint32_t out = 0;
+		for (uint32_t k = firstEven; k < count; k += 2)
+		{
+			data[(size_t)(out++) * stride] = x[k] * (float)(1 / K);
+		}
+		for (uint32_t k = firstOdd; k < count; k += 2)
+		{
+			data[(size_t)(out++) * stride] = x[k] * (float)K;
+		}
+	}
+
+	// 2D_SD of F.4.2 for every level, Mallat layout in place
+	template <typename T>
+	void forwardTransform(TileComponent& component, vector<T>& samples,
+		void (*analyse)(T* data, uint32_t count, uint32_t stride, bool oddStart, vector<T>& scratch))
+	{
+		uint32_t stride = component.rect.width();
+		uint32_t levels = (uint32_t)component.resolutions.size() - 1;
+		vector<T> scratch;
+		for (uint32_t level = 1; level <= levels; level++)
+		{
+			const Rect& region = component.resolutions[levels - level + 1].rect;
+			uint32_t width = region.width();
+			uint32_t height = region.height();
+			if (width == 0 || height == 0)
+			{
+				continue;
+			}
+			for (uint32_t x = 0; x < width; x++)
+			{
+				analyse(&samples[x], height, stride, (region.y0 & 1) != 0, scratch);
+			}
+			for (uint32_t y = 0; y < height; y++)
+			{
+				analyse(&samples[(size_t)y * stride], width, 1, (region.x0 & 1) != 0, scratch);
+			}
+		}
+	}
+
+	// deadzone scalar quantisation (E.1) of every sub-band, keeping FRACTION_BITS below the step
+	void quantize(TileComponent& component)
+	{
+		uint32_t stride = component.rect.width();
+		component.samples.resize(component.coefficients.size());
+		for (size_t r = 0; r < component.resolutions.size(); r++)
+		{
+			const vector<Band>& bands = component.resolutions[r].bands;
+			for (size_t b = 0; b < bands.size(); b++)
+			{
+				const Band& band = bands[b];
+				double scale = ldexp(1.0, band.fractionBits) / band.step;
+				for (uint32_t y = 0; y < band.rect.height(); y++)
+				{
+					size_t index = (size_t)(band.bufferY + y) * stride + band.bufferX;
+					for (uint32_t x = 0; x < band.rect.width(); x++, index++)
+					{
+						float value = component.coefficients[index];
+						int32_t magnitude = (int32_t)min(floor(fabs(value) * scale), 2147483647.0);
+						component.samples[index] = value < 0 ? -magnitude : magnitude;
+					}
+				}
+			}
+		}
+		vector<float>().swap(component.coefficients);
+	}
+
+	void transformTileComponent(TileComponent& component)
+	{
+		if (component.coefficients.empty())
+		{
+			forwardTransform(component, component.samples, analyse53);
+		}
+		else
+		{
+			forwardTransform(component, component.coefficients, analyse97);
+			quantize(component);
+		}
+	}
+
+	// level shift and the reversible (G.2) or irreversible (G.3) colour transform of the tile samples
+	void loadTileSamples(const PNMFile& image, Tile& tile, bool mct, bool irreversible)
+	{
+		int32_t shift = 1 << (image.bitDepth() - 1);
+		for (uint16_t c = 0; c < tile.components.size(); c++)
+		{
+			TileComponent& component = tile.components[c];
+			size_t count = (size_t)component.rect.width() * component.rect.height();
+			if (irreversible)
+			{
+				component.coefficients.resize(count);
+			}
+			else
+			{
+				component.samples.resize(count);
+			}
+			size_t index = 0;
+			for (uint32_t y = component.rect.y0; y < component.rect.y1; y++)
+			{
+				for (uint32_t x = component.rect.x0; x < component.rect.x1; x++)
+				{
+					int32_t value = (int32_t)image.sample(x, y, c) - shift;
+					if (irreversible)
+					{
+						component.coefficients[index++] = (float)value;
+					}
+					else
+					{
+						component.samples[index++] = value;
+					}
+				}
+			}
+		}
+
+		if (mct && irreversible)
+		{
+			vector<float>& red = tile.components[0].coefficients;
+			vector<float>& green = tile.components[1].coefficients;
+			vector<float>& blue = tile.components[2].coefficients;
+			for (size_t i = 0; i < red.size(); i++)
+			{
+				float r = red[i];
+				float g = green[i];
+				float b = blue[i];
+				red[i] = 0.299f * r + 0.587f * g + 0.114f * b;
+				green[i] = -0.16875f * r - 0.33126f * g + 0.5f * b;
+				blue[i] = 0.5f * r - 0.41869f * g - 0.08131f * b;
+			}
+		}
+		else if (mct)
+		{
+			vector<int32_t>& red = tile.components[0].samples;
+			vector<int32_t>& green = tile.components[1].samples;
+			vector<int32_t>& blue = tile.components[2].samples;
+			for (size_t i = 0; i < red.size(); i++)
+			{
+				int32_t r = red[i];
+				int32_t g = green[i];
+				int32_t b = blue[i];
+				red[i] = (r + 2 * g + b) >> 2;
+				green[i] = b - g;
+				blue[i] = r - g;
+			}
+		}
+	}
+
+	// upper convex hull of the (rate, distortion) pairs of the truncation points
+	void computeHull(CodeBlock& block)
+	{
+		const EncodedCodeBlock& encoded = block.encoded;
+		block.hull.clear();
+		vector<uint32_t> points(1, 0);
+		for (uint32_t k = 1; k <= encoded.passes(); k++)
+		{
+			double distortion = encoded.passDistortions[k - 1];
+			uint32_t rate = encoded.passLengths[k - 1];
+			if (distortion <= (points.back() == 0 ? 0 : encoded.passDistortions[points.back() - 1]))
+			{
+				continue;
+			}
+			while (points.size() > 1)
+			{
+				uint32_t j = points.back();
+				uint32_t i = points[points.size() - 2];
+				double rateJ = encoded.passLengths[j - 1];
+				double distortionJ = encoded.passDistortions[j - 1];
+				double rateI = i == 0 ? 0 : encoded.passLengths[i - 1];
+				double distortionI = i == 0 ? 0 : encoded.passDistortions[i - 1];
+				if (rate <= rateJ || (distortion - distortionJ) * (rateJ - rateI) >= (distortionJ - distortionI) * (rate - rateJ))
+				{
+					points.pop_back();
+					continue;
+				}
+				break;
+			}
+			if (rate == 0)
+			{
+				continue;
+			}
+			points.push_back(k);
+		}
+
+		for (size_t n = 1; n < points.size(); n++)
+		{
+			uint32_t i = points[n - 1];
+			uint32_t j = points[n];
+			double rate = encoded.passLengths[j - 1] - (i == 0 ? 0.0 : encoded.passLengths[i - 1]);
+			double distortion = encoded.passDistortions[j - 1] - (i == 0 ? 0 : encoded.passDistortions[i - 1]);
+			TruncationPoint point = { j, block.weight * distortion / rate };
+			block.hull.push_back(point);
+		}
+	}
+
+	void encodeCodeBlock(TileComponent& component, const Band& band, CodeBlock& block)
+	{
+		uint32_t stride = component.rect.width();
+		const int32_t* origin = &component.samples[(size_t)(band.bufferY + block.rect.y0 - band.rect.y0) * stride +
+			band.bufferX + block.rect.x0 - band.rect.x0];
+		CodeBlockEncoder coder;
+		coder.encode(origin, stride, block.rect.width(), block.rect.height(), band.orientation, band.fractionBits, block.encoded);
+		block.weight = band.weight;
+		computeHull(block);
+	}
+
+	// passes of the last hull point whose slope reaches threshold; a negative threshold takes every pass
+	uint32_t truncationPasses(const CodeBlock& block, double threshold)
+	{
+		if (threshold < 0)
+		{
+			return block.encoded.passes();
+		}
+		uint32_t passes = 0;
+		for (vector<TruncationPoint>::const_iterator it = block.hull.begin(); it != block.hull.end() && it->slope >= threshold; ++it)
+		{
+			passes = it->passes;
+		}
+		return passes;
+	}
+
+	void assignLayer(CodeBlock& block, uint16_t layer, double threshold)
+	{
+		uint32_t previous = layer == 0 ? 0 : block.layerPasses[layer - 1];
+		block.layerPasses[layer] = max(previous, truncationPasses(block, threshold));
+	}
+
+	inline uint32_t passBytes(const EncodedCodeBlock& encoded, uint32_t passes)
+	{
+		return passes == 0 ? 0 : encoded.passLengths[passes - 1];
+	}
+
+	// B.9 and B.10; returns the packet length and appends the packet to out when given
+	uint32_t writePacket(vector<PrecinctBand>& precinct, uint16_t layer, vector<uint8_t>* out, vector<uint8_t>* headers)
+	{
+		bool empty = true;
+		for (size_t b = 0; b < precinct.size(); b++)
+		{
+			for (size_t i = 0; i < precinct[b].blocks.size(); i++)
+			{
+				const CodeBlock& block = precinct[b].blocks[i];
+				if (block.layerPasses[layer] > (layer == 0 ? 0 : block.layerPasses[layer - 1]))
+				{
+					empty = false;
+				}
+			}
+		}
+
+		vector<uint8_t> header;
+		uint32_t bodyLength = 0;
+		PacketHeaderWriter bits(header);
+		bits.putBit(empty ? 0 : 1);
+		if (!empty)
+		{
+			for (size_t b = 0; b < precinct.size(); b++)
+			{
+				PrecinctBand& precinctBand = precinct[b];
+				for (uint32_t i = 0; i < precinctBand.blocks.size(); i++)
+				{
+					CodeBlock& block = precinctBand.blocks[i];
+					uint32_t previous = layer == 0 ? 0 : block.layerPasses[layer - 1];
+					uint32_t passes = block.layerPasses[layer] - previous;
+					bool contributes = passes > 0;
+					if (!block.included)
+					{
+						precinctBand.inclusion.encode(bits, i, layer + 1);
+					}
+					else
+					{
+						bits.putBit(contributes ? 1 : 0);
+					}
+					if (!contributes)
+					{
+						continue;
+					}
+					if (!block.included)
+					{
+						precinctBand.zeroBitPlanes.encode(bits, i, TagTreeEncoder::INFINITE);
+						block.included = true;
+					}
+					bits.putPassCount(passes);
+
+					uint32_t length = passBytes(block.encoded, previous + passes) - passBytes(block.encoded, previous);
+					int increment = (int)floorLog2(length) + 1 - (int)(block.lengthBits + floorLog2(passes));
+					increment = max(0, increment);
+					bits.putCommaCode(increment);
+					block.lengthBits += increment;
+					bits.putBits(length, block.lengthBits + floorLog2(passes));
+					bodyLength += length;
+				}
+			}
+		}
+		bits.flush();
+
+		if (headers != NULL)
+		{
+			headers->insert(headers->end(), header.begin(), header.end());
+		}
+		if (out != NULL)
+		{
+			if (headers == NULL)
+			{
+				out->insert(out->end(), header.begin(), header.end());
+			}
+			for (size_t b = 0; b < precinct.size(); b++)
+			{
+				for (size_t i = 0; i < precinct[b].blocks.size(); i++)
+				{
+					const CodeBlock& block = precinct[b].blocks[i];
+					const vector<uint8_t>& data = block.encoded.data;
+					uint32_t previous = layer == 0 ? 0 : block.layerPasses[layer - 1];
+					out->insert(out->end(), data.begin() + passBytes(block.encoded, previous),
+						data.begin() + passBytes(block.encoded, block.layerPasses[layer]));
+				}
+			}
+		}
+		return (uint32_t)header.size() + bodyLength;
+	}
+
+	// Packets of the first layerCount layers in LRCP order; returns their length and
+	// appends them to out and each packet length to lengths when given. With headers
+	// the packet headers go there instead (packed packet headers) and lengths only
+	// count the bodies. Coding state starts afresh on every call.
+	uint64_t writePackets(Tile& tile, uint16_t layerCount, vector<uint8_t>* out, vector<uint32_t>* lengths = NULL,
+		vector<uint8_t>* headers = NULL)
+	{
+		// tag tree leaves are only known after rate allocation
+		for (size_t c = 0; c < tile.components.size(); c++)
+		{
+			vector<Resolution>& resolutions = tile.components[c].resolutions;
+			for (size_t r = 0; r < resolutions.size(); r++)
+			{
+				for (size_t p = 0; p < resolutions[r].precincts.size(); p++)
+				{
+					vector<PrecinctBand>& precinct = resolutions[r].precincts[p];
+					for (size_t b = 0; b < precinct.size(); b++)
+					{
+						PrecinctBand& precinctBand = precinct[b];
+						precinctBand.inclusion.init(precinctBand.gridWidth, precinctBand.gridHeight);
+						precinctBand.zeroBitPlanes.init(precinctBand.gridWidth, precinctBand.gridHeight);
+						for (uint32_t i = 0; i < precinctBand.blocks.size(); i++)
+						{
+							CodeBlock& block = precinctBand.blocks[i];
+							block.lengthBits = 3;
+							block.included = false;
+							for (uint16_t layer = 0; layer < layerCount; layer++)
+							{
+								if (block.layerPasses[layer] > 0)
+								{
+									precinctBand.inclusion.setValue(i, layer);
+									break;
+								}
+							}
+							precinctBand.zeroBitPlanes.setValue(i, resolutions[r].bands[b].magnitudeBits - block.encoded.bitPlanes);
+						}
+					}
+				}
+			}
+		}
+
+		uint64_t result = 0;
+		size_t resolutionCount = tile.components.empty() ? 0 : tile.components[0].resolutions.size();
+		for (uint16_t layer = 0; layer < layerCount; layer++)
+		{
+			for (size_t r = 0; r < resolutionCount; r++)
+			{
+				for (size_t c = 0; c < tile.components.size(); c++)
+				{
+					Resolution& resolution = tile.components[c].resolutions[r];
+					for (size_t p = 0; p < resolution.precincts.size(); p++)
+					{
+						size_t packed = headers != NULL ? headers->size() : 0;
+						uint32_t length = writePacket(resolution.precincts[p], layer, out, headers);
+						if (lengths != NULL)
+						{
+							lengths->push_back(length - (uint32_t)(headers != NULL ? headers->size() - packed : 0));
+						}
+						result += length;
+					}
+				}
+			}
+		}
+		return result;
+	}
+
+	// PLT segments for lengths and PPT segments for headers, as many as their 16 bit
+	// lengths need
+	void addTilePartMarkers(TilePart& part, const vector<uint32_t>& lengths, const vector<uint8_t>& headers)
+	{
+		for (size_t i = 0; i < headers.size(); i += PackedPacketHeadersTile::MAXIMUM_LENGTH)
+		{
+			shared_ptr<PackedPacketHeadersTile> ppt(new PackedPacketHeadersTile());
+			ppt->Zppt = (uint8_t)(i / PackedPacketHeadersTile::MAXIMUM_LENGTH);
+			ppt->Raw.assign(headers.begin() + i, headers.begin() + min(headers.size(), i + PackedPacketHeadersTile::MAXIMUM_LENGTH));
+			ppt->Lppt = (uint16_t)(3 + ppt->Raw.size());
+			part.markers.push_back(ppt);
+		}
+
+		shared_ptr<PacketLengthTilePartHeader> plt;
+		uint8_t index = 0;
+		for (size_t i = 0; i < lengths.size(); i++)
+		{
+			PacketLength length(lengths[i]);
+			if (!plt || plt->size() + length.size() > 65537)
+			{
+				plt.reset(new PacketLengthTilePartHeader());
+				plt->Zplt = index++;
+				part.markers.push_back(plt);
+			}
+			plt->packetLengths.push_back(length);
+			plt->Lplt = (uint16_t)(plt->size() - 2);
+		}
+	}
+
+	void writeTilePart(Tile& tile, uint16_t layerCount, bool packetLengths, bool packedHeaders, TilePart& part)
+	{
+		part.Isot = tile.index;
+		part.TPsot = 0;
+		part.TNsot = 1;
+		part.markers.clear();
+		part.Raw.clear();
+		part.Raw.push_back((uint8_t)(J2KMarkers::SOD >> 8));
+		part.Raw.push_back((uint8_t)J2KMarkers::SOD);
+		vector<uint32_t> lengths;
+		vector<uint8_t> headers;
+		writePackets(tile, layerCount, &part.Raw, packetLengths ? &lengths : NULL, packedHeaders ? &headers : NULL);
+		addTilePartMarkers(part, lengths, headers);
+	}
+
+	template <typename F>
+	void forEachCodeBlock(Tile& tile, F f)
+	{
+		for (size_t c = 0; c < tile.components.size(); c++)
+		{
+			vector<Resolution>& resolutions = tile.components[c].resolutions;
+			for (size_t r = 0; r < resolutions.size(); r++)
+			{
+				for (size_t p = 0; p < resolutions[r].precincts.size(); p++)
+				{
+					for (size_t b = 0; b < resolutions[r].precincts[p].size(); b++)
+					{
+						vector<CodeBlock>& blocks = resolutions[r].precincts[p][b].blocks;
+						for (size_t i = 0; i < blocks.size(); i++)
+						{
+							f(blocks[i]);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Post-compression rate-distortion optimisation: one slope threshold per layer for the
+	// whole image, found by bisection over the hull slopes of every code-block.
+	class RateAllocator
+	{
+		vector<shared_ptr<Tile> >& tiles;
+		TaskScheduler& scheduler;
+		bool packetLengths;
+		bool packedHeaders;
+		vector<CodeBlock*> blocks;
+		// candidate thresholds, steepest first
+		vector<double> slopes;
+		// SOC, main header, EOC
+		uint64_t mainBytes;
+		double peak;
+		double sampleCount;
+		// squared error of rounding what the 9/7 synthesis reconstructs to integer
+		// samples, 1/12 each; the wavelet domain estimates leave it out
+		double roundingError;
+		double lastThreshold;
+
+		void assign(uint16_t layer, double threshold)
+		{
+			for (size_t i = 0; i < blocks.size(); i++)
+			{
+				assignLayer(*blocks[i], layer, threshold);
+			}
+		}
+
+		// codestream length up to the end of layer
+		uint64_t size(uint16_t layer)
+		{
+			vector<uint64_t> tileBytes(tiles.size());
+			scheduler.parallelFor(0, tiles.size(), 1, [&](size_t t)
+			{
+				vector<uint32_t> lengths;
+				vector<uint8_t> headers;
+				tileBytes[t] = 14 + writePackets(*tiles[t], layer + 1, NULL, packetLengths ? &lengths : NULL, packedHeaders ? &headers : NULL);
+				if (!lengths.empty() || !headers.empty())
+				{
+					// the PPT segments hold headers already counted
+					TilePart part;
+					addTilePartMarkers(part, lengths, headers);
+					tileBytes[t] += part.size() - 12 - headers.size();
+				}
+			});
+			uint64_t result = mainBytes;
+			for (size_t t = 0; t < tileBytes.size(); t++)
+			{
+				result += tileBytes[t];
+			}
+			return result;
+		}
+
+		double psnr(uint16_t layer) const
+		{
+			double error = 0;
+			for (size_t i = 0; i < blocks.size(); i++)
+			{
+				const CodeBlock& block = *blocks[i];
+				uint32_t passes = block.layerPasses[layer];
+				error += block.weight * (block.encoded.distortion - (passes == 0 ? 0 : block.encoded.passDistortions[passes - 1]));
+			}
+			error += roundingError;
+			return error <= 0 ? 1e9 : 10 * log10(peak * peak * sampleCount / error);
+		}
+
+	public:
+		RateAllocator(vector<shared_ptr<Tile> >& tiles, uint16_t layerCount, uint64_t mainBytes, double peak,
+			double sampleCount, bool irreversible, bool packetLengths, bool packedHeaders, TaskScheduler& scheduler)
+			: tiles(tiles), scheduler(scheduler), packetLengths(packetLengths), packedHeaders(packedHeaders),
+			mainBytes(mainBytes), peak(peak), sampleCount(sampleCount), roundingError(irreversible ? sampleCount / 12 : 0),
+			lastThreshold(HUGE_VAL)
+		{
+			for (size_t t = 0; t < tiles.size(); t++)
+			{
+				forEachCodeBlock(*tiles[t], [&](CodeBlock& block)
+				{
+					block.layerPasses.assign(layerCount, 0);
+					blocks.push_back(&block);
+					for (size_t k = 0; k < block.hull.size(); k++)
+					{
+						slopes.push_back(block.hull[k].slope);
+					}
+				});
+			}
+			sort(slopes.begin(), slopes.end(), greater<double>());
+			slopes.erase(unique(slopes.begin(), slopes.end()), slopes.end());
+		}
+
+		// Layer closes at the largest size not above bytes; earlier layers must be allocated.
+		void allocateBytes(uint16_t layer, uint64_t bytes)
+		{
+			// thresholds may only fall from one layer to the next;
+			// nothing new in this layer unless a candidate fits
+			size_t low = lower_bound(slopes.begin(), slopes.end(), lastThreshold, greater<double>()) - slopes.begin();
+			double threshold = lastThreshold;
+			size_t high = slopes.size();
+			while (low < high)
+			{
+				size_t middle = low + (high - low) / 2;
+				assign(layer, slopes[middle]);
+				if (size(layer) <= bytes)
+				{
+					threshold = slopes[middle];
+					low = middle + 1;
+				}
+				else
+				{
+					high = middle;
+				}
+			}
+			assign(layer, threshold);
+			lastThreshold = threshold;
+		}
+
+		// Layer closes at the smallest size reaching decibels.
+		void allocatePsnr(uint16_t layer, double decibels)
+		{
+			size_t low = lower_bound(slopes.begin(), slopes.end(), lastThreshold, greater<double>()) - slopes.begin();
+			// every pass when no candidate gets there
+			double threshold = -1;
+			size_t high = slopes.size();
+			while (low < high)
+			{
+				size_t middle = low + (high - low) / 2;
+				assign(layer, slopes[middle]);
+				if (psnr(layer) >= decibels)
+				{
+					threshold = slopes[middle];
+					high = middle;
+				}
+				else
+				{
+					low = middle + 1;
+				}
+			}
+			assign(layer, threshold);
+			lastThreshold = threshold;
+		}
+
+		void allocateAll(uint16_t layer)
+		{
+			assign(layer, -1);
+			lastThreshold = -1;
+		}
+
+		uint64_t fullSize(uint16_t layerCount)
+		{
+			for (uint16_t layer = 0; layer < layerCount; layer++)
+			{
+				assign(layer, -1);
+			}
+			return size(layerCount - 1);
+		}
+	};
+}
+
+void TilePartWriter::write(size_t sequence, const TilePart& tile)
+{
+	boost::mutex::scoped_lock guard(lock);
+	if (sequence != next)
+	{
+		pending.insert(make_pair(sequence, tile));
+		return;
+	}
+	tile.save(stream);
+	next++;
+
+	map<size_t, TilePart>::iterator it;
+	while ((it = pending.find(next)) != pending.end())
+	{
+		it->second.save(stream);
+		pending.erase(it);
+		next++;
+	}
+}
+
+ErrorCode J2KEncoder::prepare(const PNMFile& image, J2KFile& file) const
+{
+	if (image.width == 0 || image.height == 0 || image.components == 0 || image.maxValue == 0 ||
+		image.samples.size() != (size_t)image.width * image.height * image.components ||
+		options.codeBlockWidthExponent < 2 || options.codeBlockHeightExponent < 2 ||
+		options.codeBlockWidthExponent + options.codeBlockHeightExponent > 12 ||
+		options.layers == 0 || options.layerBytes.size() > options.layers || options.layerPsnr.size() > options.layers ||
+		(options.irreversible && !(options.quantizationStep > 0)) || options.precinctExponent > 15)
+	{
+		return ENCODER_UNSUPPORTED_IMAGE;
+	}
+
+	Header& header = file.header;
+	header.Csiz = image.components;
+	header.Lsiz = 38 + 3 * header.Csiz;
+	header.Rsiz = 0;
+	header.Xsiz = image.width;
+	header.Ysiz = image.height;
+	header.XOsiz = 0;
+	header.YOsiz = 0;
+	header.XTsiz = options.tileWidth != 0 ? min(options.tileWidth, image.width) : image.width;
+	header.YTsiz = options.tileHeight != 0 ? min(options.tileHeight, image.height) : image.height;
+	header.XTOsiz = 0;
+	header.YTOsiz = 0;
+	// Isot has 16 bits
+	if ((uint64_t)ceilDiv(header.Xsiz, header.XTsiz) * ceilDiv(header.Ysiz, header.YTsiz) > 65535)
+	{
+		return ENCODER_UNSUPPORTED_IMAGE;
+	}
+	header.Components.clear();
+	for (uint16_t c = 0; c < image.components; c++)
+	{
+		ComponentHeader component;
+		component.Ssiz = image.bitDepth() - 1;
+		component.XRsiz = 1;
+		component.YRsiz = 1;
+		header.Components.push_back(component);
+	}
+
+	// no more levels than the nominal tile size can carry
+	uint8_t levels = options.decompositionLevels;
+	while (levels > 0 && (min(header.XTsiz, header.YTsiz) >> levels) == 0)
+	{
+		levels--;
+	}
+	bool mct = image.components >= 3;
+
+	CodingStyleDefault& cod = file.codingStyleDefault;
+	cod.Lcod = 12;
+	cod.Scod = 0;
+	cod.ProgressionOrder = 0;
+	cod.NumberOfLayers = options.layers;
+	cod.MultipleComponentTransformation = mct ? 1 : 0;
+	cod.NumberOfDecompositionLevels = levels;
+	cod.CodeBlockWidth = options.codeBlockWidthExponent - 2;
+	cod.CodeBlockHeight = options.codeBlockHeightExponent - 2;
+	cod.CodeBlockStyle = 0;
+	cod.Transformation = options.irreversible ? 0 : 1;
+	cod.PrecintSizes.clear();
+	if (options.precinctExponent != 0)
+	{
+		// the LL band of resolution 0 may use 2^0, the others need at least 2^1
+		cod.Scod |= 1;
+		for (uint8_t r = 0; r <= levels; r++)
+		{
+			uint8_t exponent = r == 0 ? options.precinctExponent : max<uint8_t>(options.precinctExponent, 1);
+			cod.PrecintSizes.push_back((uint8_t)(exponent | (exponent << 4)));
+		}
+		cod.Lcod = (uint16_t)(12 + cod.PrecintSizes.size());
+	}
+
+	QuantizationDefaultParameter& qcd = file.quantizationDefaultParameter;
+	vector<BandQuantization> quantization = bandQuantization(image, levels, mct, options.irreversible, options.quantizationStep);
+	// no quantisation or scalar expounded
+	qcd.Sqcd = (GUARD_BITS << 5) | (options.irreversible ? 2 : 0);
+	qcd.Raw.clear();
+	for (vector<BandQuantization>::const_iterator it = quantization.begin(); it != quantization.end(); ++it)
+	{
+		if (options.irreversible)
+		{
+			uint16_t value = (uint16_t)((it->exponent << 11) | it->mantissa);
+			qcd.Raw.push_back((uint8_t)(value >> 8));
+			qcd.Raw.push_back((uint8_t)value);
+		}
+		else
+		{
+			qcd.Raw.push_back(it->exponent << 3);
+		}
+	}
+	qcd.Lqcd = (uint16_t)(3 + qcd.Raw.size());
+
+	file.capabilities = boost::none;
+	file.comments.clear();
+	file.componentQccs.clear();
+	file.segments.clear();
+	file.tiles.clear();
+	return SUCCESS;
+}
+
+ErrorCode J2KEncoder::encode(const PNMFile& image, J2KFile& file) const
+{
+	ErrorCode result = prepare(image, file);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	uint32_t tilesX = ceilDiv(file.header.Xsiz, file.header.XTsiz);
+	uint32_t tilesY = ceilDiv(file.header.Ysiz, file.header.YTsiz);
+	file.tiles.resize((size_t)tilesX * tilesY);
+	encodeTiles(image, file, [&file](size_t sequence, const TilePart& tile)
+	{
+		file.tiles[sequence] = tile;
+	});
+	return SUCCESS;
+}
+
+ErrorCode J2KEncoder::encode(const PNMFile& image, ostream& stream) const
+{
+	J2KFile file;
+	ErrorCode result = prepare(image, file);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	file.saveHeader(stream);
+	TilePartWriter writer(stream);
+	encodeTiles(image, file, [&writer](size_t sequence, const TilePart& tile)
+	{
+		writer.write(sequence, tile);
+	});
+	JpegAccess::WriteUint16(stream, J2KFile::EOC);
+	return SUCCESS;
+}
+
+void J2KEncoder::encodeTiles(const PNMFile& image, const J2KFile& file, const TilePartSink& sink) const
+{
+	const Header& header = file.header;
+	const CodingStyleDefault& cod = file.codingStyleDefault;
+	bool mct = cod.usesMultipleComponentTransformation();
+	bool irreversible = cod.Transformation == 0;
+	uint8_t levels = cod.NumberOfDecompositionLevels;
+	uint8_t xcb = cod.CodeBlockWidth + 2;
+	uint8_t ycb = cod.CodeBlockHeight + 2;
+	uint16_t layers = cod.NumberOfLayers;
+	vector<BandQuantization> quantization = bandQuantization(image, levels, mct, irreversible, options.quantizationStep);
+
+	uint32_t tilesX = ceilDiv(header.Xsiz - header.XTOsiz, header.XTsiz);
+	uint32_t tilesY = ceilDiv(header.Ysiz - header.YTOsiz, header.YTsiz);
+	vector<shared_ptr<Tile> > tiles;
+	for (uint32_t q = 0; q < tilesY; q++)
+	{
+		for (uint32_t p = 0; p < tilesX; p++)
+		{
+			shared_ptr<Tile> tile(new Tile());
+			tile->index = (uint16_t)(q * tilesX + p);
+			tile->rect.x0 = max(header.XTOsiz + p * header.XTsiz, header.XOsiz);
+			tile->rect.y0 = max(header.YTOsiz + q * header.YTsiz, header.YOsiz);
+			tile->rect.x1 = min(header.XTOsiz + (p + 1) * header.XTsiz, header.Xsiz);
+			tile->rect.y1 = min(header.YTOsiz + (q + 1) * header.YTsiz, header.Ysiz);
+			tile->components.resize(header.Csiz);
+			for (uint16_t c = 0; c < header.Csiz; c++)
+			{
+				tile->components[c].rect = tile->rect;
+				layoutTileComponent(tile->components[c], levels, xcb, ycb, cod.PrecintSizes, quantization, irreversible,
+					componentWeight(c, mct, irreversible));
+			}
+			tiles.push_back(tile);
+		}
+	}
+
+	// Per tile: samples -> wavelet per component -> tier-1 per code-block -> tier-2.
+	// A single layer holding every pass goes out tile by tile; anything else needs
+	// every code-block coded before the layers can be allocated.
+	bool rateControl = layers > 1 || !options.layerBytes.empty() || !options.layerPsnr.empty();
+	TaskScheduler scheduler(options.threads);
+	TaskGroup group;
+	for (size_t t = 0; t < tiles.size(); t++)
+	{
+		Tile* tile = tiles[t].get();
+		TaskPtr samples = scheduler.createTask([&image, tile, mct, irreversible]()
+		{
+			loadTileSamples(image, *tile, mct, irreversible);
+		});
+		TaskPtr packets;
+		if (!rateControl)
+		{
+			bool packetLengths = options.packetLengths;
+			bool packedHeaders = options.packedHeaders;
+			packets = scheduler.createTask([tile, t, packetLengths, packedHeaders, &sink]()
+			{
+				TilePart part;
+				writeTilePart(*tile, 1, packetLengths, packedHeaders, part);
+				sink(t, part);
+				tile->components.clear();
+			});
+		}
+
+		for (size_t c = 0; c < tile->components.size(); c++)
+		{
+			TileComponent* component = &tile->components[c];
+			TaskPtr transform = scheduler.createTask([component]()
+			{
+				transformTileComponent(*component);
+			});
+			scheduler.addDependency(transform, samples);
+
+			for (size_t r = 0; r < component->resolutions.size(); r++)
+			{
+				Resolution& resolution = component->resolutions[r];
+				for (size_t p = 0; p < resolution.precincts.size(); p++)
+				{
+					for (size_t b = 0; b < resolution.precincts[p].size(); b++)
+					{
+						const Band* band = &resolution.bands[b];
+						vector<CodeBlock>& blocks = resolution.precincts[p][b].blocks;
+						for (size_t i = 0; i < blocks.size(); i++)
+						{
+							CodeBlock* block = &blocks[i];
+							TaskPtr tier1 = scheduler.createTask([component, band, block]()
+							{
+								encodeCodeBlock(*component, *band, *block);
+								block->layerPasses.assign(1, block->encoded.passes());
+							});
+							scheduler.addDependency(tier1, transform);
+							if (packets)
+							{
+								scheduler.addDependency(packets, tier1);
+							}
+							scheduler.submit(tier1, group);
+						}
+					}
+				}
+			}
+			if (packets)
+			{
+				scheduler.addDependency(packets, transform);
+			}
+			scheduler.submit(transform, group);
+		}
+		if (packets)
+		{
+			scheduler.submit(packets, group);
+		}
+		scheduler.submit(samples, group);
+	}
+	scheduler.wait(group);
+	if (!rateControl)
+	{
+		return;
+	}
+
+	uint64_t mainBytes = file.size();
+	BOOST_FOREACH(const TilePart& tile, file.tiles)
+	{
+		mainBytes -= tile.size();
+	}
+	RateAllocator allocator(tiles, layers, mainBytes, (double)((1u << image.bitDepth()) - 1),
+		(double)image.width * image.height * image.components, irreversible, options.packetLengths, options.packedHeaders, scheduler);
+	// without targets every layer doubles the size of the one before
+	bool targets = false;
+	for (uint16_t layer = 0; layer < layers; layer++)
+	{
+		targets |= (layer < options.layerBytes.size() && options.layerBytes[layer] != 0) ||
+			(layer < options.layerPsnr.size() && options.layerPsnr[layer] > 0);
+	}
+	uint64_t fullSize = targets ? 0 : allocator.fullSize(layers);
+	for (uint16_t layer = 0; layer < layers; layer++)
+	{
+		if (layer < options.layerBytes.size() && options.layerBytes[layer] != 0)
+		{
+			allocator.allocateBytes(layer, options.layerBytes[layer]);
+		}
+		else if (layer < options.layerPsnr.size() && options.layerPsnr[layer] > 0)
+		{
+			allocator.allocatePsnr(layer, options.layerPsnr[layer]);
+		}
+		else if (!targets && layer + 1 < layers)
+		{
+			allocator.allocateBytes(layer, fullSize >> (layers - 1 - layer));
+		}
+		else
+		{
+			allocator.allocateAll(layer);
+		}
+	}
+
+	scheduler.parallelFor(0, tiles.size(), 1, [&](size_t t)
+	{
+		TilePart part;
+		writeTilePart(*tiles[t], layers, options.packetLengths, options.packedHeaders, part);
+		sink(t, part);
+		tiles[t]->components.clear();
+	});
+}
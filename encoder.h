@@ -0,0 +1,100 @@
+#ifndef _ENCODER_H_
+#define _ENCODER_H_
+
+#include <boost\cstdint.hpp>
+#include <boost\thread.hpp>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <vector>
+#include "common.h"
+#include "j2k.h"
+#include "pnm.h"
+
+namespace BJPEG
+{
+
+class EncoderOptions
+{
+public:
+	// 0 - a single tile covering the whole image
+	uint32_t tileWidth;
+	uint32_t tileHeight;
+	uint8_t decompositionLevels;
+	uint8_t codeBlockWidthExponent;
+	uint8_t codeBlockHeightExponent;
+	// 9/7 wavelet with irreversible colour transform and scalar quantisation
+	bool irreversible;
+	// irreversible path: step size in sample units; sub-band steps are scaled
+	// by the norms of their synthesis basis functions
+	float quantizationStep;
+	uint16_t layers;
+	// codestream size at the end of each layer, 0 - no byte target
+	std::vector<uint64_t> layerBytes;
+	// PSNR in dB each layer has to reach, used for layers without a byte target;
+	// estimated from the code-block distortions weighted by the synthesis norms,
+	// so decoded images may fall short of it by up to about 0.15 dB
+	std::vector<double> layerPsnr;
+	// 2^n x 2^n precincts in every resolution, 0 - the default partition of 2^15
+	uint8_t precinctExponent;
+	// PLT marker segments in every tile part, so packets can be found without
+	// decoding their headers
+	bool packetLengths;
+	// packet headers in PPT marker segments instead of in front of the packet
+	// bodies, so they can be read without touching the bodies
+	bool packedHeaders;
+	// 0 - one worker per hardware thread
+	unsigned threads;
+
+	EncoderOptions() : tileWidth(0), tileHeight(0), decompositionLevels(5),
+		codeBlockWidthExponent(6), codeBlockHeightExponent(6), irreversible(false),
+		quantizationStep(1), layers(1), precinctExponent(0), packetLengths(false), packedHeaders(false), threads(0)
+	{
+	}
+};
+
+// Writes tile parts that are finished in any order: a tile part goes to the
+// stream as soon as all tile parts before it have been written.
+class TilePartWriter
+{
+	std::ostream& stream;
+	size_t next;
+	std::map<size_t, TilePart> pending;
+	boost::mutex lock;
+
+public:
+	TilePartWriter(std::ostream& stream) : stream(stream), next(0) {}
+
+	void write(size_t sequence, const TilePart& tile);
+};
+
+// Encoder: reversible (5/3) or irreversible (9/7) path, EBCOT tier-1, quality
+// layers in LRCP order. Tiles, components and code-blocks are coded as separate
+// tasks on a TaskScheduler. Layers are formed by post-compression rate-distortion
+// optimisation once every code-block is coded; without layers or targets each
+// tile is written as soon as its code-blocks are done.
+class J2KEncoder
+{
+public:
+	EncoderOptions options;
+
+	J2KEncoder(const EncoderOptions& options = EncoderOptions()) : options(options) {}
+
+	// Fills SIZ, COD and QCD of file for image under the current options.
+	ErrorCode prepare(const PNMFile& image, J2KFile& file) const;
+
+	// Encodes into file.tiles.
+	ErrorCode encode(const PNMFile& image, J2KFile& file) const;
+
+	// Writes the codestream, each tile part as soon as it is ready.
+	ErrorCode encode(const PNMFile& image, std::ostream& stream) const;
+
+private:
+	typedef std::function<void(size_t sequence, const TilePart& tile)> TilePartSink;
+
+	void encodeTiles(const PNMFile& image, const J2KFile& file, const TilePartSink& sink) const;
+};
+
+}
+
+#endif /*_ENCODER_H_*/
@@ -0,0 +1,227 @@
+#include "instrument.h"
+#include <boost\atomic.hpp>
+#include <boost\chrono.hpp>
+#include <boost\thread.hpp>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+
+const char* const STAGE_NAMES[STAGE_COUNT] =
+{
+	"read_file", "load_header", "load_tile_part", "save_header", "save_tile_part", "write_file"
+};
+
+const char* const OPERATION_NAMES[OPERATION_COUNT] = { "load", "save" };
+
+// marker segments are counted by the low byte of their marker
+const size_t MARKERS = 256;
+
+class StageEvent
+{
+public:
+	InstrumentStage stage;
+	int32_t tile;
+	boost::thread::id thread;
+	uint64_t start;
+	uint64_t end;
+};
+
+// zero before any hook runs, as objects of static storage
+boost::atomic<uint64_t> segmentBytes[OPERATION_COUNT][MARKERS];
+boost::atomic<uint64_t> segmentTime[OPERATION_COUNT][MARKERS];
+boost::atomic<uint64_t> segmentCount[OPERATION_COUNT][MARKERS];
+boost::atomic<uint64_t> stageTime[STAGE_COUNT];
+boost::atomic<uint64_t> stageCount[STAGE_COUNT];
+boost::atomic<uint64_t> allocations;
+boost::atomic<uint64_t> allocatedBytes;
+
+// the last MAXIMUM_EVENTS runs, allocated with the first one
+boost::mutex eventLock;
+vector<StageEvent> events;
+uint64_t loggedEvents;
+
+string markerName(uint8_t marker)
+{
+	switch (0xFF00 | marker)
+	{
+	case 0xFF4F: return "SOC";
+	case 0xFF50: return "CAP";
+	case 0xFF51: return "SIZ";
+	case 0xFF52: return "COD";
+	case 0xFF53: return "COC";
+	case 0xFF55: return "TLM";
+	case 0xFF57: return "PLM";
+	case 0xFF58: return "PLT";
+	case 0xFF5C: return "QCD";
+	case 0xFF5D: return "QCC";
+	case 0xFF5E: return "RGN";
+	case 0xFF5F: return "POC";
+	case 0xFF60: return "PPM";
+	case 0xFF61: return "PPT";
+	case 0xFF63: return "CRG";
+	case 0xFF64: return "COM";
+	case 0xFF90: return "SOT";
+	case 0xFF93: return "SOD";
+	}
+	ostringstream name;
+	name << "0xFF" << hex << uppercase << (marker >> 4) << (marker & 0xF);
+	return name.str();
+}
+
+void writeCounter(ostream& stream, const char* name, const char* help, const char* type)
+{
+	stream << "# HELP " << name << ' ' << help << '\n';
+	stream << "# TYPE " << name << ' ' << type << '\n';
+}
+
+void writeSegments(ostream& stream, const char* name, boost::atomic<uint64_t> (&values)[OPERATION_COUNT][MARKERS], double scale)
+{
+	for (int operation = 0; operation < OPERATION_COUNT; operation++)
+	{
+		for (size_t marker = 0; marker < MARKERS; marker++)
+		{
+			if (segmentCount[operation][marker].load(boost::memory_order_relaxed) == 0)
+			{
+				continue;
+			}
+			stream << name << "{operation=\"" << OPERATION_NAMES[operation] << "\",marker=\"" << markerName((uint8_t)marker) << "\"} ";
+			stream << values[operation][marker].load(boost::memory_order_relaxed) * scale << '\n';
+		}
+	}
+}
+
+}
+
+uint64_t Instrumentation::now()
+{
+	return boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Instrumentation::segment(InstrumentOperation operation, uint16_t marker, uint64_t bytes, uint64_t nanoseconds)
+{
+	uint8_t index = (uint8_t)marker;
+	segmentBytes[operation][index].fetch_add(bytes, boost::memory_order_relaxed);
+	segmentTime[operation][index].fetch_add(nanoseconds, boost::memory_order_relaxed);
+	segmentCount[operation][index].fetch_add(1, boost::memory_order_relaxed);
+}
+
+void Instrumentation::allocation(uint64_t bytes)
+{
+	allocations.fetch_add(1, boost::memory_order_relaxed);
+	allocatedBytes.fetch_add(bytes, boost::memory_order_relaxed);
+}
+
+void Instrumentation::stage(InstrumentStage stage, int32_t tile, uint64_t start, uint64_t end)
+{
+	stageTime[stage].fetch_add(end - start, boost::memory_order_relaxed);
+	stageCount[stage].fetch_add(1, boost::memory_order_relaxed);
+
+	boost::thread::id thread = boost::this_thread::get_id();
+	boost::mutex::scoped_lock guard(eventLock);
+	if (events.empty())
+	{
+		events.resize(MAXIMUM_EVENTS);
+	}
+	StageEvent& event = events[loggedEvents++ % MAXIMUM_EVENTS];
+	event.stage = stage;
+	event.tile = tile;
+	event.thread = thread;
+	event.start = start;
+	event.end = end;
+}
+
+void Instrumentation::reset()
+{
+	for (int operation = 0; operation < OPERATION_COUNT; operation++)
+	{
+		for (size_t marker = 0; marker < MARKERS; marker++)
+		{
+			segmentBytes[operation][marker].store(0, boost::memory_order_relaxed);
+			segmentTime[operation][marker].store(0, boost::memory_order_relaxed);
+			segmentCount[operation][marker].store(0, boost::memory_order_relaxed);
+		}
+	}
+	for (int stage = 0; stage < STAGE_COUNT; stage++)
+	{
+		stageTime[stage].store(0, boost::memory_order_relaxed);
+		stageCount[stage].store(0, boost::memory_order_relaxed);
+	}
+	allocations.store(0, boost::memory_order_relaxed);
+	allocatedBytes.store(0, boost::memory_order_relaxed);
+
+	boost::mutex::scoped_lock guard(eventLock);
+	loggedEvents = 0;
+}
+
+void Instrumentation::writeTrace(ostream& stream)
+{
+	boost::mutex::scoped_lock guard(eventLock);
+	size_t count = (size_t)min(loggedEvents, (uint64_t)MAXIMUM_EVENTS);
+	size_t first = (size_t)(loggedEvents - count);
+	uint64_t origin = count == 0 ? 0 : events[first % MAXIMUM_EVENTS].start;
+	// trace thread numbers, in the order threads appear
+	map<boost::thread::id, uint32_t> threads;
+	for (size_t i = 0; i < count; i++)
+	{
+		const StageEvent& event = events[(first + i) % MAXIMUM_EVENTS];
+		origin = min(origin, event.start);
+		threads.insert(make_pair(event.thread, (uint32_t)threads.size()));
+	}
+
+	// timestamps in microseconds from the first run
+	ostringstream json;
+	json.setf(ios::fixed);
+	json.precision(3);
+	json << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	for (size_t i = 0; i < count; i++)
+	{
+		const StageEvent& event = events[(first + i) % MAXIMUM_EVENTS];
+		json << (i == 0 ? "\n" : ",\n");
+		json << "{\"name\":\"" << STAGE_NAMES[event.stage] << "\",\"cat\":\"bjpeg\",\"ph\":\"X\"";
+		json << ",\"ts\":" << (event.start - origin) / 1000.0 << ",\"dur\":" << (event.end - event.start) / 1000.0;
+		json << ",\"pid\":1,\"tid\":" << threads[event.thread];
+		if (event.tile >= 0)
+		{
+			json << ",\"args\":{\"tile\":" << event.tile << "}";
+		}
+		json << "}";
+	}
+	json << "\n]}\n";
+	stream << json.str();
+}
+
+void Instrumentation::writeMetrics(ostream& stream)
+{
+	ostringstream text;
+	text.precision(12);
+	writeCounter(text, "bjpeg_segments_total", "Marker segments loaded or saved, tile data as SOD.", "counter");
+	writeSegments(text, "bjpeg_segments_total", segmentCount, 1);
+	writeCounter(text, "bjpeg_segment_bytes_total", "Bytes of the marker segments loaded or saved.", "counter");
+	writeSegments(text, "bjpeg_segment_bytes_total", segmentBytes, 1);
+	writeCounter(text, "bjpeg_segment_seconds_total", "Time spent on the marker segments loaded or saved.", "counter");
+	writeSegments(text, "bjpeg_segment_seconds_total", segmentTime, 1e-9);
+
+	writeCounter(text, "bjpeg_stage_runs_total", "Runs of each stage.", "counter");
+	for (int stage = 0; stage < STAGE_COUNT; stage++)
+	{
+		text << "bjpeg_stage_runs_total{stage=\"" << STAGE_NAMES[stage] << "\"} " << stageCount[stage].load(boost::memory_order_relaxed) << '\n';
+	}
+	writeCounter(text, "bjpeg_stage_seconds_total", "Time spent in each stage.", "counter");
+	for (int stage = 0; stage < STAGE_COUNT; stage++)
+	{
+		text << "bjpeg_stage_seconds_total{stage=\"" << STAGE_NAMES[stage] << "\"} " << stageTime[stage].load(boost::memory_order_relaxed) * 1e-9 << '\n';
+	}
+
+	writeCounter(text, "bjpeg_allocations_total", "Buffers allocated for tile part segments and tile data.", "counter");
+	text << "bjpeg_allocations_total " << allocations.load(boost::memory_order_relaxed) << '\n';
+	writeCounter(text, "bjpeg_allocated_bytes_total", "Bytes of those buffers.", "counter");
+	text << "bjpeg_allocated_bytes_total " << allocatedBytes.load(boost::memory_order_relaxed) << '\n';
+	stream << text.str();
+}
@@ -0,0 +1,115 @@
+#ifndef _INSTRUMENT_H_
+#define _INSTRUMENT_H_
+
+#include <boost\cstdint.hpp>
+#include <ostream>
+
+namespace BJPEG
+{
+
+// Stages of a job that are timed as a whole, every run is a trace event
+enum InstrumentStage
+{
+	STAGE_READ_FILE,
+	STAGE_LOAD_HEADER,
+	STAGE_LOAD_TILE_PART,
+	STAGE_SAVE_HEADER,
+	STAGE_SAVE_TILE_PART,
+	STAGE_WRITE_FILE,
+	STAGE_COUNT
+};
+
+enum InstrumentOperation
+{
+	OPERATION_LOAD,
+	OPERATION_SAVE,
+	OPERATION_COUNT
+};
+
+// Process wide counters of the load and save paths: bytes, time and number of the
+// marker segments of each type (tile data counts as SOD), time of each stage,
+// buffer allocations, and a log of the latest stage runs with their tile. Counters
+// are relaxed atomics, the log is a ring that takes a lock once per stage run.
+//
+// The hooks in the library are compiled in with BJPEG_INSTRUMENT defined only;
+// without it the counters stay at zero and the exports are empty.
+class Instrumentation
+{
+public:
+	// stage runs kept for the trace, older ones are overwritten
+	static const size_t MAXIMUM_EVENTS = 1 << 16;
+
+	// nanoseconds on a steady clock
+	static uint64_t now();
+
+	static void segment(InstrumentOperation operation, uint16_t marker, uint64_t bytes, uint64_t nanoseconds);
+	static void allocation(uint64_t bytes);
+	// tile < 0 - the run does not belong to a tile
+	static void stage(InstrumentStage stage, int32_t tile, uint64_t start, uint64_t end);
+
+	static void reset();
+
+	// Chrome trace event format (chrome://tracing, Perfetto), one complete event per stage run
+	static void writeTrace(std::ostream& stream);
+	// Prometheus text exposition format
+	static void writeMetrics(std::ostream& stream);
+};
+
+// Times a stage from construction to destruction, or to its last segment() when it
+// has any, which then has to end the work of the scope. segment() charges the time
+// since the previous mark to a marker segment, so a parse loop reads the clock once
+// per segment; count() adds a segment without reading the clock, its time goes to
+// the next segment.
+class InstrumentScope
+{
+	InstrumentStage stageId;
+	int32_t tile;
+	uint64_t start;
+	uint64_t mark;
+
+public:
+	InstrumentScope(InstrumentStage stage, int32_t tile = -1) : stageId(stage), tile(tile)
+	{
+		start = mark = Instrumentation::now();
+	}
+
+	~InstrumentScope()
+	{
+		Instrumentation::stage(stageId, tile, start, mark != start ? mark : Instrumentation::now());
+	}
+
+	void setTile(int32_t tile)
+	{
+		this->tile = tile;
+	}
+
+	void segment(InstrumentOperation operation, uint16_t marker, uint64_t bytes)
+	{
+		uint64_t time = Instrumentation::now();
+		Instrumentation::segment(operation, marker, bytes, time - mark);
+		mark = time;
+	}
+
+	void count(InstrumentOperation operation, uint16_t marker, uint64_t bytes)
+	{
+		Instrumentation::segment(operation, marker, bytes, 0);
+	}
+};
+
+}
+
+#ifdef BJPEG_INSTRUMENT
+#define BJPEG_INSTRUMENT_SCOPE(scope, stage, tile) BJPEG::InstrumentScope scope(stage, tile)
+#define BJPEG_INSTRUMENT_TILE(scope, tile) scope.setTile(tile)
+#define BJPEG_INSTRUMENT_SEGMENT(scope, operation, marker, bytes) scope.segment(operation, marker, bytes)
+#define BJPEG_INSTRUMENT_COUNT(scope, operation, marker, bytes) scope.count(operation, marker, bytes)
+#define BJPEG_INSTRUMENT_ALLOCATION(bytes) BJPEG::Instrumentation::allocation(bytes)
+#else
+#define BJPEG_INSTRUMENT_SCOPE(scope, stage, tile)
+#define BJPEG_INSTRUMENT_TILE(scope, tile)
+#define BJPEG_INSTRUMENT_SEGMENT(scope, operation, marker, bytes)
+#define BJPEG_INSTRUMENT_COUNT(scope, operation, marker, bytes)
+#define BJPEG_INSTRUMENT_ALLOCATION(bytes)
+#endif
+
+#endif /*_INSTRUMENT_H_*/
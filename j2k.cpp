@@ -1,24 +1,186 @@
 #include "j2k.h"
+#include "instrument.h"
+#include "scheduler.h"
+#include <algorithm>
 #include <fstream>
 
 using namespace std;
 
 namespace BJPEG
 {
+	namespace
+	{
+		typedef ErrorCode (*MainHeaderParser)(J2KFile& file, const uint8_t* buffer, int offset);
+		typedef J2KPartPtr (*PartFactory)();
+
+		template<typename T, T J2KFile::*member>
+		ErrorCode loadMember(J2KFile& file, const uint8_t* buffer, int offset)
+		{
+			return (file.*member).load(buffer, offset);
+		}
+
+		template<typename T, std::vector<T> J2KFile::*member>
+		ErrorCode appendMember(J2KFile& file, const uint8_t* buffer, int offset)
+		{
+			T part;
+			ErrorCode result = part.load(buffer, offset);
+			if (result == SUCCESS)
+			{
+				(file.*member).push_back(part);
+			}
+			return result;
+		}
+
+		template<typename T>
+		ErrorCode appendSegment(J2KFile& file, const uint8_t* buffer, int offset)
+		{
+			J2KPartPtr part(new T());
+			ErrorCode result = part->load(buffer, offset);
+			if (result == SUCCESS)
+			{
+				file.segments.push_back(part);
+			}
+			return result;
+		}
+
+		ErrorCode loadCapabilities(J2KFile& file, const uint8_t* buffer, int offset)
+		{
+			ExtendedCapabilities cap;
+			ErrorCode result = cap.load(buffer, offset);
+			if (result == SUCCESS)
+			{
+				file.capabilities = cap;
+			}
+			return result;
+		}
+
+		// pointer markers, rebuilt by whoever needs them
+		ErrorCode skipSegment(J2KFile&, const uint8_t*, int)
+		{
+			return SUCCESS;
+		}
+
+		template<typename T>
+		J2KPartPtr createPart()
+		{
+			return J2KPartPtr(new T());
+		}
+
+		// minimum is the smallest segment length (L) whose fields the parser
+		// reads, checked before it runs so it never leaves the segment
+		struct MainHeaderRule
+		{
+			uint16_t marker;
+			uint16_t minimum;
+			MainHeaderParser entry;
+		};
+
+		struct TilePartRule
+		{
+			uint16_t marker;
+			uint16_t minimum;
+			PartFactory entry;
+		};
+
+		// Table A.2, what may follow SIZ in the main header
+		const MainHeaderRule MAIN_HEADER_RULES[] =
+		{
+			{ J2KMarkers::CAP, 6, loadCapabilities },
+			{ J2KMarkers::COD, 12, loadMember<CodingStyleDefault, &J2KFile::codingStyleDefault> },
+			{ J2KMarkers::COC, 2, appendSegment<CodingStyleComponent> },
+			{ J2KMarkers::TLM, 2, skipSegment },
+			{ J2KMarkers::PLM, 2, skipSegment },
+			{ J2KMarkers::QCD, 3, loadMember<QuantizationDefaultParameter, &J2KFile::quantizationDefaultParameter> },
+			{ J2KMarkers::QCC, 2, appendMember<QuantizationComponent, &J2KFile::componentQccs> },
+			{ J2KMarkers::RGN, 2, appendSegment<MarkerSegment> },
+			{ J2KMarkers::POC, 2, appendSegment<MarkerSegment> },
+			{ J2KMarkers::PPM, 3, appendSegment<PackedPacketHeadersMain> },
+			{ J2KMarkers::CRG, 2, appendSegment<MarkerSegment> },
+			{ J2KMarkers::COM, 4, appendMember<Comment, &J2KFile::comments> }
+		};
+
+		// and what a tile part header may hold
+		const TilePartRule TILE_PART_RULES[] =
+		{
+			{ J2KMarkers::COD, 12, createPart<CodingStyleDefault> },
+			{ J2KMarkers::COC, 2, createPart<CodingStyleComponent> },
+			{ J2KMarkers::QCD, 3, createPart<QuantizationDefaultParameter> },
+			{ J2KMarkers::QCC, 2, createPart<QuantizationComponent> },
+			{ J2KMarkers::RGN, 2, createPart<MarkerSegment> },
+			{ J2KMarkers::POC, 2, createPart<MarkerSegment> },
+			{ J2KMarkers::PPT, 3, createPart<PackedPacketHeadersTile> },
+			{ J2KMarkers::PLT, 3, createPart<PacketLengthTilePartHeader> },
+			{ J2KMarkers::COM, 4, createPart<Comment> }
+		};
+
+		// the fixed fields of SIZ and SOT
+		const uint16_t SIZ_MINIMUM = 38;
+		const uint32_t SOT_SIZE = 12;
+
+		// Rules by the second byte of their marker, a lookup is one load
+		template<typename Rule>
+		class DispatchTable
+		{
+			const Rule* entries[256];
+
+		public:
+			template<size_t N>
+			explicit DispatchTable(const Rule (&rules)[N])
+			{
+				std::fill(entries, entries + 256, (const Rule*)NULL);
+				for (size_t i = 0; i < N; i++)
+				{
+					entries[rules[i].marker & 0xFF] = &rules[i];
+				}
+			}
+
+			const Rule* operator[](uint16_t marker) const
+			{
+				return (marker >> 8) == 0xFF ? entries[marker & 0xFF] : NULL;
+			}
+		};
+
+		const DispatchTable<MainHeaderRule> MAIN_HEADER(MAIN_HEADER_RULES);
+		const DispatchTable<TilePartRule> TILE_PART(TILE_PART_RULES);
+
+		// markers without a segment (A.1.3 reserves 0xFF30 - 0xFF3F for them)
+		inline bool hasNoSegment(uint16_t marker)
+		{
+			return marker >= 0xFF30 && marker <= 0xFF3F;
+		}
+
+		// delimiting markers, never part of a header
+		inline bool isDelimiter(uint16_t marker)
+		{
+			return marker == J2KMarkers::SOC || marker == J2KMarkers::SOT || marker == J2KMarkers::SOP ||
+				marker == J2KMarkers::EPH || marker == J2KMarkers::SOD || marker == J2KFile::EOC;
+		}
+	}
+
 	J2KPartPtr J2KPart::createByMarkerId(uint16_t markerId)
 	{
-		switch (markerId)
+		const TilePartRule* rule = TILE_PART[markerId];
+		return rule != NULL ? rule->entry() : nullptr;
+	}
+
+	ErrorCode MarkerSegment::load(const uint8_t* buffer, int offset)
+	{
+		this->marker = JpegAccess::ReadUint16(buffer, offset);
+		if ((this->marker >> 8) != 0xFF || hasNoSegment(this->marker) || isDelimiter(this->marker))
 		{
-			case CodingStyleComponent::MARKER_ID:
-				return shared_ptr<CodingStyleComponent>(new CodingStyleComponent());
-			case QuantizationComponent::MARKER_ID:
-				return shared_ptr<QuantizationComponent>(new QuantizationComponent());
-			case PacketLengthTilePartHeader::MARKER_ID:
-				return shared_ptr<PacketLengthTilePartHeader>(new PacketLengthTilePartHeader());
-			case CodingStyleDefault::MARKER_ID:
-				return shared_ptr<CodingStyleDefault>(new CodingStyleDefault());
+			return J2K_MARKER_UNEXPECTED;
 		}
-		return nullptr;
+		this->Lseg = JpegAccess::ReadUint16(buffer, offset + 2);
+		this->Raw.clear();
+		this->Raw.insert(this->Raw.end(), buffer + offset + 4, buffer + offset + this->size());
+		return SUCCESS;
+	}
+
+	void MarkerSegment::save(ostream& stream) const
+	{
+		JpegAccess::WriteUint16(stream, marker);
+		JpegAccess::WriteUint16(stream, Lseg);
+		stream.write((const char*)Raw.data(), Raw.size());
 	}
 
 	ErrorCode StartOfFrameSegment::load(const uint8_t* buffer, int offset)
@@ -41,6 +203,56 @@ namespace BJPEG
 		return SUCCESS;
 	}
 
+	ErrorCode PackedPacketHeadersMain::load(const uint8_t* buffer, int offset)
+	{
+		if (!JpegAccess::VerifyReadUint16(buffer, offset, MARKER_ID))
+		{
+			return J2K_PPM_DOESNT_MATCH;
+		}
+		this->Lppm = JpegAccess::ReadUint16(buffer, offset + 2);
+		if (this->Lppm < 3)
+		{
+			return J2K_PPM_DOESNT_MATCH;
+		}
+		this->Zppm = JpegAccess::ReadUint8(buffer, offset + 4);
+		this->Raw.clear();
+		this->Raw.insert(this->Raw.end(), buffer + offset + 5, buffer + offset + this->size());
+		return SUCCESS;
+	}
+
+	void PackedPacketHeadersMain::save(ostream& stream) const
+	{
+		JpegAccess::WriteUint16(stream, MARKER_ID);
+		JpegAccess::WriteUint16(stream, Lppm);
+		JpegAccess::WriteUint8(stream, Zppm);
+		stream.write((const char*)Raw.data(), Raw.size());
+	}
+
+	ErrorCode PackedPacketHeadersTile::load(const uint8_t* buffer, int offset)
+	{
+		if (!JpegAccess::VerifyReadUint16(buffer, offset, MARKER_ID))
+		{
+			return J2K_PPT_DOESNT_MATCH;
+		}
+		this->Lppt = JpegAccess::ReadUint16(buffer, offset + 2);
+		if (this->Lppt < 3)
+		{
+			return J2K_PPT_DOESNT_MATCH;
+		}
+		this->Zppt = JpegAccess::ReadUint8(buffer, offset + 4);
+		this->Raw.clear();
+		this->Raw.insert(this->Raw.end(), buffer + offset + 5, buffer + offset + this->size());
+		return SUCCESS;
+	}
+
+	void PackedPacketHeadersTile::save(ostream& stream) const
+	{
+		JpegAccess::WriteUint16(stream, MARKER_ID);
+		JpegAccess::WriteUint16(stream, Lppt);
+		JpegAccess::WriteUint8(stream, Zppt);
+		stream.write((const char*)Raw.data(), Raw.size());
+	}
+
 	void PacketLength::save(ostream& stream) const
 	{
 		uint8_t buffer[4];
@@ -117,72 +329,129 @@ namespace BJPEG
 		}
 	}
 	
+	void TilePart::packedPacketHeaders(vector<uint8_t>& headers) const
+	{
+		vector<const PackedPacketHeadersTile*> segments;
+		BOOST_FOREACH(const J2KPartPtr& ptr, markers)
+		{
+			if (ptr->getMarker() == PackedPacketHeadersTile::MARKER_ID)
+			{
+				segments.push_back(static_cast<const PackedPacketHeadersTile*>(ptr.get()));
+			}
+		}
+		stable_sort(segments.begin(), segments.end(), [](const PackedPacketHeadersTile* a, const PackedPacketHeadersTile* b)
+		{
+			return a->Zppt < b->Zppt;
+		});
+		headers.clear();
+		BOOST_FOREACH(const PackedPacketHeadersTile* segment, segments)
+		{
+			headers.insert(headers.end(), segment->Raw.begin(), segment->Raw.end());
+		}
+	}
+
 	void TilePart::save(ostream& stream) const
 	{
+		BJPEG_INSTRUMENT_SCOPE(instrument, STAGE_SAVE_TILE_PART, Isot);
 		JpegAccess::WriteUint16(stream, MARKER_ID);
 		JpegAccess::WriteUint16(stream, Lsot);
 		JpegAccess::WriteUint16(stream, Isot);
-		JpegAccess::WriteUint32(stream, size());
+		JpegAccess::WriteUint32(stream, (uint32_t)size());
 		JpegAccess::WriteUint8(stream, TPsot);
 		JpegAccess::WriteUint8(stream, TNsot);
+		BJPEG_INSTRUMENT_COUNT(instrument, OPERATION_SAVE, MARKER_ID, SOT_SIZE);
 		for (vector<J2KPartPtr>::const_iterator it = this->markers.begin(); it != this->markers.end(); ++it) {
 			it->get()->save(stream);
+			BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_SAVE, it->get()->getMarker(), it->get()->size());
 		}
 		stream.write((const char*)Raw.data(), Raw.size());
+		BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_SAVE, J2KMarkers::SOD, Raw.size());
 	}
 
 	ErrorCode TilePart::load(const uint8_t* buffer, int offset)
 	{
-		int index = offset;
-		if (!JpegAccess::VerifyReadUint16(buffer, index, MARKER_ID))
+		return load(ByteCursor(buffer, ByteCursor::UNKNOWN_END, offset));
+	}
+
+	ErrorCode TilePart::load(const ByteCursor& cursor)
+	{
+		if (!cursor.has(SOT_SIZE))
+		{
+			return J2K_SEGMENT_TRUNCATED;
+		}
+		return load(cursor, JpegAccess::ReadUint32(cursor.current(), 6));
+	}
+
+	ErrorCode TilePart::load(const ByteCursor& cursor, uint32_t length)
+	{
+		ByteCursor body(cursor.data(), 0);
+		ErrorCode result = loadHeader(cursor, length, body);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+		this->Raw.assign(body.current(), body.current() + body.remaining());
+		BJPEG_INSTRUMENT_ALLOCATION(Raw.size());
+		return SUCCESS;
+	}
+
+	ErrorCode TilePart::loadHeader(const ByteCursor& cursor, uint32_t length, ByteCursor& body)
+	{
+		if (cursor.peekMarker() != MARKER_ID)
 		{
 			return J2K_SOT_DOESNT_MATCH;
 		}
-		index += 2;
-		if (!JpegAccess::VerifyReadUint16(buffer, index, Lsot))
+		if (length < SOT_SIZE || !cursor.has(length))
+		{
+			return J2K_SEGMENT_TRUNCATED;
+		}
+		BJPEG_INSTRUMENT_SCOPE(instrument, STAGE_LOAD_TILE_PART, -1);
+		ByteCursor part = cursor.window(length);
+		const uint8_t* sot = part.current();
+		if (!JpegAccess::VerifyReadUint16(sot, 2, Lsot))
 		{
 			return J2K_LSOT_DOESNT_MATCH;
 		}
-		index += 2;
-
-		this->Isot = JpegAccess::ReadUint16(buffer, index);
-		index += 2;
-
-		uint32_t Psot = JpegAccess::ReadUint32(buffer, index);
-		index += 4;
-
-		this->TPsot = JpegAccess::ReadUint8(buffer, index);
-		index++;
-
-		this->TNsot = JpegAccess::ReadUint8(buffer, index);
-		index++;
+		// Psot, taken from length
+		this->Isot = JpegAccess::ReadUint16(sot, 4);
+		this->TPsot = JpegAccess::ReadUint8(sot, 10);
+		this->TNsot = JpegAccess::ReadUint8(sot, 11);
+		part.skip(SOT_SIZE);
+		BJPEG_INSTRUMENT_TILE(instrument, Isot);
+		BJPEG_INSTRUMENT_COUNT(instrument, OPERATION_LOAD, MARKER_ID, SOT_SIZE);
 
 		this->markers.clear();
+		this->Raw.clear();
 		while (true)
 		{
-			uint16_t marker = JpegAccess::ReadUint16(buffer, index);
-			J2KPartPtr part = J2KPart::createByMarkerId(marker);
-			if (part == nullptr)
+			uint16_t marker = part.peekMarker();
+			const TilePartRule* rule = TILE_PART[marker];
+			if (rule == NULL)
 			{
-				if (!JpegAccess::VerifyReadUint16(buffer, index, J2KMarkers::SOD))
+				if (marker != J2KMarkers::SOD)
 				{
 					return J2K_SOD_DOESNT_MATCH;
 				}
 				break;
 			}
-			else
+			if (!part.hasSegment(rule->minimum))
 			{
-				part.get()->load(buffer, index);
-				markers.push_back(part);
-				index += part.get()->size();
+				return J2K_SEGMENT_TRUNCATED;
 			}
+			J2KPartPtr segment = rule->entry();
+			ErrorCode result = segment->load(part.current(), 0);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+			markers.push_back(segment);
+			BJPEG_INSTRUMENT_ALLOCATION(part.segmentSize());
+			BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_LOAD, marker, part.segmentSize());
+			part.skip(part.segmentSize());
 		}
 
-
-
-		this->Raw.clear();
-		this->Raw.insert(this->Raw.end(), buffer + index, buffer + offset + Psot);
-
+		body = part;
+		BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_LOAD, J2KMarkers::SOD, body.remaining());
 		return SUCCESS;
 	}
 
@@ -244,6 +513,10 @@ namespace BJPEG
 		this->XTOsiz = JpegAccess::ReadUint32(buffer, offset + 30);
 		this->YTOsiz = JpegAccess::ReadUint32(buffer, offset + 34);
 		this->Csiz = JpegAccess::ReadUint16(buffer, offset + 38);
+		if (this->Lsiz != 38 + 3 * (uint32_t)this->Csiz)
+		{
+			return J2K_SIZ_DOESNT_MATCH;
+		}
 
 		this->Components.clear();
 		if (this->Csiz > 0)
@@ -259,6 +532,32 @@ namespace BJPEG
 		return SUCCESS;
 	}
 
+	void ExtendedCapabilities::save(ostream& stream) const
+	{
+		JpegAccess::WriteUint16(stream, MARKER_ID);
+		JpegAccess::WriteUint16(stream, Lcap);
+		JpegAccess::WriteUint32(stream, Pcap);
+		for (vector<uint16_t>::const_iterator it = Ccap.begin(); it != Ccap.end(); ++it) {
+			JpegAccess::WriteUint16(stream, *it);
+		}
+	}
+
+	ErrorCode ExtendedCapabilities::load(const uint8_t* buffer, int offset)
+	{
+		if (!JpegAccess::VerifyReadUint16(buffer, offset, MARKER_ID))
+		{
+			return J2K_CAP_DOESNT_MATCH;
+		}
+		this->Lcap = JpegAccess::ReadUint16(buffer, offset + 2);
+		this->Pcap = JpegAccess::ReadUint32(buffer, offset + 4);
+		this->Ccap.clear();
+		for (int index = offset + 8; index < offset + (int)this->size(); index += 2)
+		{
+			this->Ccap.push_back(JpegAccess::ReadUint16(buffer, index));
+		}
+		return SUCCESS;
+	}
+
 	void CodingStyleDefault::save(ostream& stream) const
 	{
 		JpegAccess::WriteUint16(stream, MARKER_ID);
@@ -395,25 +694,49 @@ namespace BJPEG
 	
 	void J2KFile::save(ostream& stream) const
 	{
+		saveHeader(stream);
+		for (vector<TilePart>::const_iterator it = tiles.begin(); it != tiles.end(); ++it) {
+			it->save(stream);
+		}
+		JpegAccess::WriteUint16(stream, EOC);
+	}
+
+	void J2KFile::saveHeader(ostream& stream) const
+	{
+		BJPEG_INSTRUMENT_SCOPE(instrument, STAGE_SAVE_HEADER, -1);
 		JpegAccess::WriteUint16(stream, MARKER_ID);
 		header.save(stream);
+		BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_SAVE, Header::MARKER_ID, header.size());
+		if (capabilities)
+		{
+			capabilities->save(stream);
+			BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_SAVE, ExtendedCapabilities::MARKER_ID, capabilities->size());
+		}
 		codingStyleDefault.save(stream);
+		BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_SAVE, CodingStyleDefault::MARKER_ID, codingStyleDefault.size());
 		quantizationDefaultParameter.save(stream);
+		BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_SAVE, QuantizationDefaultParameter::MARKER_ID, quantizationDefaultParameter.size());
 		for (vector<Comment>::const_iterator it = comments.begin(); it != comments.end(); ++it) {
 			it->save(stream);
+			BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_SAVE, Comment::MARKER_ID, it->size());
 		}
 		for (vector<QuantizationComponent>::const_iterator it = componentQccs.begin(); it != componentQccs.end(); ++it) {
 			it->save(stream);
+			BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_SAVE, QuantizationComponent::MARKER_ID, it->size());
 		}
-		for (vector<TilePart>::const_iterator it = tiles.begin(); it != tiles.end(); ++it) {
-			it->save(stream);
+		for (vector<J2KPartPtr>::const_iterator it = segments.begin(); it != segments.end(); ++it) {
+			it->get()->save(stream);
+			BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_SAVE, it->get()->getMarker(), it->get()->size());
 		}
-		JpegAccess::WriteUint16(stream, EOC);
 	}
 
-	uint32_t J2KFile::size() const
+	uint64_t J2KFile::size() const
 	{
-		uint32_t result = 4 + header.size() + codingStyleDefault.size() + quantizationDefaultParameter.size();
+		uint64_t result = 4 + header.size() + codingStyleDefault.size() + quantizationDefaultParameter.size();
+		if (capabilities)
+		{
+			result += capabilities->size();
+		}
 		BOOST_FOREACH(const Comment& ptr, comments)
 		{
 			result += ptr.size();
@@ -422,6 +745,10 @@ namespace BJPEG
 		{
 			result += ptr.size();
 		}
+		BOOST_FOREACH(const J2KPartPtr& ptr, segments)
+		{
+			result += ptr->size();
+		}
 		BOOST_FOREACH(const TilePart& ptr, tiles)
 		{
 			result += ptr.size();
@@ -429,80 +756,322 @@ namespace BJPEG
 		return result;
 	}
 
-	ErrorCode J2KFile::load(const uint8_t* buffer, int offset)
+	bool J2KFile::usesMultipleComponentTransformation() const
 	{
-		if (!JpegAccess::VerifyReadUint16(buffer, offset, MARKER_ID))
+		if (codingStyleDefault.usesMultipleComponentTransformation())
 		{
-			return J2K_SOC_DOESNT_MATCH;
+			return true;
+		}
+		// tile-part COD overrides the main header for its tile
+		BOOST_FOREACH(const TilePart& tile, tiles)
+		{
+			BOOST_FOREACH(const J2KPartPtr& ptr, tile.markers)
+			{
+				if (ptr->getMarker() == CodingStyleDefault::MARKER_ID &&
+					static_cast<const CodingStyleDefault*>(ptr.get())->usesMultipleComponentTransformation())
+				{
+					return true;
+				}
+			}
 		}
-		offset += 2;
+		return false;
+	}
 
-		ErrorCode result;
-		result = this->header.load(buffer, offset);
-		if (result != SUCCESS)
+	bool J2KFile::hasPackedPacketHeaders() const
+	{
+		BOOST_FOREACH(const J2KPartPtr& ptr, segments)
 		{
-			return result;
+			if (ptr->getMarker() == PackedPacketHeadersMain::MARKER_ID)
+			{
+				return true;
+			}
+		}
+		BOOST_FOREACH(const TilePart& tile, tiles)
+		{
+			BOOST_FOREACH(const J2KPartPtr& ptr, tile.markers)
+			{
+				if (ptr->getMarker() == PackedPacketHeadersTile::MARKER_ID)
+				{
+					return true;
+				}
+			}
 		}
-		offset += this->header.size();
+		return false;
+	}
 
-		result = this->codingStyleDefault.load(buffer, offset);
-		if (result != SUCCESS)
+	ErrorCode J2KFile::packedPacketHeaders(vector<vector<uint8_t> >& headers) const
+	{
+		headers.assign(tiles.size(), vector<uint8_t>());
+		vector<const PackedPacketHeadersMain*> main;
+		BOOST_FOREACH(const J2KPartPtr& ptr, segments)
 		{
-			return result;
+			if (ptr->getMarker() == PackedPacketHeadersMain::MARKER_ID)
+			{
+				main.push_back(static_cast<const PackedPacketHeadersMain*>(ptr.get()));
+			}
 		}
-		offset += this->codingStyleDefault.size();
+		if (main.empty())
+		{
+			for (size_t i = 0; i < tiles.size(); i++)
+			{
+				tiles[i].packedPacketHeaders(headers[i]);
+			}
+			return SUCCESS;
+		}
+
+		// Nppm and its headers may be split between two segments
+		stable_sort(main.begin(), main.end(), [](const PackedPacketHeadersMain* a, const PackedPacketHeadersMain* b)
+		{
+			return a->Zppm < b->Zppm;
+		});
+		vector<uint8_t> packed;
+		BOOST_FOREACH(const PackedPacketHeadersMain* segment, main)
+		{
+			packed.insert(packed.end(), segment->Raw.begin(), segment->Raw.end());
+		}
+		size_t position = 0;
+		for (size_t i = 0; i < tiles.size(); i++)
+		{
+			if (position + 4 > packed.size())
+			{
+				return J2K_PPM_DOESNT_MATCH;
+			}
+			uint32_t Nppm = JpegAccess::ReadUint32(packed.data(), (int)position);
+			position += 4;
+			if (Nppm > packed.size() - position)
+			{
+				return J2K_PPM_DOESNT_MATCH;
+			}
+			headers[i].assign(packed.begin() + position, packed.begin() + position + Nppm);
+			position += Nppm;
+		}
+		return SUCCESS;
+	}
+
+	ComponentMask J2KFile::requiredComponents(const ComponentMask& requested) const
+	{
+		ComponentMask result(header.Csiz, false);
+		for (size_t i = 0; i < result.size() && i < requested.size(); i++)
+		{
+			result[i] = requested[i];
+		}
+
+		if (header.Csiz >= 3 && usesMultipleComponentTransformation() && (result[0] || result[1] || result[2]))
+		{
+			result[0] = result[1] = result[2] = true;
+		}
+		return result;
+	}
+
+	ErrorCode J2KFile::load(const uint8_t* buffer, int offset)
+	{
+		return load(ByteCursor(buffer, ByteCursor::UNKNOWN_END, offset));
+	}
+
+	ErrorCode J2KFile::loadBuffer(const uint8_t* buffer, uint64_t length)
+	{
+		return load(ByteCursor(buffer, length));
+	}
 
-		result = this->quantizationDefaultParameter.load(buffer, offset);
+	ErrorCode J2KFile::load(ByteCursor cursor)
+	{
+		ErrorCode result = loadHeader(cursor);
 		if (result != SUCCESS)
 		{
 			return result;
 		}
-		offset += this->quantizationDefaultParameter.size();
 
-		this->comments.clear();
-		while (Comment::isValid(buffer, offset))
+		this->tiles.clear();
+		while (cursor.peekMarker() == TilePart::MARKER_ID)
 		{
-			Comment c;
-			result = c.load(buffer, offset);
+			TilePart sot;
+			result = sot.load(cursor);
 			if (result != SUCCESS)
 			{
 				return result;
 			}
-			this->comments.push_back(c);
-			offset += c.size();
+			this->tiles.push_back(sot);
+			// by Psot, size() re-encodes PLT lengths which need not come out the same
+			cursor.skip(JpegAccess::ReadUint32(cursor.current(), 6));
 		}
 
-		this->componentQccs.clear();
-		while (QuantizationComponent::isValid(buffer, offset))
+		if (cursor.peekMarker() != EOC)
 		{
-			QuantizationComponent qcc;
-			result = qcc.load(buffer, offset);
-			if (result != SUCCESS)
+			return J2K_EOC_DOESNT_MATCH;
+		}
+
+		return SUCCESS;
+	}
+
+	ErrorCode J2KFile::load(ByteCursor cursor, TaskScheduler& scheduler)
+	{
+		ErrorCode result = loadHeader(cursor);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+
+		// only the 12 bytes of every SOT are read here
+		vector<uint64_t> offsets;
+		while (cursor.peekMarker() == TilePart::MARKER_ID)
+		{
+			if (!cursor.has(SOT_SIZE))
 			{
-				return result;
+				return J2K_SEGMENT_TRUNCATED;
 			}
-			this->componentQccs.push_back(qcc);
-			offset += qcc.size();
+			if (!JpegAccess::VerifyReadUint16(cursor.current(), 2, TilePart::Lsot))
+			{
+				return J2K_LSOT_DOESNT_MATCH;
+			}
+			// the rule of TilePart::load
+			uint32_t Psot = JpegAccess::ReadUint32(cursor.current(), 6);
+			if (Psot < SOT_SIZE || !cursor.has(Psot))
+			{
+				return J2K_SEGMENT_TRUNCATED;
+			}
+			offsets.push_back(cursor.position());
+			cursor.skip(Psot);
 		}
 
-		this->tiles.clear();
-		while (TilePart::isValid(buffer, offset))
+		if (cursor.peekMarker() != EOC)
+		{
+			return J2K_EOC_DOESNT_MATCH;
+		}
+
+		return loadTileParts(cursor, offsets, vector<uint32_t>(), scheduler);
+	}
+
+	ErrorCode J2KFile::loadTileParts(const ByteCursor& codestream, const vector<uint64_t>& offsets, const vector<uint32_t>& lengths, TaskScheduler& scheduler)
+	{
+		// every tile part is parsed straight into its slot
+		this->tiles.assign(offsets.size(), TilePart());
+		vector<ErrorCode> results(offsets.size(), SUCCESS);
+		scheduler.parallelFor(0, offsets.size(), 64, [&](size_t i)
+		{
+			ByteCursor cursor = codestream.at(offsets[i]);
+			results[i] = lengths.empty() ? this->tiles[i].load(cursor) : this->tiles[i].load(cursor, lengths[i]);
+		});
+		BOOST_FOREACH(ErrorCode result, results)
 		{
-			TilePart sot;
-			result = sot.load(buffer, offset);
 			if (result != SUCCESS)
 			{
+				this->tiles.clear();
 				return result;
 			}
-			this->tiles.push_back(sot);
-			offset += sot.size();
 		}
+		return SUCCESS;
+	}
+
+	ErrorCode J2KFile::loadHeader(const uint8_t* buffer, int& offset)
+	{
+		ByteCursor cursor(buffer, ByteCursor::UNKNOWN_END, offset);
+		ErrorCode result = loadHeader(cursor);
+		offset = (int)cursor.position();
+		return result;
+	}
 
-		if (!JpegAccess::VerifyReadUint16(buffer, offset, EOC))
+	ErrorCode J2KFile::loadHeader(ByteCursor& cursor)
+	{
+		BJPEG_INSTRUMENT_SCOPE(instrument, STAGE_LOAD_HEADER, -1);
+		if (cursor.peekMarker() != MARKER_ID)
 		{
-			return J2K_EOC_DOESNT_MATCH;
+			return J2K_SOC_DOESNT_MATCH;
 		}
+		cursor.skip(2);
 
+		if (cursor.peekMarker() != Header::MARKER_ID)
+		{
+			return J2K_SIZ_DOESNT_MATCH;
+		}
+		if (!cursor.hasSegment(SIZ_MINIMUM))
+		{
+			return J2K_SEGMENT_TRUNCATED;
+		}
+		ErrorCode result = this->header.load(cursor.current(), 0);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+		BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_LOAD, Header::MARKER_ID, this->header.size());
+		cursor.skip(this->header.size());
+
+		// SIZ comes first, the other segments in any order (A.4)
+		this->capabilities = boost::none;
+		this->comments.clear();
+		this->componentQccs.clear();
+		this->segments.clear();
+		bool coding = false;
+		bool quantization = false;
+		while (cursor.peekMarker() != TilePart::MARKER_ID && cursor.peekMarker() != EOC)
+		{
+			uint16_t marker = cursor.peekMarker();
+			if (!cursor.has(2))
+			{
+				return J2K_SEGMENT_TRUNCATED;
+			}
+			if (hasNoSegment(marker))
+			{
+				cursor.skip(2);
+				continue;
+			}
+			if ((marker >> 8) != 0xFF || isDelimiter(marker))
+			{
+				return J2K_MARKER_UNEXPECTED;
+			}
+			// segments of later parts and extensions are skipped by their length
+			const MainHeaderRule* rule = MAIN_HEADER[marker];
+			if (!cursor.hasSegment(rule != NULL ? rule->minimum : 2))
+			{
+				return J2K_SEGMENT_TRUNCATED;
+			}
+			if (rule != NULL)
+			{
+				result = rule->entry(*this, cursor.current(), 0);
+				if (result != SUCCESS)
+				{
+					return result;
+				}
+			}
+			coding |= marker == CodingStyleDefault::MARKER_ID;
+			quantization |= marker == QuantizationDefaultParameter::MARKER_ID;
+			BJPEG_INSTRUMENT_SEGMENT(instrument, OPERATION_LOAD, marker, cursor.segmentSize());
+			cursor.skip(cursor.segmentSize());
+		}
+
+		if (!coding)
+		{
+			return J2K_COD_DOESNT_MATCH;
+		}
+		if (!quantization)
+		{
+			return J2K_QCD_DOESNT_MATCH;
+		}
 		return SUCCESS;
 	}
+
+	bool TilePartReader::next(TilePart& tile)
+	{
+		if (result != SUCCESS || cursor.peekMarker() != TilePart::MARKER_ID)
+		{
+			return false;
+		}
+		if (!cursor.has(SOT_SIZE))
+		{
+			result = J2K_SEGMENT_TRUNCATED;
+			return false;
+		}
+		uint32_t length = JpegAccess::ReadUint32(cursor.current(), 6);
+		result = tile.loadHeader(cursor, length, current);
+		if (result != SUCCESS)
+		{
+			return false;
+		}
+		cursor.skip(length);
+		return true;
+	}
+
+	bool TilePartReader::atEnd() const
+	{
+		return result == SUCCESS && cursor.peekMarker() == J2KFile::EOC;
+	}
 }
\ No newline at end of file
@@ -13,31 +13,44 @@
 
 namespace BJPEG
 {
+	class TaskScheduler;
+
 	class J2KMarkers
 	{
 	public:
 		static const uint16_t SOC = 0xFF4F;
+		static const uint16_t CAP = 0xFF50;
 		static const uint16_t SIZ = 0xFF51;
 		static const uint16_t COD = 0xFF52;
 		static const uint16_t COC = 0xFF53;
+		static const uint16_t TLM = 0xFF55;
+		static const uint16_t PLM = 0xFF57;
 		static const uint16_t PLT = 0xFF58;
 		static const uint16_t QCD = 0xFF5C;
 		static const uint16_t QCC = 0xFF5D;
+		static const uint16_t RGN = 0xFF5E;
 		static const uint16_t POC = 0xFF5F;
+		static const uint16_t PPM = 0xFF60;
 		static const uint16_t PPT = 0xFF61;
+		static const uint16_t CRG = 0xFF63;
 		static const uint16_t COM = 0xFF64;
 		static const uint16_t SOT = 0xFF90;
+		static const uint16_t SOP = 0xFF91;
+		static const uint16_t EPH = 0xFF92;
 		static const uint16_t SOD = 0xFF93;
 	};
 
 	class J2KPart;
 	typedef std::shared_ptr<J2KPart> J2KPartPtr;
 
+	// One flag per image component (index matches Header::Components)
+	typedef std::vector<bool> ComponentMask;
+
 	class J2KPart : public ImageFilePart
 	{
 	public:
 		virtual uint16_t getMarker() const = 0;
-		virtual uint32_t size() const = 0;
+		virtual uint64_t size() const = 0;
 		static J2KPartPtr createByMarkerId(uint16_t markerId);
 	};
 	
@@ -96,7 +109,7 @@ namespace BJPEG
 				return MARKER_ID;
 			}
 
-			uint32_t size() const
+			uint64_t size() const
 			{
 				return 40 + this->Csiz * 3;
 			}
@@ -104,6 +117,42 @@ namespace BJPEG
 			void save(std::ostream& stream) const;
 	};
 
+	class ExtendedCapabilities : public J2KPart
+	{
+	public:
+		static const uint16_t MARKER_ID = J2KMarkers::CAP;
+		// Pcap bit of ISO/IEC 15444-15 (HTJ2K), bits are numbered from the MSB starting at 1
+		static const uint32_t PART15 = 1 << (32 - 15);
+		uint16_t Lcap;
+		uint32_t Pcap;
+		// one entry per bit set in Pcap
+		std::vector<uint16_t> Ccap;
+
+		ExtendedCapabilities() {}
+
+		uint16_t getMarker() const
+		{
+			return MARKER_ID;
+		}
+
+		inline bool isHighThroughput() const
+		{
+			return (Pcap & PART15) == PART15;
+		}
+
+		inline static bool isValid(const uint8_t* buffer, int offset)
+		{
+			return JpegAccess::VerifyReadUint16(buffer, offset, MARKER_ID);
+		}
+
+		uint64_t size() const
+		{
+			return Lcap + 2;
+		}
+		ErrorCode load(const uint8_t* buffer, int offset);
+		void save(std::ostream& stream) const;
+	};
+
 	class CodingStyleDefault : public J2KPart
 	{
 	public:
@@ -142,13 +191,25 @@ namespace BJPEG
 			return (Scod & 4) == 4;
 		}
 
+		// HT block coder (JPEG 2000 part 15) instead of EBCOT
+		inline bool usesHighThroughputBlockCoder() const
+		{
+			return (CodeBlockStyle & 0x40) == 0x40;
+		}
+
+		// components 0, 1 and 2 are coupled by the RCT/ICT
+		inline bool usesMultipleComponentTransformation() const
+		{
+			return MultipleComponentTransformation == 1;
+		}
+
 
 		inline static bool isValid(const uint8_t* buffer, int offset)
 		{
 			return JpegAccess::VerifyReadUint16(buffer, offset, MARKER_ID);
 		}
 
-		uint32_t size() const
+		uint64_t size() const
 		{
 			return Lcod + 2;
 		}
@@ -176,7 +237,7 @@ namespace BJPEG
 			return JpegAccess::VerifyReadUint16(buffer, offset, MARKER_ID);
 		}
 
-		inline uint32_t size() const
+		inline uint64_t size() const
 		{
 			return Lqcd + 2;
 		}
@@ -203,7 +264,7 @@ namespace BJPEG
 			return JpegAccess::VerifyReadUint16(buffer, offset, MARKER_ID);
 		}
 
-		uint32_t size() const
+		uint64_t size() const
 		{
 			return Lqcc + 2;
 		}
@@ -211,7 +272,7 @@ namespace BJPEG
 		void save(std::ostream& stream) const;
 	};
 
-	class Comment : J2KPart
+	class Comment : public J2KPart
 	{
 	public:
 		static const uint16_t MARKER_ID = J2KMarkers::COM;
@@ -237,7 +298,7 @@ namespace BJPEG
 		}
 
 		
-		inline uint32_t size() const
+		inline uint64_t size() const
 		{
 			return Lcom + 2;
 		}
@@ -265,7 +326,7 @@ namespace BJPEG
 			return MARKER_ID;
 		}
 
-		uint32_t size() const
+		uint64_t size() const
 		{
 			return Lcoc + 2;
 		}
@@ -278,6 +339,30 @@ namespace BJPEG
 		void save(std::ostream& stream) const;
 	};
 
+	// Marker segment without a class of its own (RGN, POC, CRG, ...),
+	// kept as it is so that it is saved back unchanged.
+	class MarkerSegment : public J2KPart
+	{
+	public:
+		uint16_t marker;
+		uint16_t Lseg;
+		std::vector<uint8_t> Raw;
+
+		MarkerSegment() {}
+
+		uint16_t getMarker() const
+		{
+			return marker;
+		}
+
+		uint64_t size() const
+		{
+			return Lseg + 2;
+		}
+		ErrorCode load(const uint8_t* buffer, int offset);
+		void save(std::ostream& stream) const;
+	};
+
 	class PacketLength
 	{
 	public:
@@ -304,7 +389,7 @@ namespace BJPEG
 		}
 
 		// Lplt + 2
-		uint32_t size() const
+		uint64_t size() const
 		{
 			//return Lplt + 2;
 			uint32_t result = 5;
@@ -323,6 +408,58 @@ namespace BJPEG
 		void save(std::ostream& stream) const;
 	};
 
+	// Packed packet headers of the main header (A.7.4): for every tile part in
+	// codestream order Nppm (4 bytes) and that many bytes of its packet headers,
+	// running on from one PPM to the next.
+	class PackedPacketHeadersMain : public J2KPart
+	{
+	public:
+		static const uint16_t MARKER_ID = J2KMarkers::PPM;
+		uint16_t Lppm;
+		uint8_t Zppm;
+		std::vector<uint8_t> Raw;
+
+		PackedPacketHeadersMain() {}
+
+		uint16_t getMarker() const
+		{
+			return MARKER_ID;
+		}
+
+		uint64_t size() const
+		{
+			return Lppm + 2;
+		}
+		ErrorCode load(const uint8_t* buffer, int offset);
+		void save(std::ostream& stream) const;
+	};
+
+	// Packed packet headers of a tile part (A.7.5), in Zppt order
+	class PackedPacketHeadersTile : public J2KPart
+	{
+	public:
+		static const uint16_t MARKER_ID = J2KMarkers::PPT;
+		// of Raw in one segment
+		static const size_t MAXIMUM_LENGTH = 0xFFFF - 3;
+		uint16_t Lppt;
+		uint8_t Zppt;
+		std::vector<uint8_t> Raw;
+
+		PackedPacketHeadersTile() {}
+
+		uint16_t getMarker() const
+		{
+			return MARKER_ID;
+		}
+
+		uint64_t size() const
+		{
+			return Lppt + 2;
+		}
+		ErrorCode load(const uint8_t* buffer, int offset);
+		void save(std::ostream& stream) const;
+	};
+
 	class TilePart : J2KPart
 	{
 	public:
@@ -341,9 +478,9 @@ namespace BJPEG
 		}
 
 		// aka Psot
-		uint32_t size() const
+		uint64_t size() const
 		{
-			uint32_t result = 12 + Raw.size();
+			uint64_t result = 12 + Raw.size();
 			BOOST_FOREACH(const J2KPartPtr ptr, markers)
 			{
 				result += ptr->size();
@@ -356,7 +493,17 @@ namespace BJPEG
 			return JpegAccess::VerifyReadUint16(buffer, offset, MARKER_ID);
 		}
 		ErrorCode load(const uint8_t* buffer, int offset);
+		ErrorCode load(const ByteCursor& cursor);
+		// length overrides Psot, for tile parts whose Psot is 0 or wrong
+		ErrorCode load(const ByteCursor& cursor, uint32_t length);
+		// As load(cursor, length), but the body (SOD and the packet data) is not
+		// copied into Raw, which is cleared; body is set to a view of it in the
+		// buffer of cursor.
+		ErrorCode loadHeader(const ByteCursor& cursor, uint32_t length, ByteCursor& body);
 		void save(std::ostream& stream) const;
+
+		// Contents of the PPT segments in Zppt order, empty without any.
+		void packedPacketHeaders(std::vector<uint8_t>& headers) const;
 	};
 
 	class J2KFile : public J2KPart, public ImageFile
@@ -366,10 +513,13 @@ namespace BJPEG
 		static const uint16_t EOC = 0xFFD9;
 
 		Header header;
+		boost::optional<ExtendedCapabilities> capabilities;
 		CodingStyleDefault codingStyleDefault;
 		QuantizationDefaultParameter quantizationDefaultParameter;
 		std::vector<QuantizationComponent> componentQccs;
 		std::vector<Comment> comments;
+		// the other main header segments (COC, RGN, POC, CRG, PPM), in codestream order
+		std::vector<J2KPartPtr> segments;
 		std::vector<TilePart> tiles;
 		
 		J2KFile() {}
@@ -381,9 +531,77 @@ namespace BJPEG
 			return MARKER_ID;
 		}
 
-		uint32_t size() const;
+		uint64_t size() const;
+		// for buffers trusted to be whole, untrusted input goes through a ByteCursor
 		ErrorCode load(const uint8_t* buffer, int offset);
+		ErrorCode load(ByteCursor cursor);
+		ErrorCode loadBuffer(const uint8_t* buffer, uint64_t length);
+		// As load(), but the tile parts are found by a pre-scan of their SOT segments
+		// and parsed on the workers of scheduler, which callers keep across files.
+		ErrorCode load(ByteCursor cursor, TaskScheduler& scheduler);
+		// Parses the tile parts at offsets (from codestream.data()) into tiles, in
+		// parallel on scheduler; lengths (when not empty) override their Psot.
+		ErrorCode loadTileParts(const ByteCursor& codestream, const std::vector<uint64_t>& offsets, const std::vector<uint32_t>& lengths, TaskScheduler& scheduler);
+		// Main header only (SOC up to the first SOT), tiles are left untouched.
+		// After SIZ the segments may come in any order, TLM, PLM and those of
+		// unknown markers are skipped. On success offset points at the first tile part.
+		ErrorCode loadHeader(const uint8_t* buffer, int& offset);
+		ErrorCode loadHeader(ByteCursor& cursor);
 		void save(std::ostream& stream) const;
+		// Main header only, for writers which stream the tile parts themselves.
+		void saveHeader(std::ostream& stream) const;
+
+		// Smallest superset of the requested components which has to be decoded
+		// to reconstruct them - the component transformation needs all of 0..2.
+		ComponentMask requiredComponents(const ComponentMask& requested) const;
+		bool usesMultipleComponentTransformation() const;
+
+		bool hasPackedPacketHeaders() const;
+		// Packet headers of every tile part (index as tiles), from the PPM segments
+		// or else the PPT segments of the tile part; empty where the headers are
+		// in the tile part data.
+		ErrorCode packedPacketHeaders(std::vector<std::vector<uint8_t> >& headers) const;
+	};
+
+	// Pulls tile parts one by one from a codestream (typically a mapped file) after
+	// J2KFile::loadHeader. Only the marker segments of the current tile part are
+	// copied, its body stays in the buffer, so arbitrarily large single- or
+	// multi-tile images can be walked with a bounded footprint.
+	class TilePartReader
+	{
+		ByteCursor cursor;
+		ByteCursor current;
+		ErrorCode result;
+
+	public:
+		TilePartReader(const uint8_t* buffer, int offset) : cursor(buffer, ByteCursor::UNKNOWN_END, offset), current(buffer, 0), result(SUCCESS) {}
+		TilePartReader(const ByteCursor& cursor) : cursor(cursor), current(cursor.data(), 0), result(SUCCESS) {}
+
+		// Loads the SOT and marker segments of the next tile part into tile, reusing
+		// its storage, tile.Raw is left empty - see body();
+		// false when the tile parts are exhausted or one failed to load.
+		bool next(TilePart& tile);
+
+		// Body of the tile part from the last next(), a view of the reader's buffer
+		// (SOD and the packet data); position() and remaining() are its offset from
+		// the start of the buffer and its length.
+		const ByteCursor& body() const
+		{
+			return current;
+		}
+
+		// true when the reader stopped at a valid EOC
+		bool atEnd() const;
+
+		ErrorCode error() const
+		{
+			return result;
+		}
+
+		int position() const
+		{
+			return (int)cursor.position();
+		}
 	};
 }
 
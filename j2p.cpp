@@ -1,5 +1,6 @@
 #include "j2p.h"
 #include <fstream>
+#include <exception>
 
 using namespace BJPEG;
 using namespace std;
@@ -18,6 +19,12 @@ J2PPartPtr J2PPart::createByMarkerId(uint32_t markerId)
 			return shared_ptr<J2PBitsPerComponent>(new J2PBitsPerComponent());
 		case J2PColourSpecification::MARKER_ID:
 			return shared_ptr<J2PColourSpecification>(new J2PColourSpecification());
+		case J2PPalette::MARKER_ID:
+			return shared_ptr<J2PPalette>(new J2PPalette());
+		case J2PComponentMapping::MARKER_ID:
+			return shared_ptr<J2PComponentMapping>(new J2PComponentMapping());
+		case J2PChannelDefinition::MARKER_ID:
+			return shared_ptr<J2PChannelDefinition>(new J2PChannelDefinition());
 		case J2PFile::MARKER_ID:
 			return shared_ptr<J2PFile>(new J2PFile());
 		case J2PResolution::MARKER_ID:
@@ -26,44 +33,299 @@ J2PPartPtr J2PPart::createByMarkerId(uint32_t markerId)
 	return nullptr;
 }
 
+ErrorCode J2PBoxIndex::readBox(const uint8_t* header, uint64_t offset, uint64_t available, J2PBox& box)
+{
+	if (available < 8)
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+	box.offset = offset;
+	box.type = JpegAccess::ReadUint32(header, 4);
+	box.headerLength = 8;
+	uint64_t length = JpegAccess::ReadUint32(header, 0);
+	if (length == 1)
+	{
+		if (available < 16)
+		{
+			return J2P_BOX_INVALID_LENGTH;
+		}
+		length = JpegAccess::ReadUint64(header, 8);
+		box.headerLength = 16;
+	}
+	else if (length == 0)
+	{
+		length = available == UNKNOWN_END ? 0 : available;
+	}
+	if ((length != 0 && length < box.headerLength) || length > available)
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+	box.length = length;
+	return SUCCESS;
+}
+
+ErrorCode J2PBoxIndex::build(const uint8_t* buffer, uint64_t begin, uint64_t end, uint32_t lastType)
+{
+	boxes.clear();
+	uint64_t offset = begin;
+	while (offset < end)
+	{
+		J2PBox box;
+		ErrorCode result = readBox(buffer + offset, offset, end == UNKNOWN_END ? UNKNOWN_END : end - offset, box);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+		boxes.push_back(box);
+		if (box.length == 0 || (end == UNKNOWN_END && box.type == lastType))
+		{
+			break;
+		}
+		offset += box.length;
+	}
+	return SUCCESS;
+}
+
+const J2PBox* J2PBoxIndex::find(uint32_t type) const
+{
+	for (vector<J2PBox>::const_iterator it = boxes.begin(); it != boxes.end(); ++it)
+	{
+		if (it->type == type)
+		{
+			return &*it;
+		}
+	}
+	return NULL;
+}
+
+ErrorCode J2PUnknownBox::load(const uint8_t* buffer, int offset)
+{
+	readLength = JpegAccess::ReadUint32(buffer, offset);
+	type = JpegAccess::ReadUint32(buffer, offset + 4);
+	// a box to the end (LBox 0) or with an XLBox (LBox 1) has no length to go by here
+	if (readLength < 8)
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+	data.assign(buffer + offset + 8, buffer + offset + readLength);
+	return SUCCESS;
+}
+
+void J2PUnknownBox::save(std::ostream& stream) const
+{
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, type);
+	stream.write((const char*)data.data(), data.size());
+}
+
 ErrorCode J2PFile::load(const uint8_t* buffer, int offset)
 {
-	if (!JpegAccess::VerifyReadUint32(buffer, offset, MARKER0) ||
+	return load(buffer, offset, J2PBoxIndex::UNKNOWN_END);
+}
+
+ErrorCode J2PFile::load(const uint8_t* buffer, int offset, uint64_t length)
+{
+	if ((length != J2PBoxIndex::UNKNOWN_END && length < 12) ||
+		!JpegAccess::VerifyReadUint32(buffer, offset, MARKER0) ||
 		!JpegAccess::VerifyReadUint32(buffer, offset + 4, MARKER1) ||
 		!JpegAccess::VerifyReadUint32(buffer, offset + 8, MARKER2))
 	{
 		return J2P_FILE_MAGIC_STRING_DOESNT_MATCH;
 	}
-	ErrorCode result;
-	result = fileType.load(buffer, offset + 12);
+	uint64_t end = length == J2PBoxIndex::UNKNOWN_END ? length : offset + length;
+	boxData = buffer;
+	ErrorCode result = index.build(buffer, offset, end, J2PContiguousCodestream::MARKER_ID);
 	if (result != SUCCESS)
 	{
 		return result;
 	}
-	offset += 12 + fileType.size();
 
-	result = header.load(buffer, offset);
+	// ftyp right after the signature, the rest in any order (I.5)
+	if (index.boxes.size() < 2 || index.boxes[1].type != J2PFileType::MARKER_ID)
+	{
+		return J2P_FILE_TYPE_DESCRIPTOR_DOESNT_MATCH;
+	}
+	result = fileType.load(buffer, (int)index.boxes[1].offset);
 	if (result != SUCCESS)
 	{
 		return result;
 	}
-	offset += header.size();
 
-	codestream.load(buffer, offset);
-	offset += codestream.size();
+	const J2PBox* box = index.find(J2PHeader::MARKER_ID);
+	if (box == NULL)
+	{
+		return J2P_HEADER_DESCRIPTOR_DOESNT_MATCH;
+	}
+	result = header.load(buffer, (int)box->offset);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
 
-	return SUCCESS;
+	box = index.find(J2PContiguousCodestream::MARKER_ID);
+	if (box == NULL)
+	{
+		return J2P_CONTIGUOUS_CODESTREAM_DOESNT_MATCH;
+	}
+	return codestream.load(buffer, (int)box->offset, box->length == 0 ? end : box->offset + box->length);
+}
+
+ErrorCode J2PFile::loadBuffer(const uint8_t* buffer, uint64_t length)
+{
+	return load(buffer, 0, length);
+}
+
+uint64_t J2PFile::size() const
+{
+	uint64_t result = 12 + fileType.size() + header.size() + codestream.size();
+	BOOST_FOREACH(const J2PBox& box, index.boxes)
+	{
+		if (!isOwnBox(box))
+		{
+			result += box.length;
+		}
+	}
+	return result;
+}
+
+bool J2PFile::isOwnBox(const J2PBox& box) const
+{
+	switch (box.type)
+	{
+		case MARKER1:
+		case J2PFileType::MARKER_ID:
+		case J2PHeader::MARKER_ID:
+		case J2PContiguousCodestream::MARKER_ID:
+			return index.find(box.type) == &box;
+	}
+	return false;
+}
+
+J2PPartPtr J2PFile::parseBox(const J2PBox& box) const
+{
+	if (boxData == NULL)
+	{
+		return nullptr;
+	}
+	J2PPartPtr part = J2PPart::createByMarkerId(box.type);
+	if (part == nullptr)
+	{
+		part = shared_ptr<J2PUnknownBox>(new J2PUnknownBox());
+	}
+	if (part->load(boxData, (int)box.offset) != SUCCESS)
+	{
+		return nullptr;
+	}
+	return part;
 }
 
 void J2PFile::save(std::ostream& stream) const
 {
+	if (index.boxes.empty())
+	{
+		JpegAccess::WriteUint32(stream, MARKER0);
+		JpegAccess::WriteUint32(stream, MARKER1);
+		JpegAccess::WriteUint32(stream, MARKER2);
+		fileType.save(stream);
+		header.save(stream);
+		codestream.save(stream);
+		return;
+	}
+
+	BOOST_FOREACH(const J2PBox& box, index.boxes)
+	{
+		if (!isOwnBox(box))
+		{
+			if (boxData != NULL)
+			{
+				stream.write((const char*)boxData + box.offset, box.length);
+			}
+			continue;
+		}
+		switch (box.type)
+		{
+			case MARKER1:
+				JpegAccess::WriteUint32(stream, MARKER0);
+				JpegAccess::WriteUint32(stream, MARKER1);
+				JpegAccess::WriteUint32(stream, MARKER2);
+				break;
+			case J2PFileType::MARKER_ID:
+				fileType.save(stream);
+				break;
+			case J2PHeader::MARKER_ID:
+				header.save(stream);
+				break;
+			case J2PContiguousCodestream::MARKER_ID:
+				codestream.save(stream);
+				break;
+		}
+	}
+}
+
+ErrorCode J2PFile::loadFile(const string& fileName)
+{
+	shared_ptr<boost::iostreams::mapped_file_source> mapping(new boost::iostreams::mapped_file_source());
+	try
+	{
+		mapping->open(fileName);
+	}
+	catch (const exception&)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	ErrorCode result = load((const uint8_t*)mapping->data(), 0, mapping->size());
+	source = mapping;
+	return result;
+}
+
+ErrorCode J2PFile::wrap(const uint8_t* buffer, uint64_t length)
+{
+	ErrorCode result = codestream.wrap(buffer, length);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	fileType.BR = "jp2 ";
+	fileType.MinV = 0;
+	fileType.CL = "jp2 ";
+	header.describe(codestream.file().header);
+	index.boxes.clear();
+	boxData = NULL;
+	source.reset();
+	return SUCCESS;
+}
+
+ErrorCode J2PFile::rewrap(const string& codestreamFileName, const string& fileName)
+{
+	boost::iostreams::mapped_file_source input;
+	try
+	{
+		input.open(codestreamFileName);
+	}
+	catch (const exception&)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	J2PFile file;
+	ErrorCode result = file.wrap((const uint8_t*)input.data(), input.size());
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	ofstream output(fileName, ios::binary);
+	if (!output)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	file.save(output);
+	return SUCCESS;
 }
 
 ErrorCode J2PFileType::load(const uint8_t* buffer, int offset)
 {
 	readLength = JpegAccess::ReadUint32(buffer, offset);
 
-	if (!JpegAccess::VerifyReadUint32(buffer, offset + 4, MARKER_ID))
+	if (!JpegAccess::VerifyReadUint32(buffer, offset + 4, MARKER_ID) || readLength < 16)
 	{
 		return J2P_FILE_TYPE_DESCRIPTOR_DOESNT_MATCH;
 	}
@@ -74,49 +336,97 @@ ErrorCode J2PFileType::load(const uint8_t* buffer, int offset)
 	}
 
 	MinV = JpegAccess::ReadUint32(buffer, offset + 12);
-	CL = string(buffer + offset + 16, buffer + offset + 20);
+	CL = string(buffer + offset + 16, buffer + offset + readLength);
 
 	return SUCCESS;
 }
 
 void J2PFileType::save(std::ostream& stream) const
 {
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	stream.write(BR.data(), 4);
+	JpegAccess::WriteUint32(stream, MinV);
+	stream.write(CL.data(), CL.size());
 }
 
 ErrorCode J2PHeader::load(const uint8_t* buffer, int offset)
 {
 	readLength = JpegAccess::ReadUint32(buffer, offset);
-	if (!JpegAccess::VerifyReadUint32(buffer, offset + 4, MARKER_ID))
+	if (!JpegAccess::VerifyReadUint32(buffer, offset + 4, MARKER_ID) || readLength < 8)
 	{
 		return J2P_HEADER_DESCRIPTOR_DOESNT_MATCH;
 	}
-	int endOffset = offset + readLength;
-	offset += 8;
+	J2PBoxIndex children;
+	ErrorCode result = children.build(buffer, offset + 8, offset + readLength);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
 	boxes.clear();
-	while(true)
+	BOOST_FOREACH(const J2PBox& box, children.boxes)
 	{
-		uint32_t markerId = JpegAccess::ReadUint32(buffer, offset + 4);
-		J2PPartPtr part = J2PPart::createByMarkerId(markerId);
-
+		J2PPartPtr part = J2PPart::createByMarkerId(box.type);
 		if (part == nullptr)
 		{
-			return J2P_UNKOWN_BOX;
+			part = shared_ptr<J2PUnknownBox>(new J2PUnknownBox());
 		}
-		else
+		result = part->load(buffer, (int)box.offset);
+		if (result != SUCCESS)
 		{
-			part.get()->load(buffer, offset);
-			boxes.push_back(part);
-			offset += part.get()->size();
-			if (offset == endOffset)
-			{
-				return SUCCESS;
-			}
+			return result;
 		}
+		boxes.push_back(part);
 	}
+	return SUCCESS;
 }
 
 void J2PHeader::save(std::ostream& stream) const
 {
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	BOOST_FOREACH(const J2PPartPtr& ptr, boxes)
+	{
+		ptr->save(stream);
+	}
+}
+
+void J2PHeader::describe(const Header& codestreamHeader)
+{
+	bool uniform = true;
+	BOOST_FOREACH(const ComponentHeader& component, codestreamHeader.Components)
+	{
+		uniform &= component.Ssiz == codestreamHeader.Components[0].Ssiz;
+	}
+
+	boxes.clear();
+	shared_ptr<J2PImageHeader> imageHeader(new J2PImageHeader());
+	imageHeader->Height = codestreamHeader.Ysiz - codestreamHeader.YOsiz;
+	imageHeader->Width = codestreamHeader.Xsiz - codestreamHeader.XOsiz;
+	imageHeader->NumberOfComponents = codestreamHeader.Csiz;
+	imageHeader->BitsPerComponent = uniform && codestreamHeader.Csiz > 0 ? codestreamHeader.Components[0].Ssiz : 0xFF;
+	imageHeader->CompressionType = 7;
+	imageHeader->ColourspaceUnkown = codestreamHeader.Csiz == 1 || codestreamHeader.Csiz == 3 ? 0 : 1;
+	imageHeader->IntellectualProperty = 0;
+	boxes.push_back(imageHeader);
+
+	if (imageHeader->BitsPerComponent == 0xFF)
+	{
+		shared_ptr<J2PBitsPerComponent> bitsPerComponent(new J2PBitsPerComponent());
+		BOOST_FOREACH(const ComponentHeader& component, codestreamHeader.Components)
+		{
+			bitsPerComponent->BPC.push_back(component.Ssiz);
+		}
+		boxes.push_back(bitsPerComponent);
+	}
+
+	// sRGB or greyscale
+	shared_ptr<J2PColourSpecification> colour(new J2PColourSpecification());
+	colour->SpecificationMethod = 1;
+	colour->Precedence = 0;
+	colour->ColourspaceApproximation = 0;
+	colour->EnumeratedColourspace = codestreamHeader.Csiz >= 3 ? 16 : 17;
+	boxes.push_back(colour);
 }
 
 ErrorCode J2PImageHeader::load(const uint8_t* buffer, int offset)
@@ -143,15 +453,33 @@ ErrorCode J2PImageHeader::load(const uint8_t* buffer, int offset)
 
 void J2PImageHeader::save(std::ostream& stream) const
 {
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	JpegAccess::WriteUint32(stream, Height);
+	JpegAccess::WriteUint32(stream, Width);
+	JpegAccess::WriteUint16(stream, NumberOfComponents);
+	JpegAccess::WriteUint8(stream, BitsPerComponent);
+	JpegAccess::WriteUint8(stream, CompressionType);
+	JpegAccess::WriteUint8(stream, ColourspaceUnkown);
+	JpegAccess::WriteUint8(stream, IntellectualProperty);
 }
 
 ErrorCode J2PBitsPerComponent::load(const uint8_t* buffer, int offset)
 {
+	readLength = JpegAccess::ReadUint32(buffer, offset);
+	if (readLength < 8)
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+	BPC.assign(buffer + offset + 8, buffer + offset + readLength);
 	return SUCCESS;
 }
 
 void J2PBitsPerComponent::save(std::ostream& stream) const
 {
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	stream.write((const char*)BPC.data(), BPC.size());
 }
 
 ErrorCode J2PColourSpecification::load(const uint8_t* buffer, int offset)
@@ -161,20 +489,26 @@ ErrorCode J2PColourSpecification::load(const uint8_t* buffer, int offset)
 	{
 		return J2P_COLOUR_SPECIFICATION_DOESNT_MATCH;
 	}
+	if (readLength < 11 || (JpegAccess::ReadUint8(buffer, offset + 8) == 1 && readLength < 15))
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
 	SpecificationMethod = JpegAccess::ReadUint8(buffer, offset + 8);
 	Precedence = JpegAccess::ReadUint8(buffer, offset + 9);
 	ColourspaceApproximation = JpegAccess::ReadUint8(buffer, offset + 10);
 	
 	offset += 11;
+	Profile = NULL;
+	ProfileLength = 0;
 	if (SpecificationMethod == 1)
 	{
 		EnumeratedColourspace = JpegAccess::ReadUint32(buffer, offset);
 		offset += 4;
 	}
-
-	if (SpecificationMethod == 2)
+	else
 	{
-		// TODO - load PROFILE
+		Profile = buffer + offset;
+		ProfileLength = readLength - 11;
 	}
 	
 	return SUCCESS;
@@ -182,6 +516,156 @@ ErrorCode J2PColourSpecification::load(const uint8_t* buffer, int offset)
 
 void J2PColourSpecification::save(std::ostream& stream) const
 {
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	JpegAccess::WriteUint8(stream, SpecificationMethod);
+	JpegAccess::WriteUint8(stream, Precedence);
+	JpegAccess::WriteUint8(stream, ColourspaceApproximation);
+	if (SpecificationMethod == 1)
+	{
+		JpegAccess::WriteUint32(stream, EnumeratedColourspace);
+	}
+	else if (ProfileLength > 0)
+	{
+		stream.write((const char*)Profile, ProfileLength);
+	}
+}
+
+uint64_t J2PPalette::size() const
+{
+	uint32_t entrySize = 0;
+	for (uint8_t column = 0; column < columns(); column++)
+	{
+		entrySize += (bitDepth(column) + 7) / 8;
+	}
+	return 11 + B.size() + NumberOfEntries * entrySize;
+}
+
+ErrorCode J2PPalette::load(const uint8_t* buffer, int offset)
+{
+	readLength = JpegAccess::ReadUint32(buffer, offset);
+	if (!JpegAccess::VerifyReadUint32(buffer, offset + 4, MARKER_ID))
+	{
+		return J2P_PALETTE_DOESNT_MATCH;
+	}
+	if (readLength < 11)
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+	NumberOfEntries = JpegAccess::ReadUint16(buffer, offset + 8);
+	uint8_t count = JpegAccess::ReadUint8(buffer, offset + 10);
+	if (readLength < 11u + count)
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+	B.assign(buffer + offset + 11, buffer + offset + 11 + count);
+	if (NumberOfEntries == 0 || count == 0 || size() != readLength)
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+
+	// values take as many bytes as their depth needs, big endian
+	C.resize((size_t)NumberOfEntries * count);
+	const uint8_t* value = buffer + offset + 11 + count;
+	for (size_t i = 0; i < C.size(); i++)
+	{
+		uint32_t entry = 0;
+		for (int bytes = (bitDepth((uint8_t)(i % count)) + 7) / 8; bytes > 0; bytes--)
+		{
+			entry = (entry << 8) | *value++;
+		}
+		C[i] = entry;
+	}
+	return SUCCESS;
+}
+
+void J2PPalette::save(std::ostream& stream) const
+{
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	JpegAccess::WriteUint16(stream, NumberOfEntries);
+	JpegAccess::WriteUint8(stream, columns());
+	stream.write((const char*)B.data(), B.size());
+	for (size_t i = 0; i < C.size(); i++)
+	{
+		for (int bytes = (bitDepth((uint8_t)(i % B.size())) + 7) / 8; bytes > 0; bytes--)
+		{
+			JpegAccess::WriteUint8(stream, (uint8_t)(C[i] >> (8 * (bytes - 1))));
+		}
+	}
+}
+
+ErrorCode J2PComponentMapping::load(const uint8_t* buffer, int offset)
+{
+	readLength = JpegAccess::ReadUint32(buffer, offset);
+	if (!JpegAccess::VerifyReadUint32(buffer, offset + 4, MARKER_ID))
+	{
+		return J2P_COMPONENT_MAPPING_DOESNT_MATCH;
+	}
+	if (readLength < 8 || (readLength - 8) % 4 != 0)
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+	channels.resize((readLength - 8) / 4);
+	for (size_t i = 0; i < channels.size(); i++)
+	{
+		int entry = offset + 8 + 4 * (int)i;
+		channels[i].CMP = JpegAccess::ReadUint16(buffer, entry);
+		channels[i].MTYP = JpegAccess::ReadUint8(buffer, entry + 2);
+		channels[i].PCOL = JpegAccess::ReadUint8(buffer, entry + 3);
+	}
+	return SUCCESS;
+}
+
+void J2PComponentMapping::save(std::ostream& stream) const
+{
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	BOOST_FOREACH(const J2PComponentMappingEntry& channel, channels)
+	{
+		JpegAccess::WriteUint16(stream, channel.CMP);
+		JpegAccess::WriteUint8(stream, channel.MTYP);
+		JpegAccess::WriteUint8(stream, channel.PCOL);
+	}
+}
+
+ErrorCode J2PChannelDefinition::load(const uint8_t* buffer, int offset)
+{
+	readLength = JpegAccess::ReadUint32(buffer, offset);
+	if (!JpegAccess::VerifyReadUint32(buffer, offset + 4, MARKER_ID))
+	{
+		return J2P_CHANNEL_DEFINITION_DOESNT_MATCH;
+	}
+	if (readLength < 10)
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+	channels.resize(JpegAccess::ReadUint16(buffer, offset + 8));
+	if (readLength != size())
+	{
+		return J2P_BOX_INVALID_LENGTH;
+	}
+	for (size_t i = 0; i < channels.size(); i++)
+	{
+		int entry = offset + 10 + 6 * (int)i;
+		channels[i].Cn = JpegAccess::ReadUint16(buffer, entry);
+		channels[i].Typ = JpegAccess::ReadUint16(buffer, entry + 2);
+		channels[i].Asoc = JpegAccess::ReadUint16(buffer, entry + 4);
+	}
+	return SUCCESS;
+}
+
+void J2PChannelDefinition::save(std::ostream& stream) const
+{
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	JpegAccess::WriteUint16(stream, (uint16_t)channels.size());
+	BOOST_FOREACH(const J2PChannelDefinitionEntry& channel, channels)
+	{
+		JpegAccess::WriteUint16(stream, channel.Cn);
+		JpegAccess::WriteUint16(stream, channel.Typ);
+		JpegAccess::WriteUint16(stream, channel.Asoc);
+	}
 }
 
 ErrorCode J2PResolution::load(const uint8_t* buffer, int offset)
@@ -191,19 +675,48 @@ ErrorCode J2PResolution::load(const uint8_t* buffer, int offset)
 	{
 		return J2P_RESOLUTION_DESCRIPTOR_DOESNT_MATCH;
 	}
+	int endOffset = offset + readLength;
 	offset += 8;
-	ErrorCode result = captureResolution.load(buffer, offset);
-	if (result != SUCCESS)
+	// either box may be missing
+	captureResolution.readLength = 0;
+	defaultDisplayResolution.readLength = 0;
+	while (offset + 8 <= endOffset)
 	{
-		return result;
+		// no LBox 0 or 1 inside res, and both boxes have 10 bytes of fields
+		uint32_t length = JpegAccess::ReadUint32(buffer, offset);
+		uint32_t markerId = JpegAccess::ReadUint32(buffer, offset + 4);
+		if (length < 18 || length > (uint32_t)(endOffset - offset))
+		{
+			return J2P_RESOLUTION_DESCRIPTOR_DOESNT_MATCH;
+		}
+		ErrorCode result;
+		if (markerId == J2PCaptureResolution::MARKER_ID)
+		{
+			result = captureResolution.load(buffer, offset);
+		}
+		else if (markerId == J2PDefaultDisplayResolution::MARKER_ID)
+		{
+			result = defaultDisplayResolution.load(buffer, offset);
+		}
+		else
+		{
+			result = J2P_RESOLUTION_DESCRIPTOR_DOESNT_MATCH;
+		}
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+		offset += length;
 	}
-	offset += captureResolution.size();
-	result = defaultDisplayResolution.load(buffer, offset);
-	return result;
+	return SUCCESS;
 }
 
 void J2PResolution::save(std::ostream& stream) const
 {
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	captureResolution.save(stream);
+	defaultDisplayResolution.save(stream);
 }
 
 ErrorCode J2PCaptureResolution::load(const uint8_t* buffer, int offset)
@@ -225,6 +738,18 @@ ErrorCode J2PCaptureResolution::load(const uint8_t* buffer, int offset)
 
 void J2PCaptureResolution::save(std::ostream& stream) const
 {
+	if (readLength == 0)
+	{
+		return;
+	}
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	JpegAccess::WriteUint16(stream, VRcN);
+	JpegAccess::WriteUint16(stream, VRcD);
+	JpegAccess::WriteUint16(stream, HRcN);
+	JpegAccess::WriteUint16(stream, HRcD);
+	JpegAccess::WriteUint8(stream, VRcE);
+	JpegAccess::WriteUint8(stream, HRcE);
 }
 
 ErrorCode J2PDefaultDisplayResolution::load(const uint8_t* buffer, int offset)
@@ -251,9 +776,26 @@ ErrorCode J2PDefaultDisplayResolution::load(const uint8_t* buffer, int offset)
 
 void J2PDefaultDisplayResolution::save(std::ostream& stream) const
 {
+	if (readLength == 0)
+	{
+		return;
+	}
+	JpegAccess::WriteUint32(stream, (uint32_t)size());
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	JpegAccess::WriteUint16(stream, VRcN);
+	JpegAccess::WriteUint16(stream, VRcD);
+	JpegAccess::WriteUint16(stream, HRcN);
+	JpegAccess::WriteUint16(stream, HRcD);
+	JpegAccess::WriteUint8(stream, VRcE);
+	JpegAccess::WriteUint8(stream, HRcE);
 }
 
 ErrorCode J2PContiguousCodestream::load(const uint8_t* buffer, int offset)
+{
+	return load(buffer, offset, J2PBoxIndex::UNKNOWN_END);
+}
+
+ErrorCode J2PContiguousCodestream::load(const uint8_t* buffer, int offset, uint64_t end)
 {
 	readLength = JpegAccess::ReadUint32(buffer, offset);
 
@@ -262,16 +804,95 @@ ErrorCode J2PContiguousCodestream::load(const uint8_t* buffer, int offset)
 		return J2P_CONTIGUOUS_CODESTREAM_DOESNT_MATCH;
 	}
 
-	ErrorCode result = file.load(buffer, offset + 8);
+	// LBox 1 - XLBox follows, 0 - up to the end of the file
+	int headerLength = readLength == 1 ? 16 : 8;
+	payload = NULL;
+	wrapped = false;
+	ErrorCode result = parsed.load(ByteCursor(buffer, end, offset + headerLength));
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	payload = buffer + offset + headerLength;
+	if (readLength == 1)
+	{
+		payloadLength = JpegAccess::ReadUint64(buffer, offset + 8) - headerLength;
+	}
+	else if (readLength == 0 && end != J2PBoxIndex::UNKNOWN_END)
+	{
+		payloadLength = end - (offset + headerLength);
+	}
+	else if (readLength == 0)
+	{
+		// up to EOC by the Psot chain, which load() has checked; file.size() would
+		// count the segments as they are saved, not as they are in the buffer
+		J2KFile header;
+		ByteCursor cursor(buffer, end, offset + headerLength);
+		header.loadHeader(cursor);
+		while (cursor.peekMarker() == TilePart::MARKER_ID)
+		{
+			cursor.skip(JpegAccess::ReadUint32(cursor.current(), 6));
+		}
+		payloadLength = cursor.position() + 2 - (offset + headerLength);
+	}
+	else
+	{
+		payloadLength = readLength - headerLength;
+	}
+	return SUCCESS;
+}
 
-	return result;
+ErrorCode J2PContiguousCodestream::wrap(const uint8_t* buffer, uint64_t length)
+{
+	ByteCursor cursor(buffer, length);
+	ErrorCode result = parsed.loadHeader(cursor);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	payload = buffer;
+	payloadLength = length;
+	wrapped = true;
+	return SUCCESS;
+}
+
+J2KFile& J2PContiguousCodestream::editFile()
+{
+	if (!wrapped)
+	{
+		payload = NULL;
+		payloadLength = 0;
+	}
+	return parsed;
 }
 
 void J2PContiguousCodestream::save(std::ostream& stream) const
 {
+	// XLBox past 4 GB
+	uint64_t length = size();
+	if (length > 0xFFFFFFFF)
+	{
+		JpegAccess::WriteUint32(stream, 1);
+		JpegAccess::WriteUint32(stream, MARKER_ID);
+		JpegAccess::WriteUint64(stream, length);
+	}
+	else
+	{
+		JpegAccess::WriteUint32(stream, (uint32_t)length);
+		JpegAccess::WriteUint32(stream, MARKER_ID);
+	}
+	if (payload == NULL)
+	{
+		parsed.save(stream);
+	}
+	else
+	{
+		stream.write((const char*)payload, payloadLength);
+	}
 }
 
-uint32_t J2PContiguousCodestream::size() const
+uint64_t J2PContiguousCodestream::size() const
 {
-	return 8 + file.size();
+	uint64_t body = payload == NULL ? parsed.size() : payloadLength;
+	return (body + 8 > 0xFFFFFFFF ? 16 : 8) + body;
 }
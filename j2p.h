@@ -4,6 +4,7 @@
 #include <boost\cstdint.hpp>
 #include <boost\shared_ptr.hpp>
 #include <boost\foreach.hpp>
+#include <boost\iostreams\device\mapped_file.hpp>
 #include <vector>
 #include <string>
 #include "common.h"
@@ -21,13 +22,68 @@ public:
 	uint32_t readLength;
 
 	virtual uint32_t getMarker() const = 0;
-	virtual uint32_t size() const
+	virtual uint64_t size() const
 	{
 		return readLength;
 	}
 	static J2PPartPtr createByMarkerId(uint32_t markerId);
 };
 
+// Where a box sits in the buffer, LBox/XLBox resolved; the body is not parsed.
+class J2PBox
+{
+public:
+	uint32_t type;
+	uint64_t offset;
+	// whole box, 0 - runs to the end of a buffer of unknown length
+	uint64_t length;
+	uint8_t headerLength;
+
+	uint64_t bodyOffset() const
+	{
+		return offset + headerLength;
+	}
+};
+
+class J2PBoxIndex
+{
+public:
+	static const uint64_t UNKNOWN_END = ~(uint64_t)0;
+	std::vector<J2PBox> boxes;
+
+	// Box at offset from its first bytes (16 at most are used); available - bytes
+	// from offset to the end of the enclosing buffer, or UNKNOWN_END.
+	static ErrorCode readBox(const uint8_t* header, uint64_t offset, uint64_t available, J2PBox& box);
+
+	// Jumps from box to box over [begin, end) without touching the bodies. With an
+	// UNKNOWN_END the walk stops after the first box of type lastType.
+	ErrorCode build(const uint8_t* buffer, uint64_t begin, uint64_t end, uint32_t lastType = 0);
+
+	// first box of the type, NULL when there is none
+	const J2PBox* find(uint32_t type) const;
+};
+
+// Any box this library does not interpret, kept as it is
+class J2PUnknownBox : public J2PPart
+{
+public:
+	uint32_t type;
+	std::vector<uint8_t> data;
+
+	uint32_t getMarker() const
+	{
+		return type;
+	}
+
+	uint64_t size() const
+	{
+		return 8 + data.size();
+	}
+
+	ErrorCode load(const uint8_t* buffer, int offset);
+	void save(std::ostream& stream) const;
+};
+
 class J2PFileType : public J2PPart
 {
 public:
@@ -41,6 +97,11 @@ public:
 		return MARKER_ID;
 	}
 
+	uint64_t size() const
+	{
+		return 16 + CL.size();
+	}
+
 	ErrorCode load(const uint8_t* buffer, int offset);
 	void save(std::ostream& stream) const;
 };
@@ -55,6 +116,19 @@ public:
 	{
 		return MARKER_ID;
 	}
+
+	uint64_t size() const
+	{
+		uint64_t result = 8;
+		BOOST_FOREACH(const J2PPartPtr& ptr, boxes)
+		{
+			result += ptr->size();
+		}
+		return result;
+	}
+
+	// ihdr, bpcc when the components differ, colr - all from the SIZ of a codestream
+	void describe(const Header& codestreamHeader);
 	ErrorCode load(const uint8_t* buffer, int offset);
 	void save(std::ostream& stream) const;
 };
@@ -75,6 +149,11 @@ public:
 	{
 		return MARKER_ID;
 	}
+
+	uint64_t size() const
+	{
+		return 22;
+	}
 	ErrorCode load(const uint8_t* buffer, int offset);
 	void save(std::ostream& stream) const;
 };
@@ -83,11 +162,18 @@ class J2PBitsPerComponent : public J2PPart
 {
 public:
 	static const uint32_t MARKER_ID = 0x62706363;
+	// one Ssiz-style value per component
+	std::vector<uint8_t> BPC;
 
 	uint32_t getMarker() const
 	{
 		return MARKER_ID;
 	}
+
+	uint64_t size() const
+	{
+		return 8 + BPC.size();
+	}
 	ErrorCode load(const uint8_t* buffer, int offset);
 	void save(std::ostream& stream) const;
 };
@@ -100,11 +186,126 @@ public:
 	uint8_t Precedence;
 	uint8_t ColourspaceApproximation;
 	uint32_t EnumeratedColourspace;
+	// PROFILE of the other methods (2 - restricted ICC) inside the loaded buffer,
+	// neither copied nor parsed; only valid while that buffer is.
+	const uint8_t* Profile;
+	uint32_t ProfileLength;
+
+	J2PColourSpecification() : EnumeratedColourspace(0), Profile(NULL), ProfileLength(0) {}
+
+	uint32_t getMarker() const
+	{
+		return MARKER_ID;
+	}
+
+	uint64_t size() const
+	{
+		return SpecificationMethod == 1 ? 15 : 11 + ProfileLength;
+	}
+	ErrorCode load(const uint8_t* buffer, int offset);
+	void save(std::ostream& stream) const;
+};
+
+// pclr: NE entries of NPC columns, each column with its own depth
+class J2PPalette : public J2PPart
+{
+public:
+	static const uint32_t MARKER_ID = 0x70636C72;
+	uint16_t NumberOfEntries;
+	// Ssiz-style B per column: depth - 1, bit 7 set when signed
+	std::vector<uint8_t> B;
+	// entry by entry, NPC values each
+	std::vector<uint32_t> C;
+
+	J2PPalette() : NumberOfEntries(0) {}
+
+	uint8_t columns() const
+	{
+		return (uint8_t)B.size();
+	}
+
+	uint8_t bitDepth(uint8_t column) const
+	{
+		return (B[column] & 0x7F) + 1;
+	}
+
+	uint32_t entry(uint16_t index, uint8_t column) const
+	{
+		return C[(size_t)index * B.size() + column];
+	}
 
 	uint32_t getMarker() const
 	{
 		return MARKER_ID;
 	}
+
+	uint64_t size() const;
+	ErrorCode load(const uint8_t* buffer, int offset);
+	void save(std::ostream& stream) const;
+};
+
+class J2PComponentMappingEntry
+{
+public:
+	uint16_t CMP;
+	// 0 - the component is used directly, 1 - through column PCOL of the palette
+	uint8_t MTYP;
+	uint8_t PCOL;
+};
+
+// cmap: where each channel of the image comes from
+class J2PComponentMapping : public J2PPart
+{
+public:
+	static const uint32_t MARKER_ID = 0x636D6170;
+	std::vector<J2PComponentMappingEntry> channels;
+
+	uint32_t getMarker() const
+	{
+		return MARKER_ID;
+	}
+
+	uint64_t size() const
+	{
+		return 8 + 4 * channels.size();
+	}
+
+	ErrorCode load(const uint8_t* buffer, int offset);
+	void save(std::ostream& stream) const;
+};
+
+class J2PChannelDefinitionEntry
+{
+public:
+	static const uint16_t COLOUR = 0;
+	static const uint16_t OPACITY = 1;
+	static const uint16_t PREMULTIPLIED_OPACITY = 2;
+	static const uint16_t UNSPECIFIED = 65535;
+	static const uint16_t WHOLE_IMAGE = 0;
+
+	uint16_t Cn;
+	uint16_t Typ;
+	// colour (1, 2, ...) the channel belongs to, 0 - the whole image, 65535 - none
+	uint16_t Asoc;
+};
+
+// cdef: type and colour association of channels
+class J2PChannelDefinition : public J2PPart
+{
+public:
+	static const uint32_t MARKER_ID = 0x63646566;
+	std::vector<J2PChannelDefinitionEntry> channels;
+
+	uint32_t getMarker() const
+	{
+		return MARKER_ID;
+	}
+
+	uint64_t size() const
+	{
+		return 10 + 6 * channels.size();
+	}
+
 	ErrorCode load(const uint8_t* buffer, int offset);
 	void save(std::ostream& stream) const;
 };
@@ -125,6 +326,12 @@ public:
 		return MARKER_ID;
 	}
 
+	// 0 - the box is absent
+	uint64_t size() const
+	{
+		return readLength == 0 ? 0 : 18;
+	}
+
 	ErrorCode load(const uint8_t* buffer, int offset);
 	void save(std::ostream& stream) const;
 };
@@ -145,6 +352,12 @@ public:
 		return MARKER_ID;
 	}
 
+	// 0 - the box is absent
+	uint64_t size() const
+	{
+		return readLength == 0 ? 0 : 18;
+	}
+
 	ErrorCode load(const uint8_t* buffer, int offset);
 	void save(std::ostream& stream) const;
 };
@@ -160,6 +373,12 @@ public:
 	{
 		return MARKER_ID;
 	}
+
+	uint64_t size() const
+	{
+		return 8 + captureResolution.size() + defaultDisplayResolution.size();
+	}
+
 	ErrorCode load(const uint8_t* buffer, int offset);
 	void save(std::ostream& stream) const;
 };
@@ -168,15 +387,37 @@ class J2PContiguousCodestream : public J2PPart
 {
 public:
 	static const uint32_t MARKER_ID = 0x6A703263;
-	J2KFile file;
+	// Codestream bytes inside the loaded buffer, saved as they are as long as the
+	// file is not edited; only valid while that buffer is.
+	const uint8_t* payload;
+	uint64_t payloadLength;
+
+	J2PContiguousCodestream() : payload(NULL), payloadLength(0), wrapped(false) {}
+
+	const J2KFile& file() const
+	{
+		return parsed;
+	}
+
+	// The file for changes, which save() re-serializes from then on. After wrap()
+	// there is only the main header, and the payload is still saved as it is.
+	J2KFile& editFile();
 
 	uint32_t getMarker() const
 	{
 		return MARKER_ID;
 	}
 	ErrorCode load(const uint8_t* buffer, int offset);
+	// the codestream is not read past end (from buffer)
+	ErrorCode load(const uint8_t* buffer, int offset, uint64_t end);
+	// the codestream of length bytes at buffer, of which only the main header is parsed
+	ErrorCode wrap(const uint8_t* buffer, uint64_t length);
 	void save(std::ostream& stream) const;
-	uint32_t size() const;
+	uint64_t size() const;
+
+private:
+	J2KFile parsed;
+	bool wrapped;
 };
 
 class J2PFile : public J2PPart, public ImageFile
@@ -196,8 +437,43 @@ public:
 	{
 		return MARKER_ID;
 	}
+
+	uint64_t size() const;
+
+	// Every top level box, in file order. Boxes other than the signature, ftyp, jp2h and
+	// the first jp2c are neither parsed nor copied; save() writes them from the loaded
+	// buffer, which therefore has to outlive the call.
+	J2PBoxIndex index;
+
+	// Without a length the file is taken to end with the first jp2c box.
 	ErrorCode load(const uint8_t* buffer, int offset);
+	ErrorCode load(const uint8_t* buffer, int offset, uint64_t length);
+	ErrorCode loadBuffer(const uint8_t* buffer, uint64_t length);
 	void save(std::ostream& stream) const;
+
+	// Parses a box of index on demand from the loaded buffer, which has to outlive
+	// this object unless loadFile mapped it; NULL when the box does not parse.
+	J2PPartPtr parseBox(const J2PBox& box) const;
+
+	// Maps the file so codestream.payload stays valid until the next load.
+	ErrorCode loadFile(const std::string& fileName);
+
+	// Boxes around the codestream of length bytes at buffer; only its main header
+	// is parsed, the codestream itself is written by reference.
+	ErrorCode wrap(const uint8_t* buffer, uint64_t length);
+
+	// .j2k -> .jp2 in one sequential write
+	static ErrorCode rewrap(const std::string& codestreamFileName, const std::string& fileName);
+
+private:
+	std::shared_ptr<boost::iostreams::mapped_file_source> source;
+	// the buffer index refers to
+	const uint8_t* boxData;
+
+	bool isOwnBox(const J2PBox& box) const;
+
+public:
+	J2PFile() : boxData(NULL) {}
 };
 
 }
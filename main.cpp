@@ -2,15 +2,52 @@
 #include <fstream>
 #include "j2k.h"
 #include "j2p.h"
+#include "batch.h"
+#include "instrument.h"
 using namespace std;
 using namespace BJPEG;
 
+// Loads every file given on the command line through the batch pipeline.
+static int batchLoad(int argc, char* argv[])
+{
+	vector<string> fileNames(argv + 1, argv + argc);
+	boost::mutex outputLock;
+	int failures = 0;
+
+	BatchPipeline pipeline;
+	pipeline.run(fileNames, [&](BatchItem& item)
+	{
+		boost::mutex::scoped_lock guard(outputLock);
+		if (item.error == SUCCESS)
+		{
+			cout << item.fileName << ": " << item.file.tiles.size() << " tile parts, " << item.file.size() << " bytes" << endl;
+		}
+		else
+		{
+			cout << item.fileName << ": error " << item.error << endl;
+			failures++;
+		}
+	});
+#ifdef BJPEG_INSTRUMENT
+	ofstream trace("bjpeg.trace.json");
+	Instrumentation::writeTrace(trace);
+	ofstream metrics("bjpeg.prom");
+	Instrumentation::writeMetrics(metrics);
+#endif
+	return failures == 0 ? 0 : 1;
+}
+
 int main(int argc, char* argv[])
 {
+	if (argc > 1)
+	{
+		return batchLoad(argc, argv);
+	}
+
 	ErrorCode errorCode;
 
 	J2KFile jpeg;
-	errorCode = jpeg.loadFile("e:\\bretagne1.j2k");
+	errorCode = jpeg.loadFile("img/Bretagne1.j2k");
 	
 	if (errorCode == SUCCESS)
 	{
@@ -32,7 +69,7 @@ int main(int argc, char* argv[])
 		(jpeg.tiles.begin() + 2)->Isot = 0;
 		(jpeg.tiles.begin() + 3)->Isot = 1;
 
-		jpeg.saveFile("e:\\clone.j2k");
+		jpeg.saveFile("img/clone.j2k");
 	}
 
 	return 0;
@@ -0,0 +1,286 @@
+#include "mosaic.h"
+#include "scheduler.h"
+#include "sidecar.h"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <exception>
+#include <unordered_map>
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	// MurmurHash64A; collisions are settled by comparing the bytes
+	uint64_t hashPayload(const uint8_t* data, uint32_t length)
+	{
+		const uint64_t m = 0xC6A4A7935BD1E995ULL;
+		const int r = 47;
+		uint64_t h = 0x9E3779B97F4A7C15ULL ^ (length * m);
+		const uint8_t* end = data + (length & ~7u);
+		for (; data != end; data += 8)
+		{
+			uint64_t k;
+			memcpy(&k, data, 8);
+			k *= m;
+			k ^= k >> r;
+			k *= m;
+			h ^= k;
+			h *= m;
+		}
+		uint64_t tail = 0;
+		for (uint32_t i = length & 7; i > 0; i--)
+		{
+			tail = (tail << 8) | data[i - 1];
+		}
+		if ((length & 7) != 0)
+		{
+			h ^= tail;
+			h *= m;
+		}
+		h ^= h >> r;
+		h *= m;
+		h ^= h >> r;
+		return h;
+	}
+
+	void writeTilePartHeader(ostream& stream, const MosaicTilePart& tilePart, uint32_t length)
+	{
+		JpegAccess::WriteUint16(stream, TilePart::MARKER_ID);
+		JpegAccess::WriteUint16(stream, TilePart::Lsot);
+		JpegAccess::WriteUint16(stream, tilePart.Isot);
+		JpegAccess::WriteUint32(stream, 12 + length);
+		JpegAccess::WriteUint8(stream, tilePart.TPsot);
+		JpegAccess::WriteUint8(stream, tilePart.TNsot);
+	}
+}
+
+ErrorCode MosaicFile::build(const uint8_t* buffer, uint64_t length, unsigned threads)
+{
+	CodestreamIndex index;
+	ErrorCode result = index.build(buffer, length);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	mainHeader.assign(buffer, buffer + index.mainHeaderLength);
+	data = buffer;
+	source.reset();
+
+	tileParts.clear();
+	vector<MosaicPayload> bodies;
+	for (uint32_t i = 0; i < index.tilePartCount(); i++)
+	{
+		TilePartEntry entry = index.tilePart(i);
+		MosaicTilePart tilePart = { entry.Isot, entry.TPsot, entry.TNsot, 0 };
+		MosaicPayload body = { entry.offset + 12, entry.length - 12 };
+		tileParts.push_back(tilePart);
+		bodies.push_back(body);
+	}
+
+	vector<uint64_t> hashes(bodies.size());
+	{
+		TaskScheduler scheduler(threads);
+		scheduler.parallelFor(0, bodies.size(), 16, [&](size_t i)
+		{
+			hashes[i] = hashPayload(buffer + bodies[i].offset, bodies[i].length);
+		});
+	}
+
+	// the first body with given contents becomes the payload, later ones refer to it
+	payloads.clear();
+	unordered_map<uint64_t, vector<uint32_t> > seen;
+	for (size_t i = 0; i < bodies.size(); i++)
+	{
+		const MosaicPayload& body = bodies[i];
+		vector<uint32_t>& candidates = seen[hashes[i]];
+		uint32_t id = (uint32_t)payloads.size();
+		BOOST_FOREACH(uint32_t candidate, candidates)
+		{
+			const MosaicPayload& payload = payloads[candidate];
+			if (payload.length == body.length && memcmp(buffer + payload.offset, buffer + body.offset, body.length) == 0)
+			{
+				id = candidate;
+				break;
+			}
+		}
+		if (id == payloads.size())
+		{
+			payloads.push_back(body);
+			candidates.push_back(id);
+		}
+		tileParts[i].payload = id;
+	}
+	return SUCCESS;
+}
+
+ErrorCode MosaicFile::load(const uint8_t* buffer, int offset)
+{
+	return load(buffer, offset, ~(uint64_t)0);
+}
+
+ErrorCode MosaicFile::load(const uint8_t* buffer, int offset, uint64_t length)
+{
+	if (length < 8 || !JpegAccess::VerifyReadUint32(buffer, offset, MARKER_ID))
+	{
+		return MOSAIC_MAGIC_DOESNT_MATCH;
+	}
+	const uint8_t* base = buffer + offset;
+	uint64_t position = 4;
+	uint32_t headerLength = JpegAccess::ReadUint32(base, 4);
+	position += 4;
+	if (position + headerLength + 4 > length)
+	{
+		return MOSAIC_INVALID_INDEX;
+	}
+	mainHeader.assign(base + position, base + position + headerLength);
+	position += headerLength;
+
+	uint32_t count = JpegAccess::ReadUint32(base, (int)position);
+	position += 4;
+	if (position + 8 * (uint64_t)count + 4 > length)
+	{
+		return MOSAIC_INVALID_INDEX;
+	}
+	tileParts.resize(count);
+	for (uint32_t i = 0; i < count; i++, position += 8)
+	{
+		tileParts[i].Isot = JpegAccess::ReadUint16(base, (int)position);
+		tileParts[i].TPsot = JpegAccess::ReadUint8(base, (int)position + 2);
+		tileParts[i].TNsot = JpegAccess::ReadUint8(base, (int)position + 3);
+		tileParts[i].payload = JpegAccess::ReadUint32(base, (int)position + 4);
+	}
+
+	count = JpegAccess::ReadUint32(base, (int)position);
+	position += 4;
+	if (position + 12 * (uint64_t)count > length)
+	{
+		return MOSAIC_INVALID_INDEX;
+	}
+	payloads.resize(count);
+	for (uint32_t i = 0; i < count; i++, position += 12)
+	{
+		payloads[i].offset = JpegAccess::ReadUint64(base, (int)position);
+		payloads[i].length = JpegAccess::ReadUint32(base, (int)position + 8);
+		if (payloads[i].offset + payloads[i].length > length)
+		{
+			return MOSAIC_INVALID_INDEX;
+		}
+	}
+	BOOST_FOREACH(const MosaicTilePart& tilePart, tileParts)
+	{
+		if (tilePart.payload >= payloads.size())
+		{
+			return MOSAIC_INVALID_INDEX;
+		}
+	}
+	data = base;
+	return SUCCESS;
+}
+
+void MosaicFile::save(ostream& stream) const
+{
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	JpegAccess::WriteUint32(stream, (uint32_t)mainHeader.size());
+	stream.write((const char*)mainHeader.data(), mainHeader.size());
+	JpegAccess::WriteUint32(stream, (uint32_t)tileParts.size());
+	BOOST_FOREACH(const MosaicTilePart& tilePart, tileParts)
+	{
+		JpegAccess::WriteUint16(stream, tilePart.Isot);
+		JpegAccess::WriteUint8(stream, tilePart.TPsot);
+		JpegAccess::WriteUint8(stream, tilePart.TNsot);
+		JpegAccess::WriteUint32(stream, tilePart.payload);
+	}
+	JpegAccess::WriteUint32(stream, (uint32_t)payloads.size());
+	uint64_t offset = 16 + mainHeader.size() + 8 * (uint64_t)tileParts.size() + 12 * (uint64_t)payloads.size();
+	BOOST_FOREACH(const MosaicPayload& payload, payloads)
+	{
+		JpegAccess::WriteUint64(stream, offset);
+		JpegAccess::WriteUint32(stream, payload.length);
+		offset += payload.length;
+	}
+	BOOST_FOREACH(const MosaicPayload& payload, payloads)
+	{
+		stream.write((const char*)data + payload.offset, payload.length);
+	}
+}
+
+ErrorCode MosaicFile::loadFile(const string& fileName)
+{
+	shared_ptr<boost::iostreams::mapped_file_source> mapping(new boost::iostreams::mapped_file_source());
+	try
+	{
+		mapping->open(fileName);
+	}
+	catch (const exception&)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	ErrorCode result = load((const uint8_t*)mapping->data(), 0, mapping->size());
+	source = mapping;
+	return result;
+}
+
+uint64_t MosaicFile::codestreamSize() const
+{
+	uint64_t result = mainHeader.size() + 12 * (uint64_t)tileParts.size() + 2;
+	BOOST_FOREACH(const MosaicTilePart& tilePart, tileParts)
+	{
+		result += payloads[tilePart.payload].length;
+	}
+	return result;
+}
+
+void MosaicFile::saveCodestream(ostream& stream) const
+{
+	stream.write((const char*)mainHeader.data(), mainHeader.size());
+	BOOST_FOREACH(const MosaicTilePart& tilePart, tileParts)
+	{
+		const MosaicPayload& payload = payloads[tilePart.payload];
+		writeTilePartHeader(stream, tilePart, payload.length);
+		stream.write((const char*)data + payload.offset, payload.length);
+	}
+	JpegAccess::WriteUint16(stream, J2KFile::EOC);
+}
+
+ErrorCode MosaicFile::tilePart(size_t index, TilePart& tile) const
+{
+	if (index >= tileParts.size())
+	{
+		return MOSAIC_INVALID_INDEX;
+	}
+	const MosaicTilePart& tilePart = tileParts[index];
+	const MosaicPayload& payload = payloads[tilePart.payload];
+	ostringstream stream;
+	writeTilePartHeader(stream, tilePart, payload.length);
+	stream.write((const char*)data + payload.offset, payload.length);
+	string bytes = stream.str();
+	return tile.load(ByteCursor((const uint8_t*)bytes.data(), bytes.size()));
+}
+
+ErrorCode MosaicFile::pack(const string& codestreamFileName, const string& fileName, unsigned threads)
+{
+	boost::iostreams::mapped_file_source input;
+	try
+	{
+		input.open(codestreamFileName);
+	}
+	catch (const exception&)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	MosaicFile file;
+	ErrorCode result = file.build((const uint8_t*)input.data(), input.size(), threads);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	ofstream output(fileName, ios::binary);
+	if (!output)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	file.save(output);
+	return SUCCESS;
+}
@@ -0,0 +1,80 @@
+#ifndef _MOSAIC_H_
+#define _MOSAIC_H_
+
+#include <boost\cstdint.hpp>
+#include <boost\iostreams\device\mapped_file.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "j2k.h"
+
+namespace BJPEG
+{
+
+// SOT fields of a tile part and the payload following them
+class MosaicTilePart
+{
+public:
+	uint16_t Isot;
+	uint8_t TPsot;
+	uint8_t TNsot;
+	uint32_t payload;
+};
+
+// Tile part body - marker segments and packet data after SOT - stored once
+class MosaicPayload
+{
+public:
+	uint64_t offset;
+	uint32_t length;
+};
+
+// Codestream with identical tile part bodies stored once, for mosaics where
+// blank, no-data or sea tiles repeat thousands of times. Layout, big endian:
+//   "BJ2D", main header length (4), main header as it was (SOC up to the first SOT),
+//   tile part count (4), per tile part Isot (2), TPsot (1), TNsot (1), payload (4),
+//   payload count (4), per payload file offset (8) and length (4), payloads.
+// The standard codestream is put back together while it is written out.
+class MosaicFile : public ImageFile
+{
+	// the buffer payload offsets refer to
+	const uint8_t* data;
+	std::shared_ptr<boost::iostreams::mapped_file_source> source;
+
+public:
+	static const uint32_t MARKER_ID = 0x424A3244;
+
+	std::vector<uint8_t> mainHeader;
+	std::vector<MosaicTilePart> tileParts;
+	std::vector<MosaicPayload> payloads;
+
+	MosaicFile() : data(NULL) {}
+
+	using ImageFile::load;
+
+	// Indexes the codestream of length bytes at buffer, hashing the tile part bodies
+	// on threads workers (0 - one per hardware thread). Payloads are not copied, the
+	// buffer has to outlive save().
+	ErrorCode build(const uint8_t* buffer, uint64_t length, unsigned threads = 0);
+
+	ErrorCode load(const uint8_t* buffer, int offset);
+	ErrorCode load(const uint8_t* buffer, int offset, uint64_t length);
+	void save(std::ostream& stream) const;
+
+	// Maps the file, so the payloads are read straight from the page cache.
+	ErrorCode loadFile(const std::string& fileName);
+
+	// size of the reconstructed codestream
+	uint64_t codestreamSize() const;
+	void saveCodestream(std::ostream& stream) const;
+	// one tile part of the codestream, parsed on demand
+	ErrorCode tilePart(size_t index, TilePart& tile) const;
+
+	// .j2k -> mosaic in one sequential write
+	static ErrorCode pack(const std::string& codestreamFileName, const std::string& fileName, unsigned threads = 0);
+};
+
+}
+
+#endif /*_MOSAIC_H_*/
@@ -0,0 +1,493 @@
+#include "packets.h"
+#include "tier2.h"
+#include <algorithm>
+#include <map>
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	// default precinct partition (Scod bit 0 clear)
+	const uint8_t PRECINCT_EXPONENT = 15;
+
+	// segments which change the packets of a tile from what the main COD says
+	inline bool changesPackets(uint16_t marker)
+	{
+		return marker == J2KMarkers::COD || marker == J2KMarkers::COC || marker == J2KMarkers::POC;
+	}
+
+	inline uint32_t ceilDiv(uint64_t value, uint64_t divisor)
+	{
+		return (uint32_t)((value + divisor - 1) / divisor);
+	}
+
+	// B-15, offset is xob (yob)
+	inline uint32_t bandCoordinate(uint32_t coordinate, uint32_t offset, uint32_t level)
+	{
+		int64_t value = (int64_t)coordinate - ((int64_t)offset << (level - 1));
+		int64_t divisor = (int64_t)1 << level;
+		return value <= 0 ? 0 : (uint32_t)((value + divisor - 1) / divisor);
+	}
+
+	inline uint32_t floorLog2(uint32_t value)
+	{
+		uint32_t result = 0;
+		while (value >>= 1)
+		{
+			result++;
+		}
+		return result;
+	}
+
+	// code-block styles with more than one codeword segment per code-block
+	// contribution: selective arithmetic coding bypass, termination on each pass
+	const uint8_t SEGMENTED_STYLES = 0x01 | 0x04;
+
+	// what packet headers of a code-block depend on from earlier layers
+	struct BlockState
+	{
+		bool included;
+		uint32_t lengthBits;
+	};
+
+	struct PrecinctBandState
+	{
+		TagTreeDecoder inclusion;
+		TagTreeDecoder zeroBitPlanes;
+		std::vector<BlockState> blocks;
+	};
+
+	typedef std::vector<PrecinctBandState> PrecinctState;
+
+	void initPrecinct(PrecinctState& precinct, const ResolutionGeometry& resolution, uint32_t p)
+	{
+		precinct.resize(resolution.bands.size());
+		for (size_t b = 0; b < precinct.size(); b++)
+		{
+			uint32_t width;
+			uint32_t height;
+			resolution.codeBlockGrid(p, b, width, height);
+			precinct[b].inclusion.init(width, height);
+			precinct[b].zeroBitPlanes.init(width, height);
+			BlockState block = { false, 3 };
+			precinct[b].blocks.assign((size_t)width * height, block);
+		}
+	}
+
+	// B.10: the header of the packet of layer at data, which has to end before
+	// length; headerLength includes a following EPH
+	ErrorCode readPacketHeader(PrecinctState& precinct, uint16_t layer, const uint8_t* data, size_t length, bool eph,
+		uint32_t& headerLength, uint32_t& bodyLength)
+	{
+		PacketHeaderReader reader(data, length);
+		bodyLength = 0;
+		if (reader.getBit() == 1)
+		{
+			for (size_t b = 0; b < precinct.size(); b++)
+			{
+				PrecinctBandState& band = precinct[b];
+				for (uint32_t i = 0; i < band.blocks.size(); i++)
+				{
+					BlockState& block = band.blocks[i];
+					bool contributes = block.included ? reader.getBit() == 1 : band.inclusion.decode(reader, i, layer + 1);
+					if (!contributes)
+					{
+						continue;
+					}
+					if (!block.included)
+					{
+						// the number of missing bit planes only matters to tier-1
+						int threshold = 1;
+						while (!band.zeroBitPlanes.decode(reader, i, threshold) && !reader.hasOverrun())
+						{
+							threshold++;
+						}
+						block.included = true;
+					}
+					uint32_t passes = reader.getPassCount();
+					block.lengthBits += reader.getCommaCode();
+					int bits = (int)(block.lengthBits + floorLog2(passes));
+					if (bits > 32 || reader.hasOverrun())
+					{
+						return PACKET_INDEX_INVALID;
+					}
+					bodyLength += reader.getBits(bits);
+				}
+			}
+		}
+		size_t used = reader.finish();
+		if (reader.hasOverrun())
+		{
+			return PACKET_INDEX_INVALID;
+		}
+		if (eph && used + 2 <= length && JpegAccess::VerifyReadUint16(data, (int)used, J2KMarkers::EPH))
+		{
+			used += 2;
+		}
+		headerLength = (uint32_t)used;
+		return SUCCESS;
+	}
+
+	// packet with the fields the progression sorts on, most significant first
+	struct OrderedPacket
+	{
+		uint64_t keys[5];
+		PacketEntry entry;
+
+		bool operator<(const OrderedPacket& other) const
+		{
+			return lexicographical_compare(keys, keys + 5, other.keys, other.keys + 5);
+		}
+	};
+}
+
+void ResolutionGeometry::codeBlockGrid(uint32_t precinct, size_t band, uint32_t& width, uint32_t& height) const
+{
+	// precincts of the resolution mapped onto the sub-band
+	uint32_t shiftX = bands.size() == 1 || ppx == 0 ? ppx : ppx - 1;
+	uint32_t shiftY = bands.size() == 1 || ppy == 0 ? ppy : ppy - 1;
+	uint64_t i = (x0 >> ppx) + precinct % precinctsWide;
+	uint64_t j = (y0 >> ppy) + precinct / precinctsWide;
+	const GridRect& rect = bands[band];
+	uint64_t rx0 = max<uint64_t>(i << shiftX, rect.x0);
+	uint64_t ry0 = max<uint64_t>(j << shiftY, rect.y0);
+	uint64_t rx1 = min<uint64_t>((i + 1) << shiftX, rect.x1);
+	uint64_t ry1 = min<uint64_t>((j + 1) << shiftY, rect.y1);
+	width = 0;
+	height = 0;
+	if (rx0 < rx1 && ry0 < ry1)
+	{
+		uint32_t xcbr = min<uint32_t>(xcb, shiftX);
+		uint32_t ycbr = min<uint32_t>(ycb, shiftY);
+		width = ceilDiv(rx1, (uint64_t)1 << xcbr) - (uint32_t)(rx0 >> xcbr);
+		height = ceilDiv(ry1, (uint64_t)1 << ycbr) - (uint32_t)(ry0 >> ycbr);
+	}
+}
+
+GridRect ResolutionGeometry::precinctRect(uint32_t precinct) const
+{
+	uint32_t i = (x0 >> ppx) + precinct % precinctsWide;
+	uint32_t j = (y0 >> ppy) + precinct / precinctsWide;
+	GridRect result;
+	result.x0 = max(x0, i << ppx) * scaleX;
+	result.y0 = max(y0, j << ppy) * scaleY;
+	result.x1 = (uint32_t)min<uint64_t>(x1, ((uint64_t)i + 1) << ppx) * scaleX;
+	result.y1 = (uint32_t)min<uint64_t>(y1, ((uint64_t)j + 1) << ppy) * scaleY;
+	return result;
+}
+
+void TileGeometry::build(const J2KFile& file, uint16_t tile)
+{
+	const Header& header = file.header;
+	const CodingStyleDefault& cod = file.codingStyleDefault;
+	uint32_t tilesX = ceilDiv(header.Xsiz - header.XTOsiz, header.XTsiz);
+	uint32_t p = tile % tilesX;
+	uint32_t q = tile / tilesX;
+	rect.x0 = max(header.XTOsiz + p * header.XTsiz, header.XOsiz);
+	rect.y0 = max(header.YTOsiz + q * header.YTsiz, header.YOsiz);
+	rect.x1 = min(header.XTOsiz + (p + 1) * header.XTsiz, header.Xsiz);
+	rect.y1 = min(header.YTOsiz + (q + 1) * header.YTsiz, header.Ysiz);
+
+	uint8_t levels = cod.NumberOfDecompositionLevels;
+	resolutions.assign(header.Csiz, vector<ResolutionGeometry>(levels + 1));
+	for (uint16_t c = 0; c < header.Csiz; c++)
+	{
+		const ComponentHeader& component = header.Components[c];
+		GridRect tileComponent = { ceilDiv(rect.x0, component.XRsiz), ceilDiv(rect.y0, component.YRsiz),
+			ceilDiv(rect.x1, component.XRsiz), ceilDiv(rect.y1, component.YRsiz) };
+		for (uint8_t r = 0; r <= levels; r++)
+		{
+			// B-14 and B-16
+			ResolutionGeometry& resolution = resolutions[c][r];
+			uint64_t scale = (uint64_t)1 << (levels - r);
+			resolution.x0 = ceilDiv(tileComponent.x0, scale);
+			resolution.y0 = ceilDiv(tileComponent.y0, scale);
+			resolution.x1 = ceilDiv(tileComponent.x1, scale);
+			resolution.y1 = ceilDiv(tileComponent.y1, scale);
+			resolution.scaleX = (uint32_t)(component.XRsiz * scale);
+			resolution.scaleY = (uint32_t)(component.YRsiz * scale);
+			bool defined = cod.isEntropyCoderWithDefinedPrecints() && r < cod.PrecintSizes.size();
+			resolution.ppx = defined ? cod.PrecintSizes[r] & 0xF : PRECINCT_EXPONENT;
+			resolution.ppy = defined ? cod.PrecintSizes[r] >> 4 : PRECINCT_EXPONENT;
+			bool empty = resolution.x1 <= resolution.x0 || resolution.y1 <= resolution.y0;
+			resolution.precinctsWide = empty ? 0 : ceilDiv(resolution.x1, (uint64_t)1 << resolution.ppx) - (resolution.x0 >> resolution.ppx);
+			resolution.precinctsHigh = empty ? 0 : ceilDiv(resolution.y1, (uint64_t)1 << resolution.ppy) - (resolution.y0 >> resolution.ppy);
+
+			resolution.xcb = cod.CodeBlockWidth + 2;
+			resolution.ycb = cod.CodeBlockHeight + 2;
+			resolution.bands.clear();
+			if (r == 0)
+			{
+				GridRect band = { resolution.x0, resolution.y0, resolution.x1, resolution.y1 };
+				resolution.bands.push_back(band);
+				continue;
+			}
+			// HL, LH, HH
+			uint32_t level = levels - r + 1;
+			for (uint32_t orientation = 1; orientation <= 3; orientation++)
+			{
+				uint32_t xob = orientation & 1;
+				uint32_t yob = orientation >> 1;
+				GridRect band = { bandCoordinate(tileComponent.x0, xob, level), bandCoordinate(tileComponent.y0, yob, level),
+					bandCoordinate(tileComponent.x1, xob, level), bandCoordinate(tileComponent.y1, yob, level) };
+				resolution.bands.push_back(band);
+			}
+		}
+	}
+}
+
+vector<PacketEntry> TileGeometry::packetOrder(const J2KFile& file, uint16_t tile) const
+{
+	const CodingStyleDefault& cod = file.codingStyleDefault;
+	vector<OrderedPacket> packets;
+	for (uint16_t c = 0; c < resolutions.size(); c++)
+	{
+		for (uint8_t r = 0; r < resolutions[c].size(); r++)
+		{
+			const ResolutionGeometry& resolution = resolutions[c][r];
+			for (uint32_t p = 0; p < resolution.precinctCount(); p++)
+			{
+				// a precinct comes up where the position loops of B.12.1.3-5 first meet
+				// it: at its upper left corner on the reference grid, except that a first
+				// column (row) not aligned to the precinct size is met at tx0 (ty0)
+				uint32_t column = p % resolution.precinctsWide;
+				uint32_t row = p / resolution.precinctsWide;
+				uint64_t x = (uint64_t)max(resolution.x0, ((resolution.x0 >> resolution.ppx) + column) << resolution.ppx) * resolution.scaleX;
+				uint64_t y = (uint64_t)max(resolution.y0, ((resolution.y0 >> resolution.ppy) + row) << resolution.ppy) * resolution.scaleY;
+				if (column == 0 && (resolution.x0 & ((1u << resolution.ppx) - 1)) != 0)
+				{
+					x = rect.x0;
+				}
+				if (row == 0 && (resolution.y0 & ((1u << resolution.ppy) - 1)) != 0)
+				{
+					y = rect.y0;
+				}
+				for (uint16_t l = 0; l < cod.NumberOfLayers; l++)
+				{
+					OrderedPacket packet;
+					PrecinctKey key = { tile, c, r, p };
+					packet.entry.key = key;
+					packet.entry.layer = l;
+					packet.entry.tilePart = 0;
+					packet.entry.offset = 0;
+					packet.entry.length = 0;
+					packet.entry.headerOffset = 0;
+					packet.entry.headerLength = 0;
+					uint64_t* k = packet.keys;
+					switch (cod.ProgressionOrder)
+					{
+						case 0:
+							k[0] = l; k[1] = r; k[2] = c; k[3] = p; k[4] = 0;
+							break;
+						case 1:
+							k[0] = r; k[1] = l; k[2] = c; k[3] = p; k[4] = 0;
+							break;
+						case 2:
+							k[0] = r; k[1] = y; k[2] = x; k[3] = c; k[4] = l;
+							break;
+						case 3:
+							k[0] = y; k[1] = x; k[2] = c; k[3] = r; k[4] = l;
+							break;
+						default:
+							k[0] = c; k[1] = y; k[2] = x; k[3] = r; k[4] = l;
+							break;
+					}
+					packets.push_back(packet);
+				}
+			}
+		}
+	}
+	sort(packets.begin(), packets.end());
+	vector<PacketEntry> result;
+	result.reserve(packets.size());
+	for (size_t i = 0; i < packets.size(); i++)
+	{
+		result.push_back(packets[i].entry);
+	}
+	return result;
+}
+
+ErrorCode PacketIndex::readPacketHeaders(const J2KFile& file, const TileGeometry& geometry, const vector<uint32_t>& tileParts,
+	const vector<vector<uint8_t> >& partHeaders, const vector<uint8_t>& packedHeaders, vector<PacketEntry>& packets)
+{
+	const CodingStyleDefault& cod = file.codingStyleDefault;
+	if ((cod.CodeBlockStyle & SEGMENTED_STYLES) != 0)
+	{
+		return PACKET_INDEX_UNSUPPORTED;
+	}
+	bool packed = !packedHeaders.empty();
+	bool sop = cod.canUseSOPMarker();
+	bool eph = cod.canUseEPHMarker();
+	map<PrecinctKey, PrecinctState> precincts;
+	size_t next = 0;
+	uint32_t headerOffset = 0;
+	BOOST_FOREACH(uint32_t i, tileParts)
+	{
+		const vector<uint8_t>& data = file.tiles[i].Raw;
+		uint32_t offset = 2;
+		// with packed headers empty packets take no data, so the headers tell where the tile part ends
+		uint32_t headerEnd = headerOffset + (uint32_t)partHeaders[i].size();
+		while (next < packets.size() && (packed ? headerOffset < headerEnd : offset < data.size()))
+		{
+			PacketEntry& packet = packets[next++];
+			const ResolutionGeometry& resolution = geometry.resolutions[packet.key.component][packet.key.resolution];
+			PrecinctState& precinct = precincts[packet.key];
+			if (precinct.empty())
+			{
+				initPrecinct(precinct, resolution, packet.key.precinct);
+			}
+			// a packed header comes without the SOP in front of its body
+			uint32_t start = offset;
+			if (sop && offset + 6 <= data.size() && JpegAccess::VerifyReadUint16(data.data(), offset, J2KMarkers::SOP))
+			{
+				offset += 6;
+				start = packed ? offset : start;
+			}
+			uint32_t headerLength;
+			uint32_t bodyLength;
+			ErrorCode result = packed
+				? readPacketHeader(precinct, packet.layer, &packedHeaders[headerOffset], headerEnd - headerOffset, eph, headerLength, bodyLength)
+				: readPacketHeader(precinct, packet.layer, &data[offset], data.size() - offset, eph, headerLength, bodyLength);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+			if (packed)
+			{
+				packet.headerOffset = headerOffset;
+				packet.headerLength = headerLength;
+				headerOffset += headerLength;
+			}
+			else
+			{
+				offset += headerLength;
+			}
+			if (bodyLength > data.size() - offset)
+			{
+				return PACKET_INDEX_INVALID;
+			}
+			offset += bodyLength;
+			packet.tilePart = i;
+			packet.offset = start;
+			packet.length = offset - start;
+		}
+		if (offset != data.size() || (packed && headerOffset != headerEnd))
+		{
+			return PACKET_INDEX_INVALID;
+		}
+	}
+	return next == packets.size() ? SUCCESS : PACKET_INDEX_INVALID;
+}
+
+uint32_t PacketIndex::tileCount(const Header& header)
+{
+	return ceilDiv(header.Xsiz - header.XTOsiz, header.XTsiz) * ceilDiv(header.Ysiz - header.YTOsiz, header.YTsiz);
+}
+
+ErrorCode PacketIndex::build(const J2KFile& file)
+{
+	BOOST_FOREACH(const J2KPartPtr& segment, file.segments)
+	{
+		if (changesPackets(segment->getMarker()))
+		{
+			return PACKET_INDEX_UNSUPPORTED;
+		}
+	}
+	tiles.assign(tileCount(file.header), vector<PacketEntry>());
+	headers.assign(tiles.size(), vector<uint8_t>());
+	vector<vector<uint32_t> > tileParts(tiles.size());
+	for (uint32_t i = 0; i < file.tiles.size(); i++)
+	{
+		if (file.tiles[i].Isot >= tiles.size())
+		{
+			return PACKET_INDEX_INVALID;
+		}
+		tileParts[file.tiles[i].Isot].push_back(i);
+	}
+	bool packed = file.hasPackedPacketHeaders();
+	vector<vector<uint8_t> > partHeaders(file.tiles.size());
+	if (packed)
+	{
+		ErrorCode result = file.packedPacketHeaders(partHeaders);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+		for (uint32_t i = 0; i < file.tiles.size(); i++)
+		{
+			vector<uint8_t>& tileHeaders = headers[file.tiles[i].Isot];
+			tileHeaders.insert(tileHeaders.end(), partHeaders[i].begin(), partHeaders[i].end());
+		}
+	}
+
+	for (uint16_t t = 0; t < tiles.size(); t++)
+	{
+		if (tileParts[t].empty())
+		{
+			continue;
+		}
+		vector<uint32_t> lengths;
+		BOOST_FOREACH(uint32_t i, tileParts[t])
+		{
+			BOOST_FOREACH(const J2KPartPtr& marker, file.tiles[i].markers)
+			{
+				if (changesPackets(marker->getMarker()))
+				{
+					return PACKET_INDEX_UNSUPPORTED;
+				}
+				if (marker->getMarker() == PacketLengthTilePartHeader::MARKER_ID)
+				{
+					BOOST_FOREACH(const PacketLength& length, ((const PacketLengthTilePartHeader&)*marker).packetLengths)
+					{
+						lengths.push_back(length.value);
+					}
+				}
+			}
+		}
+
+		TileGeometry geometry;
+		geometry.build(file, t);
+		vector<PacketEntry> packets = geometry.packetOrder(file, t);
+		// PLT lengths leave out packed headers, which have to be decoded anyway
+		if (packed || lengths.empty())
+		{
+			ErrorCode result = readPacketHeaders(file, geometry, tileParts[t], partHeaders, headers[t], packets);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+			tiles[t] = packets;
+			continue;
+		}
+		if (packets.size() != lengths.size())
+		{
+			return PACKET_INDEX_INVALID;
+		}
+		// packets never straddle tile parts; the data of each starts after SOD
+		size_t next = 0;
+		BOOST_FOREACH(uint32_t i, tileParts[t])
+		{
+			const vector<uint8_t>& data = file.tiles[i].Raw;
+			uint32_t offset = 2;
+			while (next < packets.size() && offset + lengths[next] <= data.size() && offset < data.size())
+			{
+				packets[next].tilePart = i;
+				packets[next].offset = offset;
+				packets[next].length = lengths[next];
+				offset += lengths[next];
+				next++;
+			}
+			if (offset != data.size())
+			{
+				return PACKET_INDEX_INVALID;
+			}
+		}
+		if (next != packets.size())
+		{
+			return PACKET_INDEX_INVALID;
+		}
+		tiles[t] = packets;
+	}
+	return SUCCESS;
+}
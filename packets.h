@@ -0,0 +1,150 @@
+#ifndef _PACKETS_H_
+#define _PACKETS_H_
+
+#include <boost\cstdint.hpp>
+#include <vector>
+#include "common.h"
+#include "j2k.h"
+
+namespace BJPEG
+{
+
+// Precinct of a tile: the unit a packet carries one layer of
+class PrecinctKey
+{
+public:
+	uint16_t tile;
+	uint16_t component;
+	uint8_t resolution;
+	// row by row within the resolution of the tile-component
+	uint32_t precinct;
+
+	bool operator<(const PrecinctKey& other) const
+	{
+		if (tile != other.tile)
+		{
+			return tile < other.tile;
+		}
+		if (component != other.component)
+		{
+			return component < other.component;
+		}
+		if (resolution != other.resolution)
+		{
+			return resolution < other.resolution;
+		}
+		return precinct < other.precinct;
+	}
+};
+
+class PacketEntry
+{
+public:
+	PrecinctKey key;
+	uint16_t layer;
+	// where the packet is: file.tiles[tilePart].Raw, from offset
+	uint32_t tilePart;
+	uint32_t offset;
+	uint32_t length;
+	// a packed header (PPM/PPT) sits in PacketIndex::headers of the tile instead
+	uint32_t headerOffset;
+	uint32_t headerLength;
+};
+
+// Rectangle on the reference grid, [x0, x1) x [y0, y1)
+class GridRect
+{
+public:
+	uint32_t x0;
+	uint32_t y0;
+	uint32_t x1;
+	uint32_t y1;
+
+	bool intersects(const GridRect& other) const
+	{
+		return x0 < other.x1 && other.x0 < x1 && y0 < other.y1 && other.y0 < y1;
+	}
+};
+
+// Precinct partition of a resolution of a tile-component (B.6)
+class ResolutionGeometry
+{
+public:
+	// in resolution coordinates
+	uint32_t x0;
+	uint32_t y0;
+	uint32_t x1;
+	uint32_t y1;
+	uint8_t ppx;
+	uint8_t ppy;
+	uint32_t precinctsWide;
+	uint32_t precinctsHigh;
+	// resolution to reference grid: XRsiz (YRsiz) * 2^(NL - r)
+	uint32_t scaleX;
+	uint32_t scaleY;
+	// sub-bands (LL, or HL, LH and HH) in band coordinates (B-15)
+	std::vector<GridRect> bands;
+	// code-block size exponents within the precincts of the resolution (B.7)
+	uint8_t xcb;
+	uint8_t ycb;
+
+	uint32_t precinctCount() const
+	{
+		return precinctsWide * precinctsHigh;
+	}
+
+	// clipped to the resolution, on the reference grid
+	GridRect precinctRect(uint32_t precinct) const;
+
+	// code-blocks of precinct in sub-band band, 0 x 0 where they do not meet
+	void codeBlockGrid(uint32_t precinct, size_t band, uint32_t& width, uint32_t& height) const;
+};
+
+// Geometry of a tile under the coding style of the main header.
+class TileGeometry
+{
+public:
+	GridRect rect;
+	// [component][resolution]
+	std::vector<std::vector<ResolutionGeometry> > resolutions;
+
+	void build(const J2KFile& file, uint16_t tile);
+
+	// Packets in the order of the progression (B.12) with the number of layers of COD
+	std::vector<PacketEntry> packetOrder(const J2KFile& file, uint16_t tile) const;
+};
+
+// Where every packet of a codestream is, from the PLT segments of its tile parts
+// and the progression order. Without PLT the packet headers are decoded, which only
+// reads the PPM/PPT segments when the headers are packed there.
+// build() returns PACKET_INDEX_UNSUPPORTED, rather than a wrong index, for
+// - COC or POC segments in the main header, the packet order and the precincts
+//   are taken from COD alone;
+// - COD, COC or POC segments in a tile-part header, for the same reason;
+// - the selective arithmetic coding bypass or termination on each coding pass
+//   (code-block style 0x01 or 0x04) when the packet headers have to be decoded,
+//   i.e. without PLT or with PPM/PPT: the decoder does not track the several
+//   codeword segment lengths of these styles.
+class PacketIndex
+{
+public:
+	// [tile] packets in codestream order
+	std::vector<std::vector<PacketEntry> > tiles;
+	// [tile] packed packet headers, empty when they are in the packets
+	std::vector<std::vector<uint8_t> > headers;
+
+	static uint32_t tileCount(const Header& header);
+
+private:
+	static ErrorCode readPacketHeaders(const J2KFile& file, const TileGeometry& geometry, const std::vector<uint32_t>& tileParts,
+		const std::vector<std::vector<uint8_t> >& partHeaders, const std::vector<uint8_t>& packedHeaders,
+		std::vector<PacketEntry>& packets);
+
+public:
+
+	ErrorCode build(const J2KFile& file);
+};
+
+}
+
+#endif /*_PACKETS_H_*/
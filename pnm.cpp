@@ -0,0 +1,119 @@
+#include "pnm.h"
+#include <sstream>
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	inline bool isWhitespace(uint8_t c)
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+	}
+
+	// reads one ASCII header value, skipping whitespace and # comments; 0 when it
+	// runs into end or is too large
+	uint32_t readHeaderValue(const uint8_t* buffer, uint64_t& offset, uint64_t end)
+	{
+		while (offset < end && (isWhitespace(buffer[offset]) || buffer[offset] == '#'))
+		{
+			if (buffer[offset] == '#')
+			{
+				while (offset < end && buffer[offset] != '\n' && buffer[offset] != '\r')
+				{
+					offset++;
+				}
+			}
+			offset++;
+		}
+		uint64_t value = 0;
+		while (offset < end && buffer[offset] >= '0' && buffer[offset] <= '9')
+		{
+			value = value * 10 + (buffer[offset] - '0');
+			if (value > 0xFFFFFFFF)
+			{
+				return 0;
+			}
+			offset++;
+		}
+		return (uint32_t)value;
+	}
+}
+
+ErrorCode PNMFile::load(const uint8_t* buffer, int offset)
+{
+	return load(buffer, offset, ByteCursor::UNKNOWN_END);
+}
+
+ErrorCode PNMFile::loadBuffer(const uint8_t* buffer, uint64_t length)
+{
+	return load(buffer, 0, length);
+}
+
+ErrorCode PNMFile::load(const uint8_t* buffer, uint64_t offset, uint64_t end)
+{
+	if (end - offset < 2 || buffer[offset] != 'P' || (buffer[offset + 1] != '5' && buffer[offset + 1] != '6'))
+	{
+		return PNM_MAGIC_DOESNT_MATCH;
+	}
+	components = buffer[offset + 1] == '5' ? 1 : 3;
+	offset += 2;
+
+	width = readHeaderValue(buffer, offset, end);
+	height = readHeaderValue(buffer, offset, end);
+	uint32_t maximum = readHeaderValue(buffer, offset, end);
+	if (width == 0 || height == 0 || maximum == 0 || maximum > 65535 || offset >= end || !isWhitespace(buffer[offset]))
+	{
+		return PNM_INVALID_HEADER;
+	}
+	maxValue = (uint16_t)maximum;
+	offset++;
+
+	uint64_t count = (uint64_t)width * height * components;
+	uint64_t bytesPerSample = maxValue < 256 ? 1 : 2;
+	if (count > (size_t)-1)
+	{
+		return PNM_INVALID_HEADER;
+	}
+	if (count > (end - offset) / bytesPerSample)
+	{
+		return PNM_DATA_TRUNCATED;
+	}
+	samples.resize((size_t)count);
+	const uint8_t* data = buffer + offset;
+	if (bytesPerSample == 1)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			samples[i] = data[i];
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			samples[i] = (uint16_t)((data[2 * i] << 8) | data[2 * i + 1]);
+		}
+	}
+	return SUCCESS;
+}
+
+void PNMFile::save(std::ostream& stream) const
+{
+	ostringstream header;
+	header << (components == 1 ? "P5" : "P6") << "\n" << width << " " << height << "\n" << maxValue << "\n";
+	string text = header.str();
+	stream.write(text.data(), text.size());
+
+	for (vector<uint16_t>::const_iterator it = samples.begin(); it != samples.end(); ++it)
+	{
+		if (maxValue < 256)
+		{
+			JpegAccess::WriteUint8(stream, (uint8_t)*it);
+		}
+		else
+		{
+			JpegAccess::WriteUint16(stream, *it);
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef _PNM_H_
+#define _PNM_H_
+
+#include <boost\cstdint.hpp>
+#include <vector>
+#include "common.h"
+
+namespace BJPEG
+{
+
+// Binary greymap (P5) / pixmap (P6), the raw input of the encoder.
+// Callers holding pixels in memory fill the fields directly instead of loading.
+class PNMFile : public ImageFile
+{
+public:
+	uint32_t width;
+	uint32_t height;
+	uint16_t components;
+	uint16_t maxValue;
+	// interleaved samples, row by row
+	std::vector<uint16_t> samples;
+
+	PNMFile() : width(0), height(0), components(0), maxValue(0) {}
+
+	using ImageFile::load;
+
+	uint8_t bitDepth() const
+	{
+		uint8_t result = 1;
+		while ((maxValue >> result) != 0)
+		{
+			result++;
+		}
+		return result;
+	}
+
+	inline uint16_t sample(uint32_t x, uint32_t y, uint16_t component) const
+	{
+		return samples[((size_t)y * width + x) * components + component];
+	}
+
+	// unbounded: only for buffers known to hold the whole file
+	ErrorCode load(const uint8_t* buffer, int offset);
+	ErrorCode loadBuffer(const uint8_t* buffer, uint64_t length);
+	void save(std::ostream& stream) const;
+
+private:
+	ErrorCode load(const uint8_t* buffer, uint64_t offset, uint64_t end);
+};
+
+}
+
+#endif /*_PNM_H_*/
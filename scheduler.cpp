@@ -0,0 +1,248 @@
+#include "scheduler.h"
+#include <boost\assert.hpp>
+#include <algorithm>
+
+using namespace std;
+using namespace BJPEG;
+
+TaskScheduler::TaskScheduler(unsigned threadCount) : queued(0), waiting(0), stopping(false)
+{
+	if (threadCount == 0)
+	{
+		threadCount = max(1u, boost::thread::hardware_concurrency());
+	}
+	// the last queue belongs to threads outside the pool (submit / wait callers)
+	for (unsigned i = 0; i <= threadCount; i++)
+	{
+		queues.push_back(shared_ptr<WorkerQueue>(new WorkerQueue()));
+	}
+	for (unsigned i = 0; i < threadCount; i++)
+	{
+		size_t index = i;
+		workers.create_thread([this, index]() { workerLoop(index); });
+	}
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	{
+		boost::mutex::scoped_lock guard(idleLock);
+		stopping = true;
+		workAvailable.notify_all();
+	}
+	workers.join_all();
+}
+
+TaskPtr TaskScheduler::createTask(const function<void()>& work)
+{
+	return TaskPtr(new Task(work));
+}
+
+void TaskScheduler::addDependency(const TaskPtr& task, const TaskPtr& prerequisite)
+{
+	boost::mutex::scoped_lock guard(prerequisite->lock);
+	if (!prerequisite->finished)
+	{
+		task->pending++;
+		prerequisite->successors.push_back(task);
+	}
+	else if (prerequisite->failed)
+	{
+		task->cancelled = true;
+	}
+}
+
+void TaskScheduler::submit(const TaskPtr& task, TaskGroup& group)
+{
+	task->group = &group;
+	group.outstanding++;
+	if (--task->pending == 0)
+	{
+		size_t* current = currentQueue.get();
+		enqueue(task, current != NULL ? *current : queues.size() - 1);
+	}
+}
+
+void TaskScheduler::enqueue(const TaskPtr& task, size_t queueIndex)
+{
+	{
+		WorkerQueue& queue = *queues[queueIndex];
+		boost::mutex::scoped_lock guard(queue.lock);
+		queue.tasks.push_back(task);
+	}
+	queued++;
+	boost::mutex::scoped_lock guard(idleLock);
+	workAvailable.notify_one();
+	if (waiting > 0)
+	{
+		allDone.notify_all();
+	}
+}
+
+TaskPtr TaskScheduler::take(size_t queueIndex)
+{
+	{
+		// own work: newest first
+		WorkerQueue& queue = *queues[queueIndex];
+		boost::mutex::scoped_lock guard(queue.lock);
+		if (!queue.tasks.empty())
+		{
+			TaskPtr task = queue.tasks.back();
+			queue.tasks.pop_back();
+			queued--;
+			return task;
+		}
+	}
+	// steal: oldest first, which is usually the biggest remaining piece of work
+	for (size_t i = 1; i < queues.size(); i++)
+	{
+		WorkerQueue& victim = *queues[(queueIndex + i) % queues.size()];
+		boost::mutex::scoped_lock guard(victim.lock);
+		if (!victim.tasks.empty())
+		{
+			TaskPtr task = victim.tasks.front();
+			victim.tasks.pop_front();
+			queued--;
+			return task;
+		}
+	}
+	return TaskPtr();
+}
+
+void TaskScheduler::run(const TaskPtr& task, size_t queueIndex)
+{
+	// a cancelled task only passes the failure on
+	bool failed = task->cancelled;
+	if (!failed)
+	{
+		try
+		{
+			task->work();
+		}
+		catch (...)
+		{
+			failed = true;
+			boost::mutex::scoped_lock guard(idleLock);
+			if (!task->group->failure)
+			{
+				task->group->failure = current_exception();
+			}
+		}
+	}
+	task->work = function<void()>();
+	release(task, queueIndex, failed);
+}
+
+void TaskScheduler::release(const TaskPtr& task, size_t queueIndex, bool failed)
+{
+	vector<TaskPtr> successors;
+	{
+		boost::mutex::scoped_lock guard(task->lock);
+		task->finished = true;
+		task->failed = failed;
+		successors.swap(task->successors);
+	}
+	for (vector<TaskPtr>::const_iterator it = successors.begin(); it != successors.end(); ++it)
+	{
+		if (failed)
+		{
+			(*it)->cancelled = true;
+		}
+		if (--(*it)->pending == 0)
+		{
+			enqueue(*it, queueIndex);
+		}
+	}
+	// the group may be gone as soon as its count is 0
+	if (--task->group->outstanding == 0)
+	{
+		boost::mutex::scoped_lock guard(idleLock);
+		allDone.notify_all();
+	}
+}
+
+void TaskScheduler::workerLoop(size_t index)
+{
+	currentQueue.reset(new size_t(index));
+	while (true)
+	{
+		TaskPtr task = take(index);
+		if (task)
+		{
+			run(task, index);
+			continue;
+		}
+
+		boost::mutex::scoped_lock guard(idleLock);
+		while (queued == 0 && !stopping)
+		{
+			workAvailable.wait(guard);
+		}
+		if (stopping)
+		{
+			return;
+		}
+	}
+}
+
+void TaskScheduler::wait(TaskGroup& group)
+{
+	BOOST_ASSERT(currentQueue.get() == NULL);
+	size_t index = queues.size() - 1;
+	// tasks run here see that they are inside a task
+	currentQueue.reset(new size_t(index));
+	waiting++;
+	while (group.outstanding > 0)
+	{
+		TaskPtr task = take(index);
+		if (task)
+		{
+			run(task, index);
+			continue;
+		}
+
+		boost::mutex::scoped_lock guard(idleLock);
+		while (group.outstanding > 0 && queued == 0)
+		{
+			allDone.wait(guard);
+		}
+	}
+	waiting--;
+	currentQueue.reset();
+
+	exception_ptr thrown;
+	{
+		boost::mutex::scoped_lock guard(idleLock);
+		swap(thrown, group.failure);
+	}
+	if (thrown)
+	{
+		rethrow_exception(thrown);
+	}
+}
+
+void TaskScheduler::parallelFor(size_t begin, size_t end, size_t grain, const function<void(size_t)>& body)
+{
+	if (currentQueue.get() != NULL)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			body(i);
+		}
+		return;
+	}
+	TaskGroup group;
+	grain = max((size_t)1, grain);
+	for (size_t chunk = begin; chunk < end; chunk += grain)
+	{
+		size_t chunkEnd = min(end, chunk + grain);
+		submit(createTask([chunk, chunkEnd, &body]()
+		{
+			for (size_t i = chunk; i < chunkEnd; i++)
+			{
+				body(i);
+			}
+		}), group);
+	}
+	wait(group);
+}
@@ -0,0 +1,119 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <boost\cstdint.hpp>
+#include <boost\thread.hpp>
+#include <boost\atomic.hpp>
+#include <exception>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+
+namespace BJPEG
+{
+
+class TaskScheduler;
+
+// The tasks one wait() is for, and the first exception one of them threw
+class TaskGroup
+{
+	friend class TaskScheduler;
+
+	boost::atomic<int> outstanding;
+	std::exception_ptr failure;
+
+	TaskGroup(const TaskGroup&);
+	TaskGroup& operator=(const TaskGroup&);
+
+public:
+	TaskGroup() : outstanding(0) {}
+};
+
+class Task
+{
+	friend class TaskScheduler;
+
+	std::function<void()> work;
+	boost::mutex lock;
+	boost::atomic<int> pending;
+	bool finished;
+	// threw, or was skipped because a prerequisite failed
+	bool failed;
+	boost::atomic<bool> cancelled;
+	TaskGroup* group;
+	std::vector<std::shared_ptr<Task> > successors;
+
+public:
+	Task(const std::function<void()>& work) : work(work), pending(1), finished(false), failed(false), cancelled(false), group(NULL) {}
+};
+
+typedef std::shared_ptr<Task> TaskPtr;
+
+// Work-stealing pool for fine-grained tasks (code-blocks, transform strips, ...).
+// Every worker owns a deque: it pushes and pops work at the back and idle workers
+// steal from the front of the others. A task becomes runnable once it has been
+// submitted and all of its prerequisites finished; tasks released by a finishing
+// task go to the deque of the worker that ran it, so dependent stages stay hot in cache.
+// A task that throws fails its group: its successors are released without running,
+// and the first exception is rethrown by wait() of that group.
+class TaskScheduler
+{
+	struct WorkerQueue
+	{
+		boost::mutex lock;
+		std::deque<TaskPtr> tasks;
+	};
+
+	std::vector<std::shared_ptr<WorkerQueue> > queues;
+	boost::thread_group workers;
+	boost::mutex idleLock;
+	boost::condition_variable workAvailable;
+	boost::condition_variable allDone;
+	boost::atomic<int> queued;
+	// threads inside wait(), which enqueue() wakes as well
+	boost::atomic<int> waiting;
+	boost::atomic<bool> stopping;
+	// set on workers and on a thread inside wait(), i.e. while it may run tasks
+	boost::thread_specific_ptr<size_t> currentQueue;
+
+	TaskScheduler(const TaskScheduler&);
+	TaskScheduler& operator=(const TaskScheduler&);
+
+	void workerLoop(size_t index);
+	void enqueue(const TaskPtr& task, size_t queueIndex);
+	TaskPtr take(size_t queueIndex);
+	void run(const TaskPtr& task, size_t queueIndex);
+	void release(const TaskPtr& task, size_t queueIndex, bool failed);
+
+public:
+	// threadCount == 0 uses one worker per hardware thread
+	explicit TaskScheduler(unsigned threadCount = 0);
+	~TaskScheduler();
+
+	unsigned threadCount() const
+	{
+		return (unsigned)queues.size() - 1;
+	}
+
+	TaskPtr createTask(const std::function<void()>& work);
+
+	// task will not start before prerequisite has finished, and is skipped when it
+	// failed; call before submitting task
+	void addDependency(const TaskPtr& task, const TaskPtr& prerequisite);
+
+	// group has to stay until wait(group) returns
+	void submit(const TaskPtr& task, TaskGroup& group);
+
+	// Blocks until every task submitted to group has finished; the calling thread runs
+	// tasks meanwhile. Not from inside a task, which could be waiting for itself.
+	void wait(TaskGroup& group);
+
+	// Runs body(i) for i in [begin, end) split into chunks of grain iterations and waits.
+	// Inside a task the loop runs inline on the calling thread.
+	void parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t)>& body);
+};
+
+}
+
+#endif /*_SCHEDULER_H_*/
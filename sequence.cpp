@@ -0,0 +1,306 @@
+#include "sequence.h"
+#include <boost\iostreams\device\mapped_file.hpp>
+#include <algorithm>
+#include <exception>
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	// ISO/IEC 14496-12 boxes on the way to the sample tables
+	const uint32_t MOVIE = 0x6D6F6F76;
+	const uint32_t TRACK = 0x7472616B;
+	const uint32_t MEDIA = 0x6D646961;
+	const uint32_t HANDLER = 0x68646C72;
+	const uint32_t MEDIA_INFORMATION = 0x6D696E66;
+	const uint32_t SAMPLE_TABLE = 0x7374626C;
+	const uint32_t SAMPLE_SIZE = 0x7374737A;
+	const uint32_t SAMPLE_TO_CHUNK = 0x73747363;
+	const uint32_t CHUNK_OFFSET = 0x7374636F;
+	const uint32_t CHUNK_OFFSET64 = 0x636F3634;
+	const uint32_t VIDEO = 0x76696465;
+	// ISO/IEC 15444-2 fragment table and list
+	const uint32_t FRAGMENT_TABLE = 0x6674626C;
+	const uint32_t FRAGMENT_LIST = 0x666C7374;
+
+	bool findChild(const uint8_t* buffer, const J2PBox& parent, uint32_t type, J2PBox& child)
+	{
+		J2PBoxIndex index;
+		if (index.build(buffer, parent.bodyOffset(), parent.offset + parent.length) != SUCCESS)
+		{
+			return false;
+		}
+		const J2PBox* box = index.find(type);
+		if (box == NULL)
+		{
+			return false;
+		}
+		child = *box;
+		return true;
+	}
+
+	bool readAt(ifstream& file, uint64_t offset, uint8_t* buffer, uint64_t length)
+	{
+		file.clear();
+		file.seekg((streamoff)offset);
+		file.read((char*)buffer, (streamsize)length);
+		return (uint64_t)file.gcount() == length;
+	}
+}
+
+ErrorCode J2PSequence::open(const string& fileName)
+{
+	ifstream file(fileName, ios::binary);
+	if (!file)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	file.seekg(0, ios::end);
+	streamoff size = file.tellg();
+	if (size < 0)
+	{
+		return FILE_CANNOT_SEEK;
+	}
+	this->fileName = fileName;
+	fileLength = (uint64_t)size;
+	frames.clear();
+
+	// top level boxes, only their headers are read
+	vector<J2PBox> boxes;
+	for (uint64_t offset = 0; offset < fileLength;)
+	{
+		uint8_t header[16] = { 0 };
+		uint64_t available = fileLength - offset;
+		readAt(file, offset, header, min<uint64_t>(16, available));
+		J2PBox box;
+		ErrorCode result = J2PBoxIndex::readBox(header, offset, available, box);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+		boxes.push_back(box);
+		offset += box.length;
+	}
+
+	for (vector<J2PBox>::const_iterator it = boxes.begin(); it != boxes.end(); ++it)
+	{
+		if (it->type == MOVIE)
+		{
+			vector<uint8_t> movie((size_t)(it->length - it->headerLength));
+			if (!readAt(file, it->bodyOffset(), movie.data(), movie.size()))
+			{
+				return J2P_SEQUENCE_INVALID_TABLE;
+			}
+			return indexTrack(movie);
+		}
+	}
+
+	for (vector<J2PBox>::const_iterator it = boxes.begin(); it != boxes.end(); ++it)
+	{
+		if (it->type == J2PContiguousCodestream::MARKER_ID)
+		{
+			FrameFragment fragment = { it->bodyOffset(), it->length - it->headerLength };
+			Frame frame;
+			frame.fragments.push_back(fragment);
+			frames.push_back(frame);
+		}
+		else if (it->type == FRAGMENT_TABLE)
+		{
+			ErrorCode result = indexFragments(file, *it);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+		}
+	}
+	return SUCCESS;
+}
+
+// samples of the first video track in the body of moov, from stsz, stsc and stco or co64
+ErrorCode J2PSequence::indexTrack(const vector<uint8_t>& movie)
+{
+	const uint8_t* buffer = movie.data();
+	J2PBoxIndex movieBoxes;
+	ErrorCode result = movieBoxes.build(buffer, 0, movie.size());
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+
+	BOOST_FOREACH(const J2PBox& track, movieBoxes.boxes)
+	{
+		J2PBox media, handler, information, table, sizes, chunks, offsets;
+		if (track.type != TRACK ||
+			!findChild(buffer, track, MEDIA, media) ||
+			!findChild(buffer, media, HANDLER, handler) ||
+			handler.length < (uint64_t)handler.headerLength + 12 ||
+			JpegAccess::ReadUint32(buffer + handler.bodyOffset(), 8) != VIDEO)
+		{
+			continue;
+		}
+		if (!findChild(buffer, media, MEDIA_INFORMATION, information) ||
+			!findChild(buffer, information, SAMPLE_TABLE, table) ||
+			!findChild(buffer, table, SAMPLE_SIZE, sizes) ||
+			!findChild(buffer, table, SAMPLE_TO_CHUNK, chunks) ||
+			!(findChild(buffer, table, CHUNK_OFFSET, offsets) || findChild(buffer, table, CHUNK_OFFSET64, offsets)))
+		{
+			return J2P_SEQUENCE_INVALID_TABLE;
+		}
+
+		// full boxes: version and flags come first, then the counts
+		if (sizes.length < (uint64_t)sizes.headerLength + 12 ||
+			chunks.length < (uint64_t)chunks.headerLength + 8 ||
+			offsets.length < (uint64_t)offsets.headerLength + 8)
+		{
+			return J2P_SEQUENCE_INVALID_TABLE;
+		}
+		const uint8_t* sizeTable = buffer + sizes.bodyOffset();
+		const uint8_t* chunkTable = buffer + chunks.bodyOffset();
+		const uint8_t* offsetTable = buffer + offsets.bodyOffset();
+		uint32_t sampleSize = JpegAccess::ReadUint32(sizeTable, 4);
+		uint32_t sampleCount = JpegAccess::ReadUint32(sizeTable, 8);
+		uint32_t runCount = JpegAccess::ReadUint32(chunkTable, 4);
+		uint32_t chunkCount = JpegAccess::ReadUint32(offsetTable, 4);
+		uint32_t offsetSize = offsets.type == CHUNK_OFFSET64 ? 8 : 4;
+		if (sizes.length - sizes.headerLength < 12 + (sampleSize == 0 ? 4 * (uint64_t)sampleCount : 0) ||
+			chunks.length - chunks.headerLength < 8 + 12 * (uint64_t)runCount ||
+			offsets.length - offsets.headerLength < 8 + offsetSize * (uint64_t)chunkCount ||
+			(sampleCount > 0 && (runCount == 0 || JpegAccess::ReadUint32(chunkTable, 8) != 1)))
+		{
+			return J2P_SEQUENCE_INVALID_TABLE;
+		}
+
+		frames.reserve(sampleCount);
+		uint32_t sample = 0;
+		uint32_t run = 0;
+		for (uint32_t chunk = 1; chunk <= chunkCount && sample < sampleCount; chunk++)
+		{
+			while (run + 1 < runCount && JpegAccess::ReadUint32(chunkTable, 8 + 12 * (run + 1)) <= chunk)
+			{
+				run++;
+			}
+			uint32_t samplesPerChunk = JpegAccess::ReadUint32(chunkTable, 12 + 12 * run);
+			uint64_t offset = offsetSize == 8 ? JpegAccess::ReadUint64(offsetTable, 8 + 8 * (chunk - 1)) :
+				JpegAccess::ReadUint32(offsetTable, 8 + 4 * (chunk - 1));
+			for (uint32_t k = 0; k < samplesPerChunk && sample < sampleCount; k++, sample++)
+			{
+				FrameFragment fragment = { offset, sampleSize != 0 ? sampleSize : JpegAccess::ReadUint32(sizeTable, 12 + 4 * sample) };
+				if (fragment.offset > fileLength || fragment.length > fileLength - fragment.offset)
+				{
+					return J2P_SEQUENCE_INVALID_TABLE;
+				}
+				Frame frame;
+				frame.fragments.push_back(fragment);
+				frame.boxed = true;
+				frames.push_back(frame);
+				offset += fragment.length;
+			}
+		}
+		return sample == sampleCount ? SUCCESS : J2P_SEQUENCE_INVALID_TABLE;
+	}
+	return SUCCESS;
+}
+
+// one codestream put together from the fragments of a flst
+ErrorCode J2PSequence::indexFragments(ifstream& file, const J2PBox& table)
+{
+	vector<uint8_t> body((size_t)table.length);
+	J2PBox list;
+	if (!readAt(file, table.offset, body.data(), body.size()))
+	{
+		return J2P_SEQUENCE_INVALID_TABLE;
+	}
+	J2PBox local = table;
+	local.offset = 0;
+	if (!findChild(body.data(), local, FRAGMENT_LIST, list) || list.length < (uint64_t)list.headerLength + 2)
+	{
+		return J2P_SEQUENCE_INVALID_TABLE;
+	}
+
+	const uint8_t* entries = body.data() + list.bodyOffset();
+	uint16_t count = JpegAccess::ReadUint16(entries, 0);
+	if (list.length < (uint64_t)list.headerLength + 2 + 14 * (uint64_t)count)
+	{
+		return J2P_SEQUENCE_INVALID_TABLE;
+	}
+	Frame frame;
+	for (uint16_t i = 0; i < count; i++)
+	{
+		// OFF, LEN, DR; a data reference other than 0 points into another file
+		const uint8_t* entry = entries + 2 + 14 * i;
+		if (JpegAccess::ReadUint16(entry, 12) != 0)
+		{
+			return J2P_FRAME_EXTERNAL_REFERENCE;
+		}
+		FrameFragment fragment = { JpegAccess::ReadUint64(entry, 0), JpegAccess::ReadUint32(entry, 8) };
+		if (fragment.offset > fileLength || fragment.length > fileLength - fragment.offset)
+		{
+			return J2P_SEQUENCE_INVALID_TABLE;
+		}
+		frame.fragments.push_back(fragment);
+	}
+	frames.push_back(frame);
+	return SUCCESS;
+}
+
+ErrorCode J2PSequence::openFrame(size_t n, J2KFile& file) const
+{
+	if (n >= frames.size())
+	{
+		return J2P_FRAME_OUT_OF_RANGE;
+	}
+	const Frame& frame = frames[n];
+	if (frame.fragments.size() != 1)
+	{
+		// fragments have to be put together
+		vector<uint8_t> buffer;
+		ifstream input(fileName, ios::binary);
+		BOOST_FOREACH(const FrameFragment& fragment, frame.fragments)
+		{
+			size_t position = buffer.size();
+			buffer.resize(position + (size_t)fragment.length);
+			if (fragment.length > 0 && !readAt(input, fragment.offset, &buffer[position], fragment.length))
+			{
+				return FILE_CANNOT_OPEN;
+			}
+		}
+		if (buffer.empty())
+		{
+			return J2P_CONTIGUOUS_CODESTREAM_DOESNT_MATCH;
+		}
+		return file.loadBuffer(buffer.data(), buffer.size());
+	}
+
+	// map just the frame, from the allocation granularity boundary below it
+	const FrameFragment& fragment = frame.fragments[0];
+	uint64_t start = fragment.offset - fragment.offset % boost::iostreams::mapped_file_source::alignment();
+	boost::iostreams::mapped_file_source mapping;
+	try
+	{
+		mapping.open(fileName, (size_t)(fragment.offset + fragment.length - start), (boost::intmax_t)start);
+	}
+	catch (const exception&)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	const uint8_t* data = (const uint8_t*)mapping.data() + (fragment.offset - start);
+	uint64_t length = fragment.length;
+	if (frame.boxed)
+	{
+		J2PBox box;
+		ErrorCode result = J2PBoxIndex::readBox(data, 0, fragment.length, box);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+		if (box.type != J2PContiguousCodestream::MARKER_ID)
+		{
+			return J2P_CONTIGUOUS_CODESTREAM_DOESNT_MATCH;
+		}
+		data += box.headerLength;
+		length -= box.headerLength;
+	}
+	// the parsed file keeps copies of what it needs
+	return file.loadBuffer(data, length);
+}
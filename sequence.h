@@ -0,0 +1,65 @@
+#ifndef _SEQUENCE_H_
+#define _SEQUENCE_H_
+
+#include <boost\cstdint.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "j2k.h"
+#include "j2p.h"
+
+namespace BJPEG
+{
+
+// Piece of a codestream somewhere in the file
+class FrameFragment
+{
+public:
+	uint64_t offset;
+	uint64_t length;
+};
+
+class Frame
+{
+public:
+	// concatenated in order they form the codestream
+	std::vector<FrameFragment> fragments;
+	// MJ2 samples start with a jp2c box header which is skipped on open
+	bool boxed;
+
+	Frame() : boxed(false) {}
+};
+
+// Frame offset index of a file holding many codestreams: the samples of the
+// first video track of a Motion JPEG 2000 file (ISO/IEC 15444-3), or the jp2c
+// and ftbl boxes of a JPX file in order of appearance (a JP2 holds one).
+// Building the index reads box headers and the sample tables only; a frame is
+// read when it is opened.
+class J2PSequence
+{
+	std::string fileName;
+	uint64_t fileLength;
+
+	ErrorCode indexTrack(const std::vector<uint8_t>& movie);
+	ErrorCode indexFragments(std::ifstream& file, const J2PBox& table);
+
+public:
+	std::vector<Frame> frames;
+
+	J2PSequence() : fileLength(0) {}
+
+	ErrorCode open(const std::string& fileName);
+
+	size_t frameCount() const
+	{
+		return frames.size();
+	}
+
+	// Maps the codestream of frame n alone and parses it into file.
+	ErrorCode openFrame(size_t n, J2KFile& file) const;
+};
+
+}
+
+#endif /*_SEQUENCE_H_*/
@@ -0,0 +1,455 @@
+#include "server.h"
+#include <boost\asio.hpp>
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+using namespace BJPEG;
+using boost::asio::ip::tcp;
+
+namespace
+{
+	// lowest layers first, then the coarsest resolutions
+	bool morePressing(const PacketEntry* a, const PacketEntry* b)
+	{
+		if (a->layer != b->layer)
+		{
+			return a->layer < b->layer;
+		}
+		if (a->key.resolution != b->key.resolution)
+		{
+			return a->key.resolution < b->key.resolution;
+		}
+		if (a->key.component != b->key.component)
+		{
+			return a->key.component < b->key.component;
+		}
+		if (a->key.tile != b->key.tile)
+		{
+			return a->key.tile < b->key.tile;
+		}
+		return a->key.precinct < b->key.precinct;
+	}
+
+	// response length followed by the messages
+	string frame(const string& messages)
+	{
+		ostringstream stream;
+		JpegAccess::WriteUint32(stream, (uint32_t)messages.size());
+		stream.write(messages.data(), messages.size());
+		return stream.str();
+	}
+
+	class Session : public enable_shared_from_this<Session>
+	{
+		const PrecinctServer& server;
+		ClientModel model;
+		vector<uint8_t> request;
+		string response;
+
+	public:
+		tcp::socket socket;
+
+		Session(boost::asio::io_service& service, const PrecinctServer& server) : server(server), socket(service) {}
+
+		void read()
+		{
+			shared_ptr<Session> self = shared_from_this();
+			request.resize(WindowRequest::SIZE);
+			boost::asio::async_read(socket, boost::asio::buffer(request),
+				[self](const boost::system::error_code& error, size_t)
+				{
+					if (!error)
+					{
+						self->readComponents();
+					}
+				});
+		}
+
+		void readComponents()
+		{
+			uint32_t bytes = WindowRequest::componentBytes(request.data());
+			if (bytes == 0)
+			{
+				write();
+				return;
+			}
+			shared_ptr<Session> self = shared_from_this();
+			request.resize(WindowRequest::SIZE + bytes);
+			boost::asio::async_read(socket, boost::asio::buffer(&request[WindowRequest::SIZE], bytes),
+				[self](const boost::system::error_code& error, size_t)
+				{
+					if (!error)
+					{
+						self->write();
+					}
+				});
+		}
+
+		void write()
+		{
+			WindowRequest window;
+			window.load(request.data());
+			ostringstream messages;
+			server.respond(window, model, messages);
+			response = frame(messages.str());
+			shared_ptr<Session> self = shared_from_this();
+			boost::asio::async_write(socket, boost::asio::buffer(response),
+				[self](const boost::system::error_code& error, size_t)
+				{
+					if (!error)
+					{
+						self->read();
+					}
+				});
+		}
+	};
+}
+
+class PrecinctServer::Listener
+{
+public:
+	boost::asio::io_service service;
+	tcp::acceptor acceptor;
+
+	Listener() : acceptor(service) {}
+
+	void accept(const PrecinctServer& server)
+	{
+		shared_ptr<Session> session(new Session(service, server));
+		acceptor.async_accept(session->socket,
+			[this, session, &server](const boost::system::error_code& error)
+			{
+				if (!error)
+				{
+					session->read();
+				}
+				if (acceptor.is_open())
+				{
+					accept(server);
+				}
+			});
+	}
+};
+
+class PrecinctClient::Connection
+{
+public:
+	boost::asio::io_service service;
+	tcp::socket socket;
+
+	Connection() : socket(service) {}
+};
+
+void WindowRequest::load(const uint8_t* buffer)
+{
+	x = JpegAccess::ReadUint32(buffer, 0);
+	y = JpegAccess::ReadUint32(buffer, 4);
+	width = JpegAccess::ReadUint32(buffer, 8);
+	height = JpegAccess::ReadUint32(buffer, 12);
+	reduce = JpegAccess::ReadUint8(buffer, 16);
+	layers = JpegAccess::ReadUint16(buffer, 17);
+	components.assign(JpegAccess::ReadUint16(buffer, 19), false);
+	for (size_t c = 0; c < components.size(); c++)
+	{
+		components[c] = (buffer[SIZE + c / 8] & (0x80 >> (c % 8))) != 0;
+	}
+}
+
+void WindowRequest::save(ostream& stream) const
+{
+	JpegAccess::WriteUint32(stream, x);
+	JpegAccess::WriteUint32(stream, y);
+	JpegAccess::WriteUint32(stream, width);
+	JpegAccess::WriteUint32(stream, height);
+	JpegAccess::WriteUint8(stream, reduce);
+	JpegAccess::WriteUint16(stream, layers);
+	JpegAccess::WriteUint16(stream, (uint16_t)components.size());
+	vector<uint8_t> bits((components.size() + 7) / 8, 0);
+	for (size_t c = 0; c < components.size(); c++)
+	{
+		if (components[c])
+		{
+			bits[c / 8] |= 0x80 >> (c % 8);
+		}
+	}
+	stream.write((const char*)bits.data(), bits.size());
+}
+
+ErrorCode PrecinctServer::open(const string& fileName)
+{
+	ErrorCode result = file.loadFile(fileName);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	result = index.build(file);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	// packed headers go out in their packets, clients get a header without PPM
+	file.segments.erase(remove_if(file.segments.begin(), file.segments.end(), [](const J2KPartPtr& segment)
+	{
+		return segment->getMarker() == PackedPacketHeadersMain::MARKER_ID;
+	}), file.segments.end());
+	geometries.assign(index.tiles.size(), TileGeometry());
+	for (uint16_t t = 0; t < geometries.size(); t++)
+	{
+		geometries[t].build(file, t);
+	}
+	return SUCCESS;
+}
+
+void PrecinctServer::respond(const WindowRequest& request, ClientModel& model, ostream& stream) const
+{
+	if (!model.headerSent)
+	{
+		ostringstream header;
+		file.saveHeader(header);
+		JpegAccess::WriteUint8(stream, HEADER_MESSAGE);
+		JpegAccess::WriteUint32(stream, (uint32_t)header.str().size());
+		stream << header.str();
+		model.headerSent = true;
+	}
+
+	const CodingStyleDefault& cod = file.codingStyleDefault;
+	uint8_t resolutions = cod.NumberOfDecompositionLevels - min(request.reduce, cod.NumberOfDecompositionLevels);
+	uint16_t layers = request.layers == 0 ? cod.NumberOfLayers : min(request.layers, cod.NumberOfLayers);
+	GridRect window = request.rect();
+	// with the multiple component transformation any of components 0..2 needs all three
+	ComponentMask components = request.components.empty() ? ComponentMask(file.header.Csiz, true) :
+		file.requiredComponents(request.components);
+	vector<const PacketEntry*> selected;
+	for (uint16_t t = 0; t < geometries.size(); t++)
+	{
+		if (!geometries[t].rect.intersects(window))
+		{
+			continue;
+		}
+		BOOST_FOREACH(const PacketEntry& packet, index.tiles[t])
+		{
+			if (packet.key.resolution > resolutions || packet.layer >= layers || !components[packet.key.component])
+			{
+				continue;
+			}
+			map<PrecinctKey, uint16_t>::const_iterator sent = model.layers.find(packet.key);
+			if (sent != model.layers.end() && packet.layer < sent->second)
+			{
+				continue;
+			}
+			const ResolutionGeometry& resolution = geometries[t].resolutions[packet.key.component][packet.key.resolution];
+			if (resolution.precinctRect(packet.key.precinct).intersects(window))
+			{
+				selected.push_back(&packet);
+			}
+		}
+	}
+	sort(selected.begin(), selected.end(), morePressing);
+
+	BOOST_FOREACH(const PacketEntry* packet, selected)
+	{
+		JpegAccess::WriteUint8(stream, PACKET_MESSAGE);
+		JpegAccess::WriteUint16(stream, packet->key.tile);
+		JpegAccess::WriteUint16(stream, packet->key.component);
+		JpegAccess::WriteUint8(stream, packet->key.resolution);
+		JpegAccess::WriteUint32(stream, packet->key.precinct);
+		JpegAccess::WriteUint16(stream, packet->layer);
+		JpegAccess::WriteUint32(stream, packet->headerLength + packet->length);
+		if (packet->headerLength > 0)
+		{
+			stream.write((const char*)&index.headers[packet->key.tile][packet->headerOffset], packet->headerLength);
+		}
+		stream.write((const char*)&file.tiles[packet->tilePart].Raw[packet->offset], packet->length);
+		// layers of a precinct go out in order, so the count is all the model needs
+		uint16_t& sent = model.layers[packet->key];
+		sent = max<uint16_t>(sent, packet->layer + 1);
+	}
+}
+
+ErrorCode PrecinctServer::listen(uint16_t port)
+{
+	listener.reset(new Listener());
+	boost::system::error_code error;
+	tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), port);
+	listener->acceptor.open(endpoint.protocol(), error);
+	if (!error)
+	{
+		listener->acceptor.bind(endpoint, error);
+	}
+	if (!error)
+	{
+		listener->acceptor.listen(boost::asio::socket_base::max_connections, error);
+	}
+	if (error)
+	{
+		listener.reset();
+		return SERVER_CANNOT_LISTEN;
+	}
+	listener->accept(*this);
+	return SUCCESS;
+}
+
+uint16_t PrecinctServer::port() const
+{
+	boost::system::error_code error;
+	return listener ? listener->acceptor.local_endpoint(error).port() : 0;
+}
+
+void PrecinctServer::run()
+{
+	if (listener)
+	{
+		listener->service.run();
+	}
+}
+
+void PrecinctServer::stop()
+{
+	if (listener)
+	{
+		listener->service.stop();
+	}
+}
+
+ErrorCode PrecinctClient::connect(uint16_t port)
+{
+	connection.reset(new Connection());
+	boost::system::error_code error;
+	connection->socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port), error);
+	if (error)
+	{
+		connection.reset();
+		return SERVER_CONNECTION_FAILED;
+	}
+	return SUCCESS;
+}
+
+ErrorCode PrecinctClient::request(const WindowRequest& request, uint32_t& received)
+{
+	received = 0;
+	if (!connection)
+	{
+		return SERVER_CONNECTION_FAILED;
+	}
+	ostringstream stream;
+	request.save(stream);
+	string message = stream.str();
+	boost::system::error_code error;
+	boost::asio::write(connection->socket, boost::asio::buffer(message), error);
+	uint8_t length[4];
+	if (!error)
+	{
+		boost::asio::read(connection->socket, boost::asio::buffer(length, sizeof(length)), error);
+	}
+	vector<uint8_t> body;
+	if (!error)
+	{
+		body.resize(JpegAccess::ReadUint32(length, 0));
+		boost::asio::read(connection->socket, boost::asio::buffer(body), error);
+	}
+	if (error)
+	{
+		return SERVER_CONNECTION_FAILED;
+	}
+	received = sizeof(length) + body.size();
+	return receive(body.data(), (uint32_t)body.size());
+}
+
+ErrorCode PrecinctClient::receive(const uint8_t* buffer, uint32_t length)
+{
+	uint32_t offset = 0;
+	while (offset < length)
+	{
+		uint8_t type = JpegAccess::ReadUint8(buffer, offset);
+		if (type == PrecinctServer::HEADER_MESSAGE && offset + 5 <= length)
+		{
+			uint32_t size = JpegAccess::ReadUint32(buffer, offset + 1);
+			offset += 5;
+			if (size > length - offset)
+			{
+				return SERVER_INVALID_RESPONSE;
+			}
+			header.assign(buffer + offset, buffer + offset + size);
+			offset += size;
+		}
+		else if (type == PrecinctServer::PACKET_MESSAGE && offset + 16 <= length)
+		{
+			PrecinctKey key;
+			key.tile = JpegAccess::ReadUint16(buffer, offset + 1);
+			key.component = JpegAccess::ReadUint16(buffer, offset + 3);
+			key.resolution = JpegAccess::ReadUint8(buffer, offset + 5);
+			key.precinct = JpegAccess::ReadUint32(buffer, offset + 6);
+			uint16_t layer = JpegAccess::ReadUint16(buffer, offset + 10);
+			uint32_t size = JpegAccess::ReadUint32(buffer, offset + 12);
+			offset += 16;
+			if (size > length - offset)
+			{
+				return SERVER_INVALID_RESPONSE;
+			}
+			vector<vector<uint8_t> >& bin = bins[key];
+			if (layer > bin.size())
+			{
+				return SERVER_INVALID_RESPONSE;
+			}
+			if (layer == bin.size())
+			{
+				bin.push_back(vector<uint8_t>(buffer + offset, buffer + offset + size));
+			}
+			offset += size;
+		}
+		else
+		{
+			return SERVER_INVALID_RESPONSE;
+		}
+	}
+	return SUCCESS;
+}
+
+ErrorCode PrecinctClient::assemble(J2KFile& file) const
+{
+	// loadHeader peeks past the last marker segment
+	vector<uint8_t> buffer(header);
+	buffer.push_back((uint8_t)(J2KFile::EOC >> 8));
+	buffer.push_back((uint8_t)J2KFile::EOC);
+	ByteCursor cursor(buffer.data(), buffer.size());
+	ErrorCode result = file.loadHeader(cursor);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+
+	file.tiles.clear();
+	bool eph = file.codingStyleDefault.canUseEPHMarker();
+	uint32_t count = PacketIndex::tileCount(file.header);
+	for (uint32_t t = 0; t < count; t++)
+	{
+		TileGeometry geometry;
+		geometry.build(file, (uint16_t)t);
+		TilePart part;
+		part.Isot = (uint16_t)t;
+		part.TPsot = 0;
+		part.TNsot = 1;
+		part.Raw.push_back((uint8_t)(J2KMarkers::SOD >> 8));
+		part.Raw.push_back((uint8_t)J2KMarkers::SOD);
+		BOOST_FOREACH(const PacketEntry& packet, geometry.packetOrder(file, (uint16_t)t))
+		{
+			map<PrecinctKey, vector<vector<uint8_t> > >::const_iterator bin = bins.find(packet.key);
+			if (bin != bins.end() && packet.layer < bin->second.size())
+			{
+				const vector<uint8_t>& data = bin->second[packet.layer];
+				part.Raw.insert(part.Raw.end(), data.begin(), data.end());
+				continue;
+			}
+			// zero length packet (B.10.3)
+			part.Raw.push_back(0);
+			if (eph)
+			{
+				part.Raw.push_back((uint8_t)(J2KMarkers::EPH >> 8));
+				part.Raw.push_back((uint8_t)J2KMarkers::EPH);
+			}
+		}
+		file.tiles.push_back(part);
+	}
+	return SUCCESS;
+}
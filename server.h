@@ -0,0 +1,125 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <boost\cstdint.hpp>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "j2k.h"
+#include "packets.h"
+
+namespace BJPEG
+{
+
+// A view of the image: a window on the reference grid, the number of resolution
+// levels dropped, the number of quality layers wanted (0 = all) and the components
+// wanted. On the wire a fixed part of SIZE bytes ends with the number of component
+// bits (0 = all components), which follow it packed eight to a byte.
+class WindowRequest
+{
+public:
+	static const uint32_t SIZE = 21;
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+	uint8_t reduce;
+	uint16_t layers;
+	// as the components of SIZ, empty for all of them
+	ComponentMask components;
+
+	GridRect rect() const
+	{
+		GridRect result = { x, y, x + width, y + height };
+		return result;
+	}
+
+	// bytes of component bits which follow the fixed part at buffer
+	static uint32_t componentBytes(const uint8_t* buffer)
+	{
+		return (JpegAccess::ReadUint16(buffer, 19) + 7) / 8;
+	}
+
+	// fixed part and component bits
+	void load(const uint8_t* buffer);
+	void save(std::ostream& stream) const;
+};
+
+// What a client already holds: the main header and, per precinct, how many
+// layers of it (always the first ones).
+class ClientModel
+{
+public:
+	bool headerSent;
+	std::map<PrecinctKey, uint16_t> layers;
+
+	ClientModel() : headerSent(false) {}
+};
+
+// Serves the packets of a codestream precinct by precinct, in the manner of JPIP
+// precinct data bins. A response holds only what the model of the client lacks,
+// lowest layers and resolutions first:
+//   u32 length of what follows, then messages
+//   0: u32 length, main header
+//   1: u16 tile, u16 component, u8 resolution, u32 precinct, u16 layer, u32 length, packet
+// The window selects precincts by their own extent, code-blocks whose wavelet
+// support crosses the window edge may come up a little soft until panned to.
+class PrecinctServer
+{
+	class Listener;
+
+	J2KFile file;
+	PacketIndex index;
+	std::vector<TileGeometry> geometries;
+	std::shared_ptr<Listener> listener;
+
+public:
+	static const uint8_t HEADER_MESSAGE = 0;
+	static const uint8_t PACKET_MESSAGE = 1;
+
+	// Packet headers are decoded where the tile parts have no PLT segments.
+	ErrorCode open(const std::string& fileName);
+
+	// Writes the messages for request and records them in model.
+	void respond(const WindowRequest& request, ClientModel& model, std::ostream& stream) const;
+
+	// Accepts clients on the loopback interface, port 0 picks a free one.
+	ErrorCode listen(uint16_t port);
+	uint16_t port() const;
+
+	// Serves the connections until stop(), every one with its own model.
+	void run();
+	void stop();
+};
+
+// Receives precinct data bins and puts them back together into a codestream.
+class PrecinctClient
+{
+	class Connection;
+
+	std::shared_ptr<Connection> connection;
+
+public:
+	std::vector<uint8_t> header;
+	// [precinct][layer] packets
+	std::map<PrecinctKey, std::vector<std::vector<uint8_t> > > bins;
+
+	ErrorCode connect(uint16_t port);
+
+	// Sends request and merges the response; received is the size of the response.
+	ErrorCode request(const WindowRequest& request, uint32_t& received);
+
+	// Merges the messages of a response (without its length).
+	ErrorCode receive(const uint8_t* buffer, uint32_t length);
+
+	// A codestream of one tile part per tile, packets that were not received
+	// are replaced by empty ones.
+	ErrorCode assemble(J2KFile& file) const;
+};
+
+}
+
+#endif /*_SERVER_H_*/
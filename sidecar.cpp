@@ -0,0 +1,409 @@
+#include "sidecar.h"
+#include "packets.h"
+#include "scheduler.h"
+#include <boost\filesystem.hpp>
+#include <algorithm>
+#include <fstream>
+#include <exception>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define BJPEG_SSE2
+#endif
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	void writeRecord(vector<uint8_t>& storage, const TilePartEntry& entry)
+	{
+		for (int shift = 56; shift >= 0; shift -= 8)
+		{
+			storage.push_back((uint8_t)(entry.offset >> shift));
+		}
+		for (int shift = 24; shift >= 0; shift -= 8)
+		{
+			storage.push_back((uint8_t)(entry.length >> shift));
+		}
+		storage.push_back((uint8_t)(entry.Isot >> 8));
+		storage.push_back((uint8_t)entry.Isot);
+		storage.push_back(entry.TPsot);
+		storage.push_back(entry.TNsot);
+	}
+
+	shared_ptr<boost::iostreams::mapped_file_source> mapFile(const string& fileName)
+	{
+		shared_ptr<boost::iostreams::mapped_file_source> mapping(new boost::iostreams::mapped_file_source());
+		try
+		{
+			mapping->open(fileName);
+		}
+		catch (const exception&)
+		{
+			mapping.reset();
+		}
+		return mapping;
+	}
+
+	// marker segments a tile part header may start with, or its SOD
+	bool startsTilePartHeader(uint16_t marker)
+	{
+		switch (marker)
+		{
+			case J2KMarkers::COD:
+			case J2KMarkers::COC:
+			case J2KMarkers::QCD:
+			case J2KMarkers::QCC:
+			case J2KMarkers::RGN:
+			case J2KMarkers::POC:
+			case J2KMarkers::PLT:
+			case J2KMarkers::PPT:
+			case J2KMarkers::COM:
+			case J2KMarkers::SOD:
+				return true;
+		}
+		return false;
+	}
+
+	// Whether the SOT marker at position looks like the start of a tile part of a
+	// codestream with tiles tiles; offsets relative to it, the file may be larger
+	// than an int.
+	bool plausibleTilePart(const uint8_t* buffer, uint64_t length, uint64_t position, uint32_t tiles)
+	{
+		const uint8_t* sot = buffer + position;
+		if (position + 14 > length || !JpegAccess::VerifyReadUint16(sot, 2, TilePart::Lsot))
+		{
+			return false;
+		}
+		uint8_t TPsot = JpegAccess::ReadUint8(sot, 10);
+		uint8_t TNsot = JpegAccess::ReadUint8(sot, 11);
+		return JpegAccess::ReadUint16(sot, 4) < tiles && (TNsot == 0 || TPsot < TNsot) && startsTilePartHeader(JpegAccess::ReadUint16(sot, 12));
+	}
+
+	// scanned by every worker of MarkerScanner::find
+	const uint64_t SCAN_CHUNK = 1 << 22;
+}
+
+void MarkerScanner::find(const uint8_t* buffer, uint64_t length, uint64_t begin, uint64_t end, uint8_t code, vector<uint64_t>& positions)
+{
+	// the second byte has to be within the buffer too
+	end = min(end, length == 0 ? 0 : length - 1);
+	uint64_t i = begin;
+#ifdef BJPEG_SSE2
+	const __m128i prefix = _mm_set1_epi8((char)0xFF);
+	const __m128i suffix = _mm_set1_epi8((char)code);
+	for (; i + 16 <= end; i += 16)
+	{
+		__m128i first = _mm_loadu_si128((const __m128i*)(buffer + i));
+		__m128i second = _mm_loadu_si128((const __m128i*)(buffer + i + 1));
+		int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, prefix), _mm_cmpeq_epi8(second, suffix)));
+		for (int bit = 0; mask != 0; bit++, mask >>= 1)
+		{
+			if (mask & 1)
+			{
+				positions.push_back(i + bit);
+			}
+		}
+	}
+#endif
+	for (; i < end; i++)
+	{
+		if (buffer[i] == 0xFF && buffer[i + 1] == code)
+		{
+			positions.push_back(i);
+		}
+	}
+}
+
+void MarkerScanner::find(const uint8_t* buffer, uint64_t length, uint8_t code, unsigned threads, vector<uint64_t>& positions)
+{
+	size_t chunks = (size_t)((length + SCAN_CHUNK - 1) / SCAN_CHUNK);
+	vector<vector<uint64_t> > found(chunks);
+	{
+		TaskScheduler scheduler(threads);
+		scheduler.parallelFor(0, chunks, 1, [&](size_t i)
+		{
+			find(buffer, length, i * SCAN_CHUNK, (i + 1) * SCAN_CHUNK, code, found[i]);
+		});
+	}
+	BOOST_FOREACH(const vector<uint64_t>& chunk, found)
+	{
+		positions.insert(positions.end(), chunk.begin(), chunk.end());
+	}
+}
+
+TilePartEntry CodestreamIndex::tilePart(uint32_t n) const
+{
+	const uint8_t* record = recordData() + (size_t)n * RECORD_SIZE;
+	TilePartEntry entry;
+	entry.offset = JpegAccess::ReadUint64(record, 0);
+	entry.length = JpegAccess::ReadUint32(record, 8);
+	entry.Isot = JpegAccess::ReadUint16(record, 12);
+	entry.TPsot = JpegAccess::ReadUint8(record, 14);
+	entry.TNsot = JpegAccess::ReadUint8(record, 15);
+	return entry;
+}
+
+ErrorCode CodestreamIndex::build(const uint8_t* buffer, uint64_t length)
+{
+	clear();
+	J2KFile codestream;
+	ByteCursor cursor(buffer, length);
+	ErrorCode result = codestream.loadHeader(cursor);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	mainHeaderLength = (uint32_t)cursor.position();
+	fileSize = length;
+
+	uint32_t tiles = PacketIndex::tileCount(codestream.header);
+	uint64_t position = cursor.position();
+	// read at buffer + position, an int offset would wrap past 2 GB
+	while (position + 12 <= length && JpegAccess::VerifyReadUint16(buffer + position, 0, TilePart::MARKER_ID))
+	{
+		const uint8_t* sot = buffer + position;
+		if (!JpegAccess::VerifyReadUint16(sot, 2, TilePart::Lsot))
+		{
+			return J2K_LSOT_DOESNT_MATCH;
+		}
+		uint64_t Psot = JpegAccess::ReadUint32(sot, 6);
+		if (Psot == 0)
+		{
+			// the last tile part runs up to EOC; producers which write 0 for every
+			// tile part are left to recover()
+			Psot = length - 2 - position;
+			vector<uint64_t> later;
+			MarkerScanner::find(buffer, length, position + 12, length - 2, (uint8_t)TilePart::MARKER_ID, later);
+			BOOST_FOREACH(uint64_t candidate, later)
+			{
+				if (plausibleTilePart(buffer, length, candidate, tiles))
+				{
+					return J2K_SOT_DOESNT_MATCH;
+				}
+			}
+		}
+		if (Psot < 12 || position + Psot > length)
+		{
+			return J2K_SOT_DOESNT_MATCH;
+		}
+		TilePartEntry entry = { position, (uint32_t)Psot, JpegAccess::ReadUint16(sot, 4),
+			JpegAccess::ReadUint8(sot, 10), JpegAccess::ReadUint8(sot, 11) };
+		writeRecord(storage, entry);
+		count++;
+		position += Psot;
+	}
+	if (position + 2 > length || !JpegAccess::VerifyReadUint16(buffer + position, 0, J2KFile::EOC))
+	{
+		return J2K_EOC_DOESNT_MATCH;
+	}
+	return SUCCESS;
+}
+
+ErrorCode CodestreamIndex::recover(const uint8_t* buffer, uint64_t length, unsigned threads)
+{
+	clear();
+	J2KFile codestream;
+	ByteCursor cursor(buffer, length);
+	ErrorCode result = codestream.loadHeader(cursor);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	mainHeaderLength = (uint32_t)cursor.position();
+	fileSize = length;
+
+	vector<uint64_t> candidates;
+	MarkerScanner::find(buffer, length, (uint8_t)TilePart::MARKER_ID, threads, candidates);
+	uint32_t tiles = PacketIndex::tileCount(codestream.header);
+	vector<uint64_t> starts;
+	BOOST_FOREACH(uint64_t position, candidates)
+	{
+		if (position >= cursor.position() && plausibleTilePart(buffer, length, position, tiles))
+		{
+			starts.push_back(position);
+		}
+	}
+	if (starts.empty())
+	{
+		return J2K_SOT_DOESNT_MATCH;
+	}
+
+	uint64_t end = length;
+	if (length >= 2 && JpegAccess::VerifyReadUint16(buffer + length - 2, 0, J2KFile::EOC))
+	{
+		end = length - 2;
+	}
+	for (size_t i = 0; i < starts.size(); i++)
+	{
+		const uint8_t* sot = buffer + starts[i];
+		uint64_t next = i + 1 < starts.size() ? starts[i + 1] : end;
+		if (next - starts[i] > 0xFFFFFFFF)
+		{
+			return J2K_SOT_DOESNT_MATCH;
+		}
+		TilePartEntry entry = { starts[i], (uint32_t)(next - starts[i]), JpegAccess::ReadUint16(sot, 4),
+			JpegAccess::ReadUint8(sot, 10), JpegAccess::ReadUint8(sot, 11) };
+		writeRecord(storage, entry);
+		count++;
+	}
+	return SUCCESS;
+}
+
+ErrorCode CodestreamIndex::load(const uint8_t* buffer, uint64_t length)
+{
+	clear();
+	if (length < HEADER_SIZE || !JpegAccess::VerifyReadUint32(buffer, 0, MARKER_ID))
+	{
+		return SIDECAR_MAGIC_DOESNT_MATCH;
+	}
+	if (!JpegAccess::VerifyReadUint16(buffer, 4, VERSION))
+	{
+		return SIDECAR_VERSION_DOESNT_MATCH;
+	}
+	fileSize = JpegAccess::ReadUint64(buffer, 8);
+	modified = JpegAccess::ReadUint64(buffer, 16);
+	mainHeaderLength = JpegAccess::ReadUint32(buffer, 24);
+	uint32_t tileParts = JpegAccess::ReadUint32(buffer, 28);
+	if (length != HEADER_SIZE + (uint64_t)tileParts * RECORD_SIZE)
+	{
+		return SIDECAR_INVALID_LENGTH;
+	}
+	count = tileParts;
+	records = buffer + HEADER_SIZE;
+	return SUCCESS;
+}
+
+void CodestreamIndex::save(ostream& stream) const
+{
+	JpegAccess::WriteUint32(stream, MARKER_ID);
+	JpegAccess::WriteUint16(stream, VERSION);
+	JpegAccess::WriteUint16(stream, 0);
+	JpegAccess::WriteUint64(stream, fileSize);
+	JpegAccess::WriteUint64(stream, modified);
+	JpegAccess::WriteUint32(stream, mainHeaderLength);
+	JpegAccess::WriteUint32(stream, count);
+	stream.write((const char*)recordData(), (streamsize)count * RECORD_SIZE);
+}
+
+ErrorCode CodestreamIndex::open(const string& codestreamFileName, const uint8_t* buffer, uint64_t length, bool writeSidecar)
+{
+	boost::system::error_code error;
+	time_t time = boost::filesystem::last_write_time(codestreamFileName, error);
+	if (error)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+
+	string sidecar = sidecarName(codestreamFileName);
+	shared_ptr<boost::iostreams::mapped_file_source> mapping = mapFile(sidecar);
+	if (mapping && load((const uint8_t*)mapping->data(), mapping->size()) == SUCCESS &&
+		fileSize == length && modified == (uint64_t)time)
+	{
+		source = mapping;
+		return SUCCESS;
+	}
+	// a stale sidecar may have been loaded, its records point into mapping
+	clear();
+	mapping.reset();
+
+	ErrorCode result = build(buffer, length);
+	if (result != SUCCESS)
+	{
+		result = recover(buffer, length);
+	}
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	modified = (uint64_t)time;
+	if (writeSidecar)
+	{
+		// written aside and renamed, readers never see half a sidecar; a read-only
+		// directory only costs the scan next time
+		string temporary = sidecar + ".tmp";
+		{
+			ofstream output(temporary, ios::binary);
+			if (output)
+			{
+				save(output);
+			}
+		}
+		boost::filesystem::rename(temporary, sidecar, error);
+		if (error)
+		{
+			boost::filesystem::remove(temporary, error);
+		}
+	}
+	return SUCCESS;
+}
+
+ErrorCode IndexedCodestream::loadFile(const string& fileName, bool writeSidecar)
+{
+	// the index of a failed load must not be read against a previous file
+	source.reset();
+	shared_ptr<boost::iostreams::mapped_file_source> mapping = mapFile(fileName);
+	if (!mapping)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	const uint8_t* buffer = (const uint8_t*)mapping->data();
+	ErrorCode result = index.open(fileName, buffer, mapping->size(), writeSidecar);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	ByteCursor cursor(buffer, mapping->size());
+	result = file.loadHeader(cursor);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	if (cursor.position() != index.mainHeaderLength)
+	{
+		return SIDECAR_INVALID_LENGTH;
+	}
+	file.tiles.clear();
+	source = mapping;
+	return SUCCESS;
+}
+
+ErrorCode IndexedCodestream::loadTilePart(uint32_t n, TilePart& tile) const
+{
+	if (!source)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	if (n >= index.tilePartCount())
+	{
+		return SIDECAR_INVALID_LENGTH;
+	}
+	TilePartEntry entry = index.tilePart(n);
+	if (entry.offset + entry.length > source->size())
+	{
+		return SIDECAR_INVALID_LENGTH;
+	}
+	return tile.load(ByteCursor((const uint8_t*)source->data(), source->size(), entry.offset), entry.length);
+}
+
+ErrorCode IndexedCodestream::loadTileParts(TaskScheduler& scheduler)
+{
+	if (!source)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	vector<uint64_t> offsets;
+	vector<uint32_t> lengths;
+	for (uint32_t n = 0; n < index.tilePartCount(); n++)
+	{
+		TilePartEntry entry = index.tilePart(n);
+		if (entry.offset + entry.length > source->size())
+		{
+			return SIDECAR_INVALID_LENGTH;
+		}
+		offsets.push_back(entry.offset);
+		lengths.push_back(entry.length);
+	}
+	return file.loadTileParts(ByteCursor((const uint8_t*)source->data(), source->size()), offsets, lengths, scheduler);
+}
@@ -0,0 +1,138 @@
+#ifndef _SIDECAR_H_
+#define _SIDECAR_H_
+
+#include <boost\cstdint.hpp>
+#include <boost\iostreams\device\mapped_file.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "j2k.h"
+
+namespace BJPEG
+{
+
+class TilePartEntry
+{
+public:
+	// of the SOT marker
+	uint64_t offset;
+	// aka Psot, resolved when it was 0
+	uint32_t length;
+	uint16_t Isot;
+	uint8_t TPsot;
+	uint8_t TNsot;
+};
+
+// Finds markers in a codestream: positions of 0xFF followed by code, compared
+// 16 bytes at a time where SSE2 is available. Entropy coded data never has a byte
+// above 0x8F after 0xFF, so SOT (and SOP where used) only turn up as markers.
+class MarkerScanner
+{
+public:
+	// Appends to positions, in ascending order, the markers starting in [begin, end)
+	// of the buffer of length bytes.
+	static void find(const uint8_t* buffer, uint64_t length, uint64_t begin, uint64_t end, uint8_t code, std::vector<uint64_t>& positions);
+
+	// As find(), split over threads workers (0 - one per hardware thread).
+	static void find(const uint8_t* buffer, uint64_t length, uint8_t code, unsigned threads, std::vector<uint64_t>& positions);
+};
+
+// Where the tile parts of a codestream are, so that opening it does not have to
+// walk every SOT. Saved next to the codestream as <name>.bji, big endian:
+//   "BJ2I", version (2), reserved (2), codestream size (8), modification time (8),
+//   main header length (4), tile part count (4), then 16 byte records of
+//   offset (8), length (4), Isot (2), TPsot (1), TNsot (1).
+// A loaded sidecar stays mapped and records are decoded when asked for, so an
+// open touches the first page only.
+class CodestreamIndex
+{
+	std::shared_ptr<boost::iostreams::mapped_file_source> source;
+	// records of a built index
+	std::vector<uint8_t> storage;
+	// records of a loaded sidecar, NULL for a built index so that copies read their
+	// own storage
+	const uint8_t* records;
+	uint32_t count;
+
+	const uint8_t* recordData() const
+	{
+		return records != NULL ? records : storage.data();
+	}
+
+	// no records, and no mapping left for them to point into
+	void clear()
+	{
+		records = NULL;
+		count = 0;
+		storage.clear();
+		source.reset();
+	}
+
+public:
+	static const uint32_t MARKER_ID = 0x424A3249;
+	static const uint16_t VERSION = 1;
+	static const int HEADER_SIZE = 32;
+	static const int RECORD_SIZE = 16;
+
+	uint64_t fileSize;
+	// seconds since the epoch
+	uint64_t modified;
+	uint32_t mainHeaderLength;
+
+	CodestreamIndex() : records(NULL), count(0), fileSize(0), modified(0), mainHeaderLength(0) {}
+
+	uint32_t tilePartCount() const
+	{
+		return count;
+	}
+
+	TilePartEntry tilePart(uint32_t n) const;
+
+	// Walks the SOT markers of the codestream of length bytes at buffer; only Psot
+	// is looked at inside the tile parts.
+	ErrorCode build(const uint8_t* buffer, uint64_t length);
+
+	// For codestreams build() rejects because of a zero or wrong Psot: the tile
+	// parts are taken from the SOT markers found by a scan of the whole buffer, a
+	// candidate counts when its Lsot, Isot (within the tiles of the header), TPsot
+	// and the marker after it are plausible, and every tile part runs up to the
+	// next one (the last up to EOC or the end of the buffer).
+	ErrorCode recover(const uint8_t* buffer, uint64_t length, unsigned threads = 0);
+
+	// sidecar contents of length bytes, the buffer has to outlive the index
+	ErrorCode load(const uint8_t* buffer, uint64_t length);
+	void save(std::ostream& stream) const;
+
+	static std::string sidecarName(const std::string& codestreamFileName)
+	{
+		return codestreamFileName + ".bji";
+	}
+
+	// The sidecar of the codestream when its size and modification time still
+	// match; otherwise the index is built from the codestream at buffer (recovered
+	// when that fails) and, with writeSidecar, saved for the next open.
+	ErrorCode open(const std::string& codestreamFileName, const uint8_t* buffer, uint64_t length, bool writeSidecar = true);
+};
+
+// Codestream opened through its index: the main header is parsed, tile parts
+// are loaded one at a time from the mapped file when asked for.
+class IndexedCodestream
+{
+	std::shared_ptr<boost::iostreams::mapped_file_source> source;
+
+public:
+	// main header only, tiles stay empty until loadTileParts()
+	J2KFile file;
+	CodestreamIndex index;
+
+	ErrorCode loadFile(const std::string& fileName, bool writeSidecar = true);
+	ErrorCode loadTilePart(uint32_t n, TilePart& tile) const;
+	// All tile parts into file.tiles, parsed in parallel on scheduler at the
+	// offsets of the index.
+	ErrorCode loadTileParts(TaskScheduler& scheduler);
+};
+
+}
+
+#endif /*_SIDECAR_H_*/
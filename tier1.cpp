@@ -0,0 +1,471 @@
+#include "tier1.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	// coefficient state flags
+	const uint8_t SIGNIFICANT = 1;
+	const uint8_t VISITED = 2;
+	const uint8_t REFINED = 4;
+	const uint8_t NEGATIVE = 8;
+
+	// context labels: 0-8 significance, 9-13 sign, 14-16 refinement
+	const int CONTEXT_SIGN = 9;
+	const int CONTEXT_REFINEMENT = 14;
+	const int CONTEXT_RUN = 17;
+	const int CONTEXT_UNIFORM = 18;
+
+	inline int signContribution(uint8_t flag)
+	{
+		if ((flag & SIGNIFICANT) == 0)
+		{
+			return 0;
+		}
+		return (flag & NEGATIVE) != 0 ? -1 : 1;
+	}
+
+	inline int clampContribution(int value)
+	{
+		return value < -1 ? -1 : (value > 1 ? 1 : value);
+	}
+}
+
+// Table C.2
+const MQEncoder::State MQEncoder::states[47] =
+{
+	{ 0x5601,  1,  1, 1 }, { 0x3401,  2,  6, 0 }, { 0x1801,  3,  9, 0 }, { 0x0AC1,  4, 12, 0 },
+	{ 0x0521,  5, 29, 0 }, { 0x0221, 38, 33, 0 }, { 0x5601,  7,  6, 1 }, { 0x5401,  8, 14, 0 },
+	{ 0x4801,  9, 14, 0 }, { 0x3801, 10, 14, 0 }, { 0x3001, 11, 17, 0 }, { 0x2401, 12, 18, 0 },
+	{ 0x1C01, 13, 20, 0 }, { 0x1601, 29, 21, 0 }, { 0x5601, 15, 14, 1 }, { 0x5401, 16, 14, 0 },
+	{ 0x5101, 17, 15, 0 }, { 0x4801, 18, 16, 0 }, { 0x3801, 19, 17, 0 }, { 0x3401, 20, 18, 0 },
+	{ 0x3001, 21, 19, 0 }, { 0x2801, 22, 19, 0 }, { 0x2401, 23, 20, 0 }, { 0x2201, 24, 21, 0 },
+	{ 0x1C01, 25, 22, 0 }, { 0x1801, 26, 23, 0 }, { 0x1601, 27, 24, 0 }, { 0x1401, 28, 25, 0 },
+	{ 0x1201, 29, 26, 0 }, { 0x1101, 30, 27, 0 }, { 0x0AC1, 31, 28, 0 }, { 0x09C1, 32, 29, 0 },
+	{ 0x08A1, 33, 30, 0 }, { 0x0521, 34, 31, 0 }, { 0x0441, 35, 32, 0 }, { 0x02A1, 36, 33, 0 },
+	{ 0x0221, 37, 34, 0 }, { 0x0141, 38, 35, 0 }, { 0x0111, 39, 36, 0 }, { 0x0085, 40, 37, 0 },
+	{ 0x0049, 41, 38, 0 }, { 0x0025, 42, 39, 0 }, { 0x0015, 43, 40, 0 }, { 0x0009, 44, 41, 0 },
+	{ 0x0005, 45, 42, 0 }, { 0x0001, 45, 43, 0 }, { 0x5601, 46, 46, 0 }
+};
+
+void MQEncoder::init()
+{
+	A = 0x8000;
+	C = 0;
+	CT = 12;
+	out.clear();
+	out.push_back(0);
+	resetContexts();
+}
+
+void MQEncoder::resetContexts()
+{
+	// Table D.7
+	fill(index, index + CONTEXTS, 0);
+	fill(mps, mps + CONTEXTS, 0);
+	index[0] = 4;
+	index[CONTEXT_RUN] = 3;
+	index[CONTEXT_UNIFORM] = 46;
+}
+
+void MQEncoder::encode(int bit, int context)
+{
+	const State& state = states[index[context]];
+	A -= state.qe;
+	if (bit == mps[context])
+	{
+		if ((A & 0x8000) != 0)
+		{
+			C += state.qe;
+			return;
+		}
+		if (A < state.qe)
+		{
+			A = state.qe;
+		}
+		else
+		{
+			C += state.qe;
+		}
+		index[context] = state.nmps;
+	}
+	else
+	{
+		if (A < state.qe)
+		{
+			C += state.qe;
+		}
+		else
+		{
+			A = state.qe;
+		}
+		if (state.switchMps)
+		{
+			mps[context] = 1 - mps[context];
+		}
+		index[context] = state.nlps;
+	}
+	renormalize();
+}
+
+void MQEncoder::renormalize()
+{
+	do
+	{
+		A <<= 1;
+		C <<= 1;
+		if (--CT == 0)
+		{
+			byteOut();
+		}
+	} while ((A & 0x8000) == 0);
+}
+
+void MQEncoder::byteOut()
+{
+	if (out.back() == 0xFF)
+	{
+		out.push_back((uint8_t)(C >> 20));
+		C &= 0xFFFFF;
+		CT = 7;
+		return;
+	}
+	if (C >= 0x8000000)
+	{
+		// carry into the pending byte
+		out.back()++;
+		C &= 0x7FFFFFF;
+		if (out.back() == 0xFF)
+		{
+			out.push_back((uint8_t)(C >> 20));
+			C &= 0xFFFFF;
+			CT = 7;
+			return;
+		}
+	}
+	out.push_back((uint8_t)(C >> 19));
+	C &= 0x7FFFF;
+	CT = 8;
+}
+
+void MQEncoder::flush()
+{
+	uint32_t tempC = C + A;
+	C |= 0xFFFF;
+	if (C >= tempC)
+	{
+		C -= 0x8000;
+	}
+	C <<= CT;
+	byteOut();
+	C <<= CT;
+	byteOut();
+	// a segment must not end with 0xFF
+	if (out.size() > 1 && out.back() == 0xFF)
+	{
+		out.pop_back();
+	}
+}
+
+bool CodeBlockEncoder::hasSignificantNeighbour(int x, int y) const
+{
+	const uint8_t* f = &flags[(y + 1) * flagStride + x + 1];
+	return ((f[-1] | f[1] | f[-flagStride] | f[flagStride] |
+		f[-flagStride - 1] | f[-flagStride + 1] | f[flagStride - 1] | f[flagStride + 1]) & SIGNIFICANT) != 0;
+}
+
+// Table D.1
+int CodeBlockEncoder::significanceContext(int x, int y) const
+{
+	const uint8_t* f = &flags[(y + 1) * flagStride + x + 1];
+	int h = (f[-1] & SIGNIFICANT) + (f[1] & SIGNIFICANT);
+	int v = (f[-flagStride] & SIGNIFICANT) + (f[flagStride] & SIGNIFICANT);
+	int d = (f[-flagStride - 1] & SIGNIFICANT) + (f[-flagStride + 1] & SIGNIFICANT) +
+		(f[flagStride - 1] & SIGNIFICANT) + (f[flagStride + 1] & SIGNIFICANT);
+
+	if (orientation == HH)
+	{
+		int hv = h + v;
+		if (d >= 3)
+		{
+			return 8;
+		}
+		if (d == 2)
+		{
+			return hv >= 1 ? 7 : 6;
+		}
+		if (d == 1)
+		{
+			return hv >= 2 ? 5 : (hv == 1 ? 4 : 3);
+		}
+		return hv >= 2 ? 2 : hv;
+	}
+
+	if (orientation == HL)
+	{
+		swap(h, v);
+	}
+	if (h == 2)
+	{
+		return 8;
+	}
+	if (h == 1)
+	{
+		return v >= 1 ? 7 : (d >= 1 ? 6 : 5);
+	}
+	if (v == 2)
+	{
+		return 4;
+	}
+	if (v == 1)
+	{
+		return 3;
+	}
+	return d >= 2 ? 2 : d;
+}
+
+// Table D.3
+void CodeBlockEncoder::encodeSign(int x, int y)
+{
+	const uint8_t* f = &flags[(y + 1) * flagStride + x + 1];
+	int h = clampContribution(signContribution(f[-1]) + signContribution(f[1]));
+	int v = clampContribution(signContribution(f[-flagStride]) + signContribution(f[flagStride]));
+	int flip = 0;
+	if (h < 0 || (h == 0 && v < 0))
+	{
+		h = -h;
+		v = -v;
+		flip = 1;
+	}
+	int context = h == 0 ? CONTEXT_SIGN + (v == 0 ? 0 : 1) : CONTEXT_SIGN + 3 + v;
+	int negative = (f[0] & NEGATIVE) != 0 ? 1 : 0;
+	mq.encode(negative ^ flip, context);
+}
+
+// Distortion bookkeeping assumes mid-point reconstruction of truncated magnitudes;
+// a completely decoded reversible coefficient is exact.
+void CodeBlockEncoder::addSignificanceDistortion(uint32_t magnitude, int plane)
+{
+	double value = ldexp((double)magnitude, -fractionBits);
+	double reconstructed = fractionBits == 0 && plane == 0 ? value : ldexp((magnitude >> (plane + fractionBits)) + 0.5, plane);
+	passDistortion += value * value - (value - reconstructed) * (value - reconstructed);
+}
+
+void CodeBlockEncoder::addRefinementDistortion(uint32_t magnitude, int plane)
+{
+	double value = ldexp((double)magnitude, -fractionBits);
+	double before = ldexp((magnitude >> (plane + 1 + fractionBits)) + 0.5, plane + 1);
+	double after = fractionBits == 0 && plane == 0 ? value : ldexp((magnitude >> (plane + fractionBits)) + 0.5, plane);
+	passDistortion += (value - before) * (value - before) - (value - after) * (value - after);
+}
+
+void CodeBlockEncoder::significancePass(int plane)
+{
+	for (int y0 = 0; y0 < height; y0 += 4)
+	{
+		int yEnd = min(y0 + 4, height);
+		for (int x = 0; x < width; x++)
+		{
+			for (int y = y0; y < yEnd; y++)
+			{
+				uint8_t& flag = flagAt(x, y);
+				if ((flag & SIGNIFICANT) != 0)
+				{
+					continue;
+				}
+				int context = significanceContext(x, y);
+				if (context == 0)
+				{
+					continue;
+				}
+				int bit = (magnitudes[y * width + x] >> (plane + fractionBits)) & 1;
+				mq.encode(bit, context);
+				if (bit)
+				{
+					flag |= SIGNIFICANT;
+					encodeSign(x, y);
+					addSignificanceDistortion(magnitudes[y * width + x], plane);
+				}
+				flag |= VISITED;
+			}
+		}
+	}
+}
+
+void CodeBlockEncoder::refinementPass(int plane)
+{
+	for (int y0 = 0; y0 < height; y0 += 4)
+	{
+		int yEnd = min(y0 + 4, height);
+		for (int x = 0; x < width; x++)
+		{
+			for (int y = y0; y < yEnd; y++)
+			{
+				uint8_t& flag = flagAt(x, y);
+				if ((flag & (SIGNIFICANT | VISITED)) != SIGNIFICANT)
+				{
+					continue;
+				}
+				int context;
+				if ((flag & REFINED) != 0)
+				{
+					context = CONTEXT_REFINEMENT + 2;
+				}
+				else
+				{
+					context = CONTEXT_REFINEMENT + (hasSignificantNeighbour(x, y) ? 1 : 0);
+				}
+				uint32_t magnitude = magnitudes[y * width + x];
+				mq.encode((magnitude >> (plane + fractionBits)) & 1, context);
+				addRefinementDistortion(magnitude, plane);
+				flag |= REFINED;
+			}
+		}
+	}
+}
+
+void CodeBlockEncoder::cleanupPass(int plane)
+{
+	for (int y0 = 0; y0 < height; y0 += 4)
+	{
+		int yEnd = min(y0 + 4, height);
+		for (int x = 0; x < width; x++)
+		{
+			int y = y0;
+			if (yEnd - y0 == 4)
+			{
+				bool runMode = true;
+				for (int k = y0; k < yEnd && runMode; k++)
+				{
+					runMode = (flagAt(x, k) & (SIGNIFICANT | VISITED)) == 0 && !hasSignificantNeighbour(x, k);
+				}
+				if (runMode)
+				{
+					int first = 0;
+					while (first < 4 && ((magnitudes[(y0 + first) * width + x] >> (plane + fractionBits)) & 1) == 0)
+					{
+						first++;
+					}
+					if (first == 4)
+					{
+						mq.encode(0, CONTEXT_RUN);
+						continue;
+					}
+					mq.encode(1, CONTEXT_RUN);
+					mq.encode(first >> 1, CONTEXT_UNIFORM);
+					mq.encode(first & 1, CONTEXT_UNIFORM);
+					y = y0 + first;
+					flagAt(x, y) |= SIGNIFICANT;
+					encodeSign(x, y);
+					addSignificanceDistortion(magnitudes[y * width + x], plane);
+					y++;
+				}
+			}
+
+			for (; y < yEnd; y++)
+			{
+				uint8_t& flag = flagAt(x, y);
+				if ((flag & (SIGNIFICANT | VISITED)) != 0)
+				{
+					continue;
+				}
+				int bit = (magnitudes[y * width + x] >> (plane + fractionBits)) & 1;
+				mq.encode(bit, significanceContext(x, y));
+				if (bit)
+				{
+					flag |= SIGNIFICANT;
+					encodeSign(x, y);
+					addSignificanceDistortion(magnitudes[y * width + x], plane);
+				}
+			}
+		}
+	}
+
+	for (vector<uint8_t>::iterator it = flags.begin(); it != flags.end(); ++it)
+	{
+		*it &= ~VISITED;
+	}
+}
+
+void CodeBlockEncoder::encode(const int32_t* samples, int stride, int width, int height, Orientation orientation,
+	int fractionBits, EncodedCodeBlock& result)
+{
+	this->width = width;
+	this->height = height;
+	this->orientation = orientation;
+	this->fractionBits = fractionBits;
+	flagStride = width + 2;
+	flags.assign((size_t)flagStride * (height + 2), 0);
+	magnitudes.resize((size_t)width * height);
+
+	uint32_t maximum = 0;
+	result.distortion = 0;
+	for (int y = 0; y < height; y++)
+	{
+		const int32_t* row = samples + (size_t)y * stride;
+		for (int x = 0; x < width; x++)
+		{
+			uint32_t magnitude = (uint32_t)abs(row[x]);
+			magnitudes[y * width + x] = magnitude;
+			maximum |= magnitude;
+			if (row[x] < 0)
+			{
+				flagAt(x, y) |= NEGATIVE;
+			}
+			double value = ldexp((double)magnitude, -fractionBits);
+			result.distortion += value * value;
+		}
+	}
+
+	result.bitPlanes = 0;
+	while ((maximum >> fractionBits) >> result.bitPlanes)
+	{
+		result.bitPlanes++;
+	}
+	result.data.clear();
+	result.passLengths.clear();
+	result.passDistortions.clear();
+	if (result.bitPlanes == 0)
+	{
+		return;
+	}
+
+	mq.init();
+	passDistortion = 0;
+	for (int plane = result.bitPlanes - 1; plane >= 0; plane--)
+	{
+		if (plane != result.bitPlanes - 1)
+		{
+			significancePass(plane);
+			result.passLengths.push_back(mq.numBytes());
+			result.passDistortions.push_back(passDistortion);
+			refinementPass(plane);
+			result.passLengths.push_back(mq.numBytes());
+			result.passDistortions.push_back(passDistortion);
+		}
+		cleanupPass(plane);
+		result.passLengths.push_back(mq.numBytes());
+		result.passDistortions.push_back(passDistortion);
+	}
+	mq.flush();
+	result.data.assign(mq.data(), mq.data() + mq.length());
+
+	// A pass ending inside the single codeword segment is decodable from the bytes
+	// finished so far plus what is still held in the coder registers (at most three).
+	// A trailing 0xFF carries nothing the decoder would not pad itself.
+	uint32_t length = mq.length();
+	result.passLengths.back() = length;
+	for (size_t i = result.passLengths.size() - 1; i-- > 0;)
+	{
+		uint32_t rate = min(result.passLengths[i] + 3, result.passLengths[i + 1]);
+		while (rate > 0 && result.data[rate - 1] == 0xFF)
+		{
+			rate--;
+		}
+		result.passLengths[i] = rate;
+	}
+}
@@ -0,0 +1,136 @@
+#ifndef _TIER1_H_
+#define _TIER1_H_
+
+#include <boost\cstdint.hpp>
+#include <vector>
+
+namespace BJPEG
+{
+
+// MQ arithmetic coder of ITU-T T.800 Annex C, encoder side
+class MQEncoder
+{
+public:
+	static const int CONTEXTS = 19;
+
+	MQEncoder()
+	{
+		init();
+	}
+
+	void init();
+	void resetContexts();
+	void encode(int bit, int context);
+	void flush();
+
+	// bytes which can no longer change; what a truncated segment has to keep at least
+	uint32_t numBytes() const
+	{
+		return out.size() > 2 ? (uint32_t)out.size() - 2 : 0;
+	}
+
+	// coded bytes, valid after flush()
+	const uint8_t* data() const
+	{
+		return out.data() + 1;
+	}
+
+	uint32_t length() const
+	{
+		return (uint32_t)out.size() - 1;
+	}
+
+private:
+	struct State
+	{
+		uint16_t qe;
+		uint8_t nmps;
+		uint8_t nlps;
+		uint8_t switchMps;
+	};
+	static const State states[47];
+
+	uint32_t A;
+	uint32_t C;
+	int CT;
+	// out[0] is a scratch byte in front of the segment, the last byte is B
+	std::vector<uint8_t> out;
+	uint8_t index[CONTEXTS];
+	uint8_t mps[CONTEXTS];
+
+	void renormalize();
+	void byteOut();
+};
+
+// Result of coding one code-block
+class EncodedCodeBlock
+{
+public:
+	// magnitude bit-planes actually present in the code-block
+	uint8_t bitPlanes;
+	// one single codeword segment holding all passes
+	std::vector<uint8_t> data;
+	// bytes needed to decode up to and including each pass
+	std::vector<uint32_t> passLengths;
+	// squared error left with nothing decoded, in quantiser steps
+	double distortion;
+	// squared error removed up to and including each pass
+	std::vector<double> passDistortions;
+
+	EncodedCodeBlock() : bitPlanes(0), distortion(0) {}
+
+	uint32_t passes() const
+	{
+		return (uint32_t)passLengths.size();
+	}
+};
+
+// EBCOT tier-1 (Annex D) with the default code-block style: no bypass, no
+// per-pass termination, no context reset, no vertically causal contexts.
+class CodeBlockEncoder
+{
+public:
+	// orientation of the sub-band the code-block belongs to
+	enum Orientation
+	{
+		LL = 0,
+		HL = 1,
+		LH = 2,
+		HH = 3
+	};
+
+	// samples carry fractionBits bits below the quantiser step; those are not
+	// coded, they only sharpen the distortion estimates
+	void encode(const int32_t* samples, int stride, int width, int height, Orientation orientation,
+		int fractionBits, EncodedCodeBlock& result);
+
+private:
+	int width;
+	int height;
+	int flagStride;
+	Orientation orientation;
+	// significance state with a one coefficient border on each side
+	std::vector<uint8_t> flags;
+	std::vector<uint32_t> magnitudes;
+	int fractionBits;
+	double passDistortion;
+	MQEncoder mq;
+
+	uint8_t& flagAt(int x, int y)
+	{
+		return flags[(y + 1) * flagStride + x + 1];
+	}
+
+	int significanceContext(int x, int y) const;
+	bool hasSignificantNeighbour(int x, int y) const;
+	void encodeSign(int x, int y);
+	void addSignificanceDistortion(uint32_t magnitude, int plane);
+	void addRefinementDistortion(uint32_t magnitude, int plane);
+	void significancePass(int plane);
+	void refinementPass(int plane);
+	void cleanupPass(int plane);
+};
+
+}
+
+#endif /*_TIER1_H_*/
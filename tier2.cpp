@@ -0,0 +1,305 @@
+#include "tier2.h"
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	// Parent of every node of a tag tree over width x height leaves, level by level,
+	// leaves first; each level halves the one below. The root has -1.
+	vector<int> treeParents(uint32_t width, uint32_t height)
+	{
+		vector<int> parents;
+		if (width == 0 || height == 0)
+		{
+			return parents;
+		}
+
+		vector<uint32_t> widths(1, width);
+		vector<uint32_t> heights(1, height);
+		while (widths.back() > 1 || heights.back() > 1)
+		{
+			widths.push_back((widths.back() + 1) / 2);
+			heights.push_back((heights.back() + 1) / 2);
+		}
+
+		size_t levelStart = 0;
+		for (size_t level = 0; level < widths.size(); level++)
+		{
+			size_t parentStart = levelStart + widths[level] * heights[level];
+			for (uint32_t y = 0; y < heights[level]; y++)
+			{
+				for (uint32_t x = 0; x < widths[level]; x++)
+				{
+					parents.push_back(level + 1 < widths.size() ? (int)(parentStart + (y / 2) * widths[level + 1] + x / 2) : -1);
+				}
+			}
+			levelStart = parentStart;
+		}
+		return parents;
+	}
+}
+
+void PacketHeaderWriter::byteOut()
+{
+	buffer = (buffer << 8) & 0xFFFF;
+	freeBits = buffer == 0xFF00 ? 7 : 8;
+	out.push_back((uint8_t)(buffer >> 8));
+}
+
+void PacketHeaderWriter::putBit(uint32_t bit)
+{
+	if (freeBits == 0)
+	{
+		byteOut();
+	}
+	freeBits--;
+	buffer |= bit << freeBits;
+}
+
+void PacketHeaderWriter::putBits(uint32_t value, int count)
+{
+	for (int i = count - 1; i >= 0; i--)
+	{
+		putBit((value >> i) & 1);
+	}
+}
+
+void PacketHeaderWriter::putCommaCode(int count)
+{
+	while (count-- > 0)
+	{
+		putBit(1);
+	}
+	putBit(0);
+}
+
+// Table B.4
+void PacketHeaderWriter::putPassCount(uint32_t passes)
+{
+	if (passes == 1)
+	{
+		putBits(0, 1);
+	}
+	else if (passes == 2)
+	{
+		putBits(2, 2);
+	}
+	else if (passes <= 5)
+	{
+		putBits(0xC | (passes - 3), 4);
+	}
+	else if (passes <= 36)
+	{
+		putBits(0x1E0 | (passes - 6), 9);
+	}
+	else
+	{
+		putBits(0xFF80 | (passes - 37), 16);
+	}
+}
+
+void PacketHeaderWriter::flush()
+{
+	byteOut();
+	// a header must not end with 0xFF either
+	if (freeBits == 7)
+	{
+		byteOut();
+	}
+}
+
+void TagTreeEncoder::init(uint32_t width, uint32_t height)
+{
+	vector<int> parents = treeParents(width, height);
+	nodes.resize(parents.size());
+	for (size_t i = 0; i < parents.size(); i++)
+	{
+		nodes[i].value = INFINITE;
+		nodes[i].low = 0;
+		nodes[i].known = false;
+		nodes[i].parent = parents[i];
+	}
+}
+
+void TagTreeEncoder::setValue(uint32_t leaf, int value)
+{
+	int index = (int)leaf;
+	while (index >= 0 && nodes[index].value > value)
+	{
+		nodes[index].value = value;
+		index = nodes[index].parent;
+	}
+}
+
+void TagTreeEncoder::encode(PacketHeaderWriter& writer, uint32_t leaf, int threshold)
+{
+	// walk from the root down to the leaf
+	int path[32];
+	int depth = 0;
+	for (int index = (int)leaf; index >= 0; index = nodes[index].parent)
+	{
+		path[depth++] = index;
+	}
+
+	int low = 0;
+	while (depth > 0)
+	{
+		Node& node = nodes[path[--depth]];
+		if (low > node.low)
+		{
+			node.low = low;
+		}
+		else
+		{
+			low = node.low;
+		}
+
+		while (low < threshold)
+		{
+			if (low >= node.value)
+			{
+				if (!node.known)
+				{
+					writer.putBit(1);
+					node.known = true;
+				}
+				break;
+			}
+			writer.putBit(0);
+			low++;
+		}
+		node.low = low;
+	}
+}
+
+uint32_t PacketHeaderReader::getBit()
+{
+	if (remaining == 0)
+	{
+		bool stuffed = position > 0 && current == 0xFF;
+		if (position < length)
+		{
+			current = data[position];
+		}
+		else
+		{
+			current = 0;
+			overrun = true;
+		}
+		position++;
+		remaining = stuffed ? 7 : 8;
+	}
+	remaining--;
+	return (current >> remaining) & 1;
+}
+
+uint32_t PacketHeaderReader::getBits(int count)
+{
+	uint32_t value = 0;
+	while (count-- > 0)
+	{
+		value = (value << 1) | getBit();
+	}
+	return value;
+}
+
+int PacketHeaderReader::getCommaCode()
+{
+	int count = 0;
+	while (getBit() == 1 && !overrun)
+	{
+		count++;
+	}
+	return count;
+}
+
+// Table B.4
+uint32_t PacketHeaderReader::getPassCount()
+{
+	if (getBit() == 0)
+	{
+		return 1;
+	}
+	if (getBit() == 0)
+	{
+		return 2;
+	}
+	uint32_t value = getBits(2);
+	if (value != 3)
+	{
+		return 3 + value;
+	}
+	value = getBits(5);
+	if (value != 31)
+	{
+		return 6 + value;
+	}
+	return 37 + getBits(7);
+}
+
+size_t PacketHeaderReader::finish()
+{
+	// the writer follows a final 0xFF with one more byte
+	if (position > 0 && current == 0xFF)
+	{
+		position++;
+		overrun |= position > length;
+	}
+	remaining = 0;
+	return position;
+}
+
+void TagTreeDecoder::init(uint32_t width, uint32_t height)
+{
+	vector<int> parents = treeParents(width, height);
+	nodes.resize(parents.size());
+	for (size_t i = 0; i < parents.size(); i++)
+	{
+		nodes[i].value = TagTreeEncoder::INFINITE;
+		nodes[i].low = 0;
+		nodes[i].parent = parents[i];
+	}
+}
+
+bool TagTreeDecoder::decode(PacketHeaderReader& reader, uint32_t leaf, int threshold)
+{
+	int path[32];
+	int depth = 0;
+	for (int index = (int)leaf; index >= 0; index = nodes[index].parent)
+	{
+		path[depth++] = index;
+	}
+
+	int low = 0;
+	while (depth > 0)
+	{
+		Node& node = nodes[path[--depth]];
+		if (low > node.low)
+		{
+			node.low = low;
+		}
+		else
+		{
+			low = node.low;
+		}
+
+		while (low < threshold && low < node.value)
+		{
+			if (reader.getBit() == 1)
+			{
+				node.value = low;
+			}
+			else
+			{
+				low++;
+			}
+			if (reader.hasOverrun())
+			{
+				return false;
+			}
+		}
+		node.low = low;
+	}
+	return nodes[leaf].value < threshold;
+}
@@ -0,0 +1,117 @@
+#ifndef _TIER2_H_
+#define _TIER2_H_
+
+#include <boost\cstdint.hpp>
+#include <vector>
+
+namespace BJPEG
+{
+
+// Packet header bit writer with the bit stuffing of B.10.1: after a 0xFF byte
+// only seven bits go into the next one.
+class PacketHeaderWriter
+{
+	std::vector<uint8_t>& out;
+	uint32_t buffer;
+	int freeBits;
+
+	void byteOut();
+
+public:
+	PacketHeaderWriter(std::vector<uint8_t>& out) : out(out), buffer(0), freeBits(8) {}
+
+	void putBit(uint32_t bit);
+	void putBits(uint32_t value, int count);
+	// comma code of B.10.7.1: count ones followed by a zero
+	void putCommaCode(int count);
+	void putPassCount(uint32_t passes);
+	void flush();
+};
+
+// Reads packet header bits, skipping the stuffed bit after every 0xFF byte.
+// Reading past the end yields zeros and sets overrun().
+class PacketHeaderReader
+{
+	const uint8_t* data;
+	size_t length;
+	size_t position;
+	uint8_t current;
+	int remaining;
+	bool overrun;
+
+public:
+	PacketHeaderReader(const uint8_t* data, size_t length) : data(data), length(length), position(0), current(0),
+		remaining(0), overrun(false) {}
+
+	uint32_t getBit();
+	uint32_t getBits(int count);
+	// number of ones before the first zero (B.10.7.1)
+	int getCommaCode();
+	uint32_t getPassCount();
+
+	// Bytes the header took, including the byte a trailing 0xFF needs after it.
+	size_t finish();
+
+	bool hasOverrun() const
+	{
+		return overrun;
+	}
+};
+
+// Tag tree of B.10.2, encoder side. Every node remembers how far its value has
+// already been signalled, so a leaf can be coded again with a higher threshold
+// (inclusion tag tree, one threshold per layer).
+class TagTreeEncoder
+{
+	struct Node
+	{
+		int parent;
+		int value;
+		int low;
+		bool known;
+	};
+	std::vector<Node> nodes;
+
+public:
+	static const int INFINITE = 0xFFFF;
+
+	TagTreeEncoder() {}
+	TagTreeEncoder(uint32_t width, uint32_t height)
+	{
+		init(width, height);
+	}
+
+	void init(uint32_t width, uint32_t height);
+	void setValue(uint32_t leaf, int value);
+	// signals whether the leaf value is below threshold and, if so, the value itself
+	void encode(PacketHeaderWriter& writer, uint32_t leaf, int threshold);
+};
+
+// Tag tree of B.10.2, decoder side; what was learned about a node stays for later
+// (higher threshold) reads of the same leaf.
+class TagTreeDecoder
+{
+	struct Node
+	{
+		int parent;
+		int value;
+		int low;
+	};
+	std::vector<Node> nodes;
+
+public:
+	TagTreeDecoder() {}
+
+	void init(uint32_t width, uint32_t height);
+	// whether the leaf value is below threshold
+	bool decode(PacketHeaderReader& reader, uint32_t leaf, int threshold);
+	// leaf value, once decode() found it
+	int value(uint32_t leaf) const
+	{
+		return nodes[leaf].value;
+	}
+};
+
+}
+
+#endif /*_TIER2_H_*/
@@ -0,0 +1,671 @@
+#include "validator.h"
+#include "j2k.h"
+#include <boost\iostreams\device\mapped_file.hpp>
+#include <sstream>
+
+using namespace std;
+using namespace BJPEG;
+
+namespace
+{
+	// markers without a segment (A.1.3)
+	inline bool hasNoSegment(uint16_t marker)
+	{
+		return marker >= 0xFF30 && marker <= 0xFF3F;
+	}
+
+	inline bool isDelimiter(uint16_t marker)
+	{
+		return marker == J2KMarkers::SOC || marker == J2KMarkers::SOT || marker == J2KMarkers::SOP ||
+			marker == J2KMarkers::EPH || marker == J2KMarkers::SOD || marker == J2KFile::EOC;
+	}
+
+	string markerName(uint16_t marker)
+	{
+		ostringstream stream;
+		stream << "0x" << hex << uppercase << marker;
+		return stream.str();
+	}
+
+	// Decomposition levels in effect: of a COD, and of COCs per component; unset
+	// values come from the main header (A.6.1 precedence).
+	class CodingLevels
+	{
+		const CodingLevels* fallback;
+		int levels;
+		vector<int> components;
+
+	public:
+		CodingLevels(uint16_t componentCount, const CodingLevels* fallback)
+			: fallback(fallback), levels(-1), components(componentCount, -1) {}
+
+		void setDefault(int value)
+		{
+			levels = value;
+		}
+
+		void setComponent(uint16_t component, int value)
+		{
+			components[component] = value;
+		}
+
+		// -1 without any COD
+		int of(int component) const
+		{
+			if (component >= 0 && components[component] >= 0)
+			{
+				return components[component];
+			}
+			if (levels >= 0)
+			{
+				return levels;
+			}
+			return fallback != NULL ? fallback->of(component) : -1;
+		}
+	};
+
+	// A QCD or QCC, checked once the segments that set its levels are known
+	class PendingQuantization
+	{
+	public:
+		uint64_t offset;
+		uint16_t marker;
+		// -1 for QCD
+		int component;
+		uint8_t style;
+		// after Sqcx
+		uint32_t length;
+	};
+
+	class Validation
+	{
+		const uint8_t* buffer;
+		uint64_t length;
+		size_t maximumIssues;
+		vector<ValidationIssue>& issues;
+		uint16_t Csiz;
+		uint32_t tileCount;
+		bool packedMain;
+
+	public:
+		Validation(const uint8_t* buffer, uint64_t length, size_t maximumIssues, vector<ValidationIssue>& issues)
+			: buffer(buffer), length(length), maximumIssues(maximumIssues), issues(issues), Csiz(0), tileCount(0), packedMain(false) {}
+
+		void run();
+
+	private:
+		void report(ErrorCode code, uint64_t offset, const string& description);
+		bool full() const
+		{
+			return issues.size() >= maximumIssues;
+		}
+		// Csiz < 257 has one byte component indices (A.6.2)
+		uint32_t componentBytes() const
+		{
+			return Csiz < 257 ? 1 : 2;
+		}
+
+		bool checkSize(ByteCursor& cursor);
+		bool checkMainHeader(ByteCursor& cursor, CodingLevels& levels);
+		void checkTileParts(ByteCursor& cursor, const CodingLevels& levels);
+		void checkTilePartHeader(ByteCursor part, bool first, const CodingLevels& main);
+
+		void checkCodingStyle(uint64_t offset, const uint8_t* parameters, ErrorCode code);
+		void checkCod(const uint8_t* segment, uint64_t offset, CodingLevels& levels);
+		void checkCoc(const uint8_t* segment, uint64_t offset, CodingLevels& levels);
+		void addQuantization(const uint8_t* segment, uint64_t offset, vector<PendingQuantization>& pending);
+		void checkQuantization(const vector<PendingQuantization>& pending, const CodingLevels& levels);
+		void checkPlt(const uint8_t* segment, uint64_t offset, uint64_t& packetBytes);
+	};
+
+	void Validation::report(ErrorCode code, uint64_t offset, const string& description)
+	{
+		if (!full())
+		{
+			ValidationIssue issue = { code, offset, description };
+			issues.push_back(issue);
+		}
+	}
+
+	void Validation::run()
+	{
+		ByteCursor cursor(buffer, length);
+		if (cursor.peekMarker() != J2KFile::MARKER_ID)
+		{
+			report(J2K_SOC_DOESNT_MATCH, 0, "no SOC at the start");
+			return;
+		}
+		cursor.skip(2);
+		if (!checkSize(cursor))
+		{
+			return;
+		}
+		CodingLevels levels(Csiz, NULL);
+		if (!checkMainHeader(cursor, levels))
+		{
+			return;
+		}
+		checkTileParts(cursor, levels);
+	}
+
+	bool Validation::checkSize(ByteCursor& cursor)
+	{
+		uint64_t offset = cursor.position();
+		if (cursor.peekMarker() != Header::MARKER_ID)
+		{
+			report(J2K_SIZ_DOESNT_MATCH, offset, "SIZ does not follow SOC");
+			return false;
+		}
+		if (!cursor.hasSegment(38))
+		{
+			report(J2K_SEGMENT_TRUNCATED, offset, "SIZ is cut short");
+			return false;
+		}
+		const uint8_t* p = cursor.current();
+		uint16_t Lsiz = JpegAccess::ReadUint16(p, 2);
+		uint32_t Xsiz = JpegAccess::ReadUint32(p, 6);
+		uint32_t Ysiz = JpegAccess::ReadUint32(p, 10);
+		uint32_t XOsiz = JpegAccess::ReadUint32(p, 14);
+		uint32_t YOsiz = JpegAccess::ReadUint32(p, 18);
+		uint32_t XTsiz = JpegAccess::ReadUint32(p, 22);
+		uint32_t YTsiz = JpegAccess::ReadUint32(p, 26);
+		uint32_t XTOsiz = JpegAccess::ReadUint32(p, 30);
+		uint32_t YTOsiz = JpegAccess::ReadUint32(p, 34);
+		Csiz = JpegAccess::ReadUint16(p, 38);
+		if (Csiz == 0 || Csiz > 16384 || Lsiz != 38 + 3 * (uint32_t)Csiz)
+		{
+			ostringstream stream;
+			stream << "Lsiz " << Lsiz << " with Csiz " << Csiz;
+			report(J2K_SIZ_DOESNT_MATCH, offset, stream.str());
+			return false;
+		}
+		// B.3, the tile grid has to cover the image from its first tile on
+		if (XOsiz >= Xsiz || YOsiz >= Ysiz || XTsiz == 0 || YTsiz == 0 || XTOsiz > XOsiz || YTOsiz > YOsiz ||
+			(uint64_t)XTOsiz + XTsiz <= XOsiz || (uint64_t)YTOsiz + YTsiz <= YOsiz)
+		{
+			report(J2K_SIZ_DOESNT_MATCH, offset, "image or tile grid out of range");
+			return false;
+		}
+		for (uint16_t c = 0; c < Csiz; c++)
+		{
+			const uint8_t* component = p + 40 + 3 * c;
+			if ((component[0] & 0x7F) > 37 || component[1] == 0 || component[2] == 0)
+			{
+				ostringstream stream;
+				stream << "component " << c << " has an invalid depth or subsampling";
+				report(J2K_SIZ_DOESNT_MATCH, offset, stream.str());
+			}
+		}
+		uint64_t tilesWide = (Xsiz - XTOsiz + (uint64_t)XTsiz - 1) / XTsiz;
+		uint64_t tilesHigh = (Ysiz - YTOsiz + (uint64_t)YTsiz - 1) / YTsiz;
+		if (tilesWide * tilesHigh > 65535)
+		{
+			report(J2K_SIZ_DOESNT_MATCH, offset, "more than 65535 tiles");
+			return false;
+		}
+		tileCount = (uint32_t)(tilesWide * tilesHigh);
+		cursor.skip(cursor.segmentSize());
+		return true;
+	}
+
+	bool Validation::checkMainHeader(ByteCursor& cursor, CodingLevels& levels)
+	{
+		vector<PendingQuantization> pending;
+		bool coding = false;
+		bool quantization = false;
+		while (!full())
+		{
+			uint64_t offset = cursor.position();
+			uint16_t marker = cursor.peekMarker();
+			if (!cursor.has(2))
+			{
+				report(J2K_SEGMENT_TRUNCATED, offset, "the codestream ends in the main header");
+				return false;
+			}
+			if (marker == TilePart::MARKER_ID || marker == J2KFile::EOC)
+			{
+				break;
+			}
+			if (hasNoSegment(marker))
+			{
+				cursor.skip(2);
+				continue;
+			}
+			if ((marker >> 8) != 0xFF || isDelimiter(marker))
+			{
+				report(J2K_MARKER_UNEXPECTED, offset, "no marker segment at " + markerName(marker));
+				return false;
+			}
+			if (!cursor.hasSegment(2))
+			{
+				report(J2K_SEGMENT_TRUNCATED, offset, markerName(marker) + " runs past the end");
+				return false;
+			}
+			const uint8_t* segment = cursor.current();
+			switch (marker)
+			{
+				case J2KMarkers::COD:
+					if (coding)
+					{
+						report(J2K_COD_DOESNT_MATCH, offset, "second COD in the main header");
+					}
+					coding = true;
+					checkCod(segment, offset, levels);
+					break;
+				case J2KMarkers::COC:
+					checkCoc(segment, offset, levels);
+					break;
+				case J2KMarkers::QCD:
+					if (quantization)
+					{
+						report(J2K_QCD_DOESNT_MATCH, offset, "second QCD in the main header");
+					}
+					quantization = true;
+					addQuantization(segment, offset, pending);
+					break;
+				case J2KMarkers::QCC:
+					addQuantization(segment, offset, pending);
+					break;
+				case J2KMarkers::PPM:
+					packedMain = true;
+					break;
+				case J2KMarkers::SIZ:
+				case J2KMarkers::PLT:
+				case J2KMarkers::PPT:
+					report(J2K_MARKER_UNEXPECTED, offset, markerName(marker) + " in the main header");
+					break;
+			}
+			cursor.skip(cursor.segmentSize());
+		}
+
+		if (!coding)
+		{
+			report(J2K_COD_DOESNT_MATCH, cursor.position(), "no COD in the main header");
+		}
+		if (!quantization)
+		{
+			report(J2K_QCD_DOESNT_MATCH, cursor.position(), "no QCD in the main header");
+		}
+		checkQuantization(pending, levels);
+		return !full();
+	}
+
+	void Validation::checkTileParts(ByteCursor& cursor, const CodingLevels& levels)
+	{
+		// per tile: tile parts seen and TNsot, 0 while unknown
+		vector<uint16_t> parts(tileCount, 0);
+		vector<uint8_t> partCounts(tileCount, 0);
+		while (cursor.peekMarker() == TilePart::MARKER_ID && !full())
+		{
+			uint64_t offset = cursor.position();
+			if (!cursor.has(12))
+			{
+				report(J2K_SEGMENT_TRUNCATED, offset, "SOT is cut short");
+				return;
+			}
+			const uint8_t* sot = cursor.current();
+			if (!JpegAccess::VerifyReadUint16(sot, 2, TilePart::Lsot))
+			{
+				report(J2K_LSOT_DOESNT_MATCH, offset, "Lsot is not 10");
+				return;
+			}
+			uint16_t Isot = JpegAccess::ReadUint16(sot, 4);
+			uint32_t Psot = JpegAccess::ReadUint32(sot, 6);
+			uint8_t TPsot = JpegAccess::ReadUint8(sot, 10);
+			uint8_t TNsot = JpegAccess::ReadUint8(sot, 11);
+			// 0 - the last tile part, up to EOC
+			uint64_t partLength = Psot != 0 ? Psot : (cursor.remaining() >= 2 ? cursor.remaining() - 2 : 0);
+			if (partLength < 14)
+			{
+				ostringstream stream;
+				stream << "Psot " << Psot << " leaves no room for SOT and SOD";
+				report(J2K_SOT_DOESNT_MATCH, offset, stream.str());
+				return;
+			}
+			if (!cursor.has(partLength))
+			{
+				ostringstream stream;
+				stream << "Psot " << Psot << " runs " << partLength - cursor.remaining() << " bytes past the end";
+				report(J2K_SEGMENT_TRUNCATED, offset, stream.str());
+				return;
+			}
+
+			if (Isot >= tileCount)
+			{
+				ostringstream stream;
+				stream << "Isot " << Isot << " outside the grid of " << tileCount << " tiles";
+				report(J2K_SOT_DOESNT_MATCH, offset, stream.str());
+			}
+			else
+			{
+				if (TPsot != parts[Isot])
+				{
+					ostringstream stream;
+					stream << "tile " << Isot << ": TPsot " << (int)TPsot << " where " << parts[Isot] << " comes next";
+					report(J2K_SOT_DOESNT_MATCH, offset, stream.str());
+				}
+				parts[Isot]++;
+				if (TNsot != 0)
+				{
+					if (partCounts[Isot] != 0 && partCounts[Isot] != TNsot)
+					{
+						ostringstream stream;
+						stream << "tile " << Isot << ": TNsot " << (int)TNsot << " after " << (int)partCounts[Isot];
+						report(J2K_SOT_DOESNT_MATCH, offset, stream.str());
+					}
+					partCounts[Isot] = TNsot;
+				}
+			}
+			checkTilePartHeader(cursor.window(partLength), TPsot == 0, levels);
+			cursor.skip(partLength);
+			if (Psot == 0)
+			{
+				break;
+			}
+		}
+
+		uint32_t missing = 0;
+		for (uint32_t t = 0; t < tileCount; t++)
+		{
+			if (parts[t] == 0)
+			{
+				missing++;
+			}
+			else if (partCounts[t] != 0 && parts[t] != partCounts[t])
+			{
+				ostringstream stream;
+				stream << "tile " << t << " has " << parts[t] << " of " << (int)partCounts[t] << " tile parts";
+				report(J2K_SOT_DOESNT_MATCH, cursor.position(), stream.str());
+			}
+		}
+		if (missing > 0)
+		{
+			ostringstream stream;
+			stream << missing << " of " << tileCount << " tiles have no tile part";
+			report(J2K_SOT_DOESNT_MATCH, cursor.position(), stream.str());
+		}
+
+		if (full())
+		{
+			return;
+		}
+		if (cursor.peekMarker() != J2KFile::EOC)
+		{
+			report(J2K_EOC_DOESNT_MATCH, cursor.position(), "no EOC after the last tile part");
+		}
+		else if (cursor.remaining() > 2)
+		{
+			ostringstream stream;
+			stream << cursor.remaining() - 2 << " bytes after EOC";
+			report(J2K_EOC_DOESNT_MATCH, cursor.position(), stream.str());
+		}
+	}
+
+	void Validation::checkTilePartHeader(ByteCursor part, bool first, const CodingLevels& main)
+	{
+		CodingLevels levels(Csiz, &main);
+		vector<PendingQuantization> pending;
+		bool lengths = false;
+		uint64_t packetBytes = 0;
+		part.skip(12);
+		while (!full())
+		{
+			uint64_t offset = part.position();
+			uint16_t marker = part.peekMarker();
+			if (marker == J2KMarkers::SOD)
+			{
+				break;
+			}
+			if (!part.has(2) || (marker >> 8) != 0xFF || isDelimiter(marker) || hasNoSegment(marker))
+			{
+				report(J2K_SOD_DOESNT_MATCH, offset, "no SOD after the tile part header");
+				return;
+			}
+			if (!part.hasSegment(2))
+			{
+				report(J2K_SEGMENT_TRUNCATED, offset, markerName(marker) + " runs past Psot");
+				return;
+			}
+			const uint8_t* segment = part.current();
+			switch (marker)
+			{
+				case J2KMarkers::COD:
+				case J2KMarkers::COC:
+				case J2KMarkers::QCD:
+				case J2KMarkers::QCC:
+				case J2KMarkers::RGN:
+					// Table A.2
+					if (!first)
+					{
+						report(J2K_MARKER_UNEXPECTED, offset, markerName(marker) + " after the first tile part of its tile");
+					}
+					if (marker == J2KMarkers::COD)
+					{
+						checkCod(segment, offset, levels);
+					}
+					else if (marker == J2KMarkers::COC)
+					{
+						checkCoc(segment, offset, levels);
+					}
+					else if (marker != J2KMarkers::RGN)
+					{
+						addQuantization(segment, offset, pending);
+					}
+					break;
+				case J2KMarkers::PPT:
+					if (packedMain)
+					{
+						report(J2K_PPT_DOESNT_MATCH, offset, "PPT with PPM in the main header");
+					}
+					break;
+				case J2KMarkers::PLT:
+					lengths = true;
+					checkPlt(segment, offset, packetBytes);
+					break;
+				case J2KMarkers::POC:
+				case J2KMarkers::COM:
+					break;
+				default:
+					report(J2K_MARKER_UNEXPECTED, offset, markerName(marker) + " in a tile part header");
+					break;
+			}
+			part.skip(part.segmentSize());
+		}
+		checkQuantization(pending, levels);
+
+		uint64_t data = part.remaining() - 2;
+		if (lengths && packetBytes != data)
+		{
+			ostringstream stream;
+			stream << "PLT lengths add up to " << packetBytes << ", the tile part has " << data;
+			report(J2K_PLT_DOESNT_MATCH, part.position(), stream.str());
+		}
+	}
+
+	// SPcod / SPcoc: levels, code-block width and height, style, transformation
+	void Validation::checkCodingStyle(uint64_t offset, const uint8_t* parameters, ErrorCode code)
+	{
+		if (parameters[0] > 32)
+		{
+			report(code, offset, "more than 32 decomposition levels");
+		}
+		if (parameters[1] > 8 || parameters[2] > 8 || parameters[1] + parameters[2] > 8)
+		{
+			report(code, offset, "code-block larger than 4096 samples");
+		}
+		if (parameters[4] > 1)
+		{
+			report(code, offset, "unknown wavelet transformation");
+		}
+	}
+
+	void Validation::checkCod(const uint8_t* segment, uint64_t offset, CodingLevels& levels)
+	{
+		uint16_t Lcod = JpegAccess::ReadUint16(segment, 2);
+		if (Lcod < 12)
+		{
+			report(J2K_COD_DOESNT_MATCH, offset, "COD is cut short");
+			return;
+		}
+		uint8_t Scod = segment[4];
+		uint8_t decompositionLevels = segment[9];
+		uint32_t expected = 12 + ((Scod & 1) != 0 ? decompositionLevels + 1 : 0);
+		if (Lcod != expected)
+		{
+			ostringstream stream;
+			stream << "Lcod " << Lcod << " where " << expected << " is expected";
+			report(J2K_COD_DOESNT_MATCH, offset, stream.str());
+		}
+		if (segment[5] > 4)
+		{
+			report(J2K_COD_DOESNT_MATCH, offset, "unknown progression order");
+		}
+		if (JpegAccess::ReadUint16(segment, 6) == 0)
+		{
+			report(J2K_COD_DOESNT_MATCH, offset, "no quality layers");
+		}
+		checkCodingStyle(offset, segment + 9, J2K_COD_DOESNT_MATCH);
+		levels.setDefault(decompositionLevels);
+	}
+
+	void Validation::checkCoc(const uint8_t* segment, uint64_t offset, CodingLevels& levels)
+	{
+		uint16_t Lcoc = JpegAccess::ReadUint16(segment, 2);
+		uint32_t bytes = componentBytes();
+		if (Lcoc < 8 + bytes)
+		{
+			report(J2K_COC_DOESNT_MATCH, offset, "COC is cut short");
+			return;
+		}
+		uint16_t component = bytes == 1 ? segment[4] : JpegAccess::ReadUint16(segment, 4);
+		uint8_t Scoc = segment[4 + bytes];
+		const uint8_t* parameters = segment + 5 + bytes;
+		uint32_t expected = 8 + bytes + ((Scoc & 1) != 0 ? parameters[0] + 1 : 0);
+		if (Lcoc != expected)
+		{
+			ostringstream stream;
+			stream << "Lcoc " << Lcoc << " where " << expected << " is expected";
+			report(J2K_COC_DOESNT_MATCH, offset, stream.str());
+		}
+		if (component >= Csiz)
+		{
+			report(J2K_COC_DOESNT_MATCH, offset, "component outside SIZ");
+			return;
+		}
+		checkCodingStyle(offset, parameters, J2K_COC_DOESNT_MATCH);
+		levels.setComponent(component, parameters[0]);
+	}
+
+	void Validation::addQuantization(const uint8_t* segment, uint64_t offset, vector<PendingQuantization>& pending)
+	{
+		PendingQuantization quantization;
+		quantization.offset = offset;
+		quantization.marker = JpegAccess::ReadUint16(segment, 0);
+		uint16_t L = JpegAccess::ReadUint16(segment, 2);
+		uint32_t bytes = quantization.marker == J2KMarkers::QCC ? componentBytes() : 0;
+		ErrorCode code = bytes == 0 ? J2K_QCD_DOESNT_MATCH : J2K_QCC_DOESNT_MATCH;
+		if (L < 3 + bytes)
+		{
+			report(code, offset, markerName(quantization.marker) + " is cut short");
+			return;
+		}
+		quantization.component = bytes == 0 ? -1 : (bytes == 1 ? segment[4] : JpegAccess::ReadUint16(segment, 4));
+		if (quantization.component >= Csiz)
+		{
+			report(code, offset, "component outside SIZ");
+			return;
+		}
+		quantization.style = segment[4 + bytes] & 0x1F;
+		quantization.length = L - 3 - bytes;
+		pending.push_back(quantization);
+	}
+
+	// A.6.4: one exponent byte per sub-band, one 16 bit value in all, or one per sub-band
+	void Validation::checkQuantization(const vector<PendingQuantization>& pending, const CodingLevels& levels)
+	{
+		BOOST_FOREACH(const PendingQuantization& quantization, pending)
+		{
+			ErrorCode code = quantization.component < 0 ? J2K_QCD_DOESNT_MATCH : J2K_QCC_DOESNT_MATCH;
+			int decompositionLevels = levels.of(quantization.component);
+			if (decompositionLevels < 0)
+			{
+				continue;
+			}
+			uint32_t bands = 1 + 3 * decompositionLevels;
+			uint32_t expected;
+			switch (quantization.style)
+			{
+				case 0:
+					expected = bands;
+					break;
+				case 1:
+					expected = 2;
+					break;
+				case 2:
+					expected = 2 * bands;
+					break;
+				default:
+					report(code, quantization.offset, "unknown quantization style");
+					continue;
+			}
+			if (quantization.length != expected)
+			{
+				ostringstream stream;
+				stream << markerName(quantization.marker) << " holds " << quantization.length << " bytes of step sizes where "
+					<< decompositionLevels << " levels take " << expected;
+				report(code, quantization.offset, stream.str());
+			}
+		}
+	}
+
+	void Validation::checkPlt(const uint8_t* segment, uint64_t offset, uint64_t& packetBytes)
+	{
+		uint16_t Lplt = JpegAccess::ReadUint16(segment, 2);
+		if (Lplt < 4)
+		{
+			report(J2K_PLT_DOESNT_MATCH, offset, "PLT without packet lengths");
+			return;
+		}
+		uint32_t value = 0;
+		for (uint32_t i = 5; i < 2u + Lplt; i++)
+		{
+			if (value > 0x1FFFFFF)
+			{
+				report(J2K_PLT_DOESNT_MATCH, offset, "packet length over 32 bits");
+				return;
+			}
+			value = (value << 7) | (segment[i] & 0x7F);
+			if ((segment[i] & 0x80) == 0)
+			{
+				packetBytes += value;
+				value = 0;
+			}
+		}
+		if ((segment[Lplt + 1] & 0x80) != 0)
+		{
+			report(J2K_PLT_DOESNT_MATCH, offset, "last packet length is unterminated");
+		}
+	}
+}
+
+ErrorCode CodestreamValidator::validate(const uint8_t* buffer, uint64_t length, vector<ValidationIssue>& issues, size_t maximumIssues)
+{
+	size_t first = issues.size();
+	Validation validation(buffer, length, first + maximumIssues, issues);
+	validation.run();
+	return issues.size() > first ? issues[first].code : SUCCESS;
+}
+
+ErrorCode CodestreamValidator::validateFile(const string& fileName, vector<ValidationIssue>& issues, size_t maximumIssues)
+{
+	boost::iostreams::mapped_file_source mapping;
+	try
+	{
+		mapping.open(fileName);
+	}
+	catch (const exception&)
+	{
+		return FILE_CANNOT_OPEN;
+	}
+	return validate((const uint8_t*)mapping.data(), mapping.size(), issues, maximumIssues);
+}
@@ -0,0 +1,45 @@
+#ifndef _VALIDATOR_H_
+#define _VALIDATOR_H_
+
+#include <boost\cstdint.hpp>
+#include <string>
+#include <vector>
+#include "common.h"
+
+namespace BJPEG
+{
+
+// A conformance problem: its error, the offset of the marker it was found at
+// (from the start of the codestream) and what exactly is wrong.
+class ValidationIssue
+{
+public:
+	ErrorCode code;
+	uint64_t offset;
+	std::string description;
+};
+
+// Checks the structure of a codestream without loading it: marker order, segment
+// lengths against their contents (SIZ, COD, COC, QCD, QCC, PLT), the Psot chain,
+// tile indices and tile part numbering against the tile grid of SIZ, and the PLT
+// lengths of every tile part against its data. Only marker segments are read and
+// tile data is stepped over by Psot, so nothing is copied and the cost is close
+// to that of paging the headers in.
+class CodestreamValidator
+{
+public:
+	static const size_t MAXIMUM_ISSUES = 100;
+
+	// Appends the problems of the codestream of length bytes at buffer to issues,
+	// at most maximumIssues of them. Returns SUCCESS or the code of the first one.
+	static ErrorCode validate(const uint8_t* buffer, uint64_t length, std::vector<ValidationIssue>& issues,
+		size_t maximumIssues = MAXIMUM_ISSUES);
+
+	// As validate(), on the mapped file.
+	static ErrorCode validateFile(const std::string& fileName, std::vector<ValidationIssue>& issues,
+		size_t maximumIssues = MAXIMUM_ISSUES);
+};
+
+}
+
+#endif /*_VALIDATOR_H_*/